@@ -6,34 +6,69 @@
 #include <cstdlib>
 #include <cstdint>
 #include <algorithm>
+#include <future>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
 #include "bst.h"
 
 struct KeyError { };
 
+/**
+* The number of nodes in the subtree rooted at a node, kept by AVLNodes of
+* trees with order statistics enabled. The disabled specialization is empty,
+* so other nodes carry no extra storage, and its accessors do nothing.
+*/
+template <bool Enabled>
+class SubtreeSize
+{
+public:
+    SubtreeSize() : size_(1) {}
+
+    std::size_t getSize() const { return size_; }
+    void setSize(std::size_t size) { size_ = size; }
+
+protected:
+    std::size_t size_;
+};
+
+template <>
+class SubtreeSize<false>
+{
+public:
+    std::size_t getSize() const { return 0; }
+    void setSize(std::size_t size) {}
+};
+
 /**
 * A special kind of node for an AVL tree, which adds the balance as a data member, plus
 * other additional helper functions. You do NOT need to implement any functionality or
 * add additional data members or helper functions.
+* With OrderStatistics set, the node also knows the size of its subtree.
 */
-template <typename Key, typename Value>
-class AVLNode : public Node<Key, Value>
+template <typename Key, typename Value, bool OrderStatistics = false>
+class AVLNode : public Node<Key, Value>, public SubtreeSize<OrderStatistics>
 {
 public:
     // Constructor/destructor.
-    AVLNode(const Key& key, const Value& value, AVLNode<Key, Value>* parent);
-    virtual ~AVLNode();
+    AVLNode(const Key& key, const Value& value, AVLNode<Key, Value, OrderStatistics>* parent);
+    template<typename K, typename V>
+    AVLNode(K&& key, V&& value, AVLNode<Key, Value, OrderStatistics>* parent);
+    ~AVLNode();
 
     // Getter/setter for the node's height.
     int8_t getBalance () const;
     void setBalance (int8_t balance);
     void updateBalance(int8_t diff);
 
-    // Getters for parent, left, and right. These need to be redefined since they
+    // Getters for parent, left, and right. These hide the Node versions since they
     // return pointers to AVLNodes - not plain Nodes. See the Node class in bst.h
     // for more information.
-    virtual AVLNode<Key, Value>* getParent() const override;
-    virtual AVLNode<Key, Value>* getLeft() const override;
-    virtual AVLNode<Key, Value>* getRight() const override;
+    AVLNode<Key, Value, OrderStatistics>* getParent() const;
+    AVLNode<Key, Value, OrderStatistics>* getLeft() const;
+    AVLNode<Key, Value, OrderStatistics>* getRight() const;
 
 protected:
     int8_t balance_;    // effectively a signed char
@@ -50,18 +85,29 @@ protected:
 /**
 * An explicit constructor to initialize the elements by calling the base class constructor
 */
-template<class Key, class Value>
-AVLNode<Key, Value>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value> *parent) :
+template<class Key, class Value, bool OrderStatistics>
+AVLNode<Key, Value, OrderStatistics>::AVLNode(const Key& key, const Value& value, AVLNode<Key, Value, OrderStatistics> *parent) :
     Node<Key, Value>(key, value, parent), balance_(0)
 {
 
 }
 
+/**
+* Forwarding constructor, so keys and values can be moved into the node.
+*/
+template<class Key, class Value, bool OrderStatistics>
+template<typename K, typename V>
+AVLNode<Key, Value, OrderStatistics>::AVLNode(K&& key, V&& value, AVLNode<Key, Value, OrderStatistics> *parent) :
+    Node<Key, Value>(std::forward<K>(key), std::forward<V>(value), parent), balance_(0)
+{
+
+}
+
 /**
 * A destructor which does nothing.
 */
-template<class Key, class Value>
-AVLNode<Key, Value>::~AVLNode()
+template<class Key, class Value, bool OrderStatistics>
+AVLNode<Key, Value, OrderStatistics>::~AVLNode()
 {
 
 }
@@ -69,8 +115,8 @@ AVLNode<Key, Value>::~AVLNode()
 /**
 * A getter for the balance of a AVLNode.
 */
-template<class Key, class Value>
-int8_t AVLNode<Key, Value>::getBalance() const
+template<class Key, class Value, bool OrderStatistics>
+int8_t AVLNode<Key, Value, OrderStatistics>::getBalance() const
 {
     return balance_;
 }
@@ -78,8 +124,8 @@ int8_t AVLNode<Key, Value>::getBalance() const
 /**
 * A setter for the balance of a AVLNode.
 */
-template<class Key, class Value>
-void AVLNode<Key, Value>::setBalance(int8_t balance)
+template<class Key, class Value, bool OrderStatistics>
+void AVLNode<Key, Value, OrderStatistics>::setBalance(int8_t balance)
 {
     balance_ = balance;
 }
@@ -87,36 +133,36 @@ void AVLNode<Key, Value>::setBalance(int8_t balance)
 /**
 * Adds diff to the balance of a AVLNode.
 */
-template<class Key, class Value>
-void AVLNode<Key, Value>::updateBalance(int8_t diff)
+template<class Key, class Value, bool OrderStatistics>
+void AVLNode<Key, Value, OrderStatistics>::updateBalance(int8_t diff)
 {
     balance_ += diff;
 }
 
 /**
-* An overridden function for getting the parent since a static_cast is necessary to make sure
-* that our node is a AVLNode.
+* A getter for the parent, with a static_cast since every node in an AVLTree
+* is an AVLNode.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getParent() const
+template<class Key, class Value, bool OrderStatistics>
+AVLNode<Key, Value, OrderStatistics> *AVLNode<Key, Value, OrderStatistics>::getParent() const
 {
     return static_cast<AVLNode*>(this->parent_);
 }
 
 /**
-* Overridden for the same reasons as above.
+* Redeclared for the same reasons as above.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getLeft() const
+template<class Key, class Value, bool OrderStatistics>
+AVLNode<Key, Value, OrderStatistics> *AVLNode<Key, Value, OrderStatistics>::getLeft() const
 {
     return static_cast<AVLNode*>(this->left_);
 }
 
 /**
-* Overridden for the same reasons as above.
+* Redeclared for the same reasons as above.
 */
-template<class Key, class Value>
-AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
+template<class Key, class Value, bool OrderStatistics>
+AVLNode<Key, Value, OrderStatistics> *AVLNode<Key, Value, OrderStatistics>::getRight() const
 {
     return static_cast<AVLNode*>(this->right_);
 }
@@ -129,310 +175,387 @@ AVLNode<Key, Value> *AVLNode<Key, Value>::getRight() const
 */
 
 
-template <class Key, class Value>
-class AVLTree : public BinarySearchTree<Key, Value>
+template <class Key, class Value, bool OrderStatistics = false, class Compare = std::less<Key> >
+class AVLTree : public BinarySearchTree<Key, Value, Compare>
 {
 public:
+    AVLTree();
+    template<typename InputIt>
+    AVLTree(InputIt first, InputIt last);
+    AVLTree(AVLTree&& other);
+    AVLTree& operator=(AVLTree&& other);
+    virtual ~AVLTree();
+
     void insert (const std::pair<const Key, Value> &new_item) override;
-    void remove(const Key& key) override;  // TODO
 
     virtual void insert(const Key& k, const Value& v);
 
-    void print_placeholders(std::ios::fmtflags origCoutState, std::map<Key, uint8_t> valuePlaceholders) const override;
-
-    //todo: remove public helper
-    int calcBalance(const Key& node);
+    void print_placeholders(std::ios::fmtflags origCoutState, std::map<Key, uint8_t, Compare> valuePlaceholders) const override;
+
+    // Order statistics, O(log n) each. Only available on an
+    // AVLTree<Key, Value, true>, whose nodes know their subtree sizes.
+    // rank() is the number of keys less than key, select() returns the
+    // item with index i in key order (0 is the smallest) or end().
+    std::size_t rank(const Key& key) const;
+    typename BinarySearchTree<Key, Value, Compare>::iterator select(std::size_t i);
+    typename BinarySearchTree<Key, Value, Compare>::const_iterator select(std::size_t i) const;
+    std::size_t count_range(const Key& a, const Key& b) const;
+
+    // Split and join, O(log n) each. Nodes are relinked, never copied, so
+    // the resulting trees keep the storage of the trees they came from
+    // alive, but each allocates new nodes from an arena of its own.
+    // split() returns the items with keys less than key and the rest,
+    // leaving this tree empty. join() builds a tree out of left, pivot and
+    // right, whose keys must be in that order (std::invalid_argument
+    // otherwise), leaving left and right empty. The two-tree join()
+    // concatenates, using the smallest item of right as the pivot.
+    std::pair<AVLTree, AVLTree> split(const Key& key);
+    static AVLTree join(AVLTree& left, const std::pair<const Key, Value>& pivot, AVLTree& right);
+    static AVLTree join(AVLTree& left, AVLTree& right);
+
+    // Set algebra, again relinking nodes, so a and b are taken as rvalues
+    // and left empty. The results hold the items whose keys are in a or b,
+    // in both, or in a but not b, with a's values where both have a key.
+    // Passing the same tree twice gives that tree back, or an empty one for
+    // the difference. Each splits b around a's root and recurses on the two
+    // halves, O(m log(n/m + 1)) for trees of m <= n items. Large halves are
+    // worked on in parallel, by up to threads threads (0 picks
+    // std::thread::hardware_concurrency()).
+    static AVLTree set_union(AVLTree&& a, AVLTree&& b, unsigned threads = 0);
+    static AVLTree set_intersection(AVLTree&& a, AVLTree&& b, unsigned threads = 0);
+    static AVLTree set_difference(AVLTree&& a, AVLTree&& b, unsigned threads = 0);
+
+    // As BinarySearchTree::apply_batch(), but a sorted batch of at least an
+    // eighth of the tree's size, yet too small to rebuild it, is applied in
+    // one descent: it is split around each node it reaches, and every
+    // subtree it touches is rebalanced once, on the way back up, in
+    // O(k log(n/k + 1)) for k ops on n items. Sparser batches share little
+    // of their paths and are applied one op at a time.
+    // If Key or Value throws, the ops applied so far stay applied.
+    template<typename ForwardIt>
+    void apply_batch(ForwardIt first, ForwardIt last);
 
 protected:
-    virtual void nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2);
+    virtual void nodeSwap( AVLNode<Key, Value, OrderStatistics>* n1, AVLNode<Key, Value, OrderStatistics>* n2);
+
+    Node<Key, Value>* createNode(const Key& key, Value&& value, Node<Key, Value>* parent) override;
+    Node<Key, Value>* createNode(Key&& key, Value&& value, Node<Key, Value>* parent) override;
+    void destroyNode(Node<Key, Value>* node) override;
+    void afterInsert(Node<Key, Value>* node) override;
+    void removeNode(Node<Key, Value>* node) override;
+    AVLNode<Key, Value, OrderStatistics>* detachNode(Node<Key, Value>* node);
+    void setBuiltShape(Node<Key, Value>* node, int balance, std::size_t size) override;
 
     // Add helper functions here
-    static int getHeight(AVLNode<Key, Value>* node);
 
-    void insertFix(AVLNode<Key, Value>* p, AVLNode<Key, Value>* n);
-    void finishLeftInsert(AVLNode<Key, Value>* p, AVLNode<Key, Value>* n, AVLNode<Key, Value>* g);
-    void finishRightInsert(AVLNode<Key, Value>* p, AVLNode<Key, Value>* n, AVLNode<Key, Value>* g);
+    void insertFix(AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n);
+    void finishLeftInsert(AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n, AVLNode<Key, Value, OrderStatistics>* g);
+    void finishRightInsert(AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n, AVLNode<Key, Value, OrderStatistics>* g);
+
+    static bool isZigZag(AVLNode<Key, Value, OrderStatistics>* g, AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n);
+
+    void rotateRight(AVLNode<Key, Value, OrderStatistics>* z);
+    void rotateLeft(AVLNode<Key, Value, OrderStatistics>* x);
+
+    // Subtree size upkeep. The walking helpers have a no-op overload picked
+    // when order statistics are disabled, so those trees pay nothing for it.
+    typedef std::integral_constant<bool, OrderStatistics> StatisticsTag;
+    static std::size_t subtreeSize(AVLNode<Key, Value, OrderStatistics>* node);
+    static void updateSize(AVLNode<Key, Value, OrderStatistics>* node, std::true_type);
+    static void updateSize(AVLNode<Key, Value, OrderStatistics>* node, std::false_type);
+    static void adjustSizesToRoot(AVLNode<Key, Value, OrderStatistics>* node, std::ptrdiff_t diff, std::true_type);
+    static void adjustSizesToRoot(AVLNode<Key, Value, OrderStatistics>* node, std::ptrdiff_t diff, std::false_type);
+    static std::size_t sizeFromRoot(AVLNode<Key, Value, OrderStatistics>* root, std::size_t fallback, std::true_type);
+    static std::size_t sizeFromRoot(AVLNode<Key, Value, OrderStatistics>* root, std::size_t fallback, std::false_type);
+    AVLNode<Key, Value, OrderStatistics>* selectNode(std::size_t i) const;
+    std::size_t countRange(const Key& a, const Key& b, std::true_type) const;
+    std::size_t countRange(const Key& a, const Key& b, std::false_type) const;
+
+
+    void removeFix(AVLNode<Key, Value, OrderStatistics>* n, int8_t diff);
+
+    // Split/join on detached subtrees. Both use root_ to hold the root of
+    // the subtree being worked on, since the rotations keep it up to date.
+    static int treeHeight(AVLNode<Key, Value, OrderStatistics>* root);
+    int joinSubtrees(AVLNode<Key, Value, OrderStatistics>* left, int leftHeight, AVLNode<Key, Value, OrderStatistics>* pivot,
+        AVLNode<Key, Value, OrderStatistics>* right, int rightHeight);
+    int joinSubtrees(AVLNode<Key, Value, OrderStatistics>* left, int leftHeight, AVLNode<Key, Value, OrderStatistics>* right, int rightHeight);
+    void splitSubtree(AVLNode<Key, Value, OrderStatistics>* node, int height, const Key& key,
+        AVLNode<Key, Value, OrderStatistics>*& left, int& leftHeight, AVLNode<Key, Value, OrderStatistics>*& right, int& rightHeight, AVLNode<Key, Value, OrderStatistics>*& match);
+    bool growFix(AVLNode<Key, Value, OrderStatistics>* n);
+    static AVLTree joinWithPivot(AVLTree& left, AVLNode<Key, Value, OrderStatistics>* pivot, AVLTree& right);
+    // smaller batches than size() / BATCH_DESCENT_DIVISOR ops are applied one
+    // at a time: the descents of separate ops overlap their cache misses,
+    // which outweighs the top levels a single descent shares between them
+    static const std::size_t BATCH_DESCENT_DIVISOR = 8;
+    template<typename ForwardIt>
+    void applyBatchSubtree(AVLNode<Key, Value, OrderStatistics>* node, int height, ForwardIt first, ForwardIt last,
+        AVLNode<Key, Value, OrderStatistics>* prev, AVLNode<Key, Value, OrderStatistics>* next,
+        AVLNode<Key, Value, OrderStatistics>*& result, int& resultHeight);
+    template<typename ForwardIt>
+    void insertBatchRun(ForwardIt first, ForwardIt last, AVLNode<Key, Value, OrderStatistics>* prev, AVLNode<Key, Value, OrderStatistics>* next,
+        AVLNode<Key, Value, OrderStatistics>*& result, int& resultHeight);
+
+    // Set algebra. Every thread works in a tree object of its own, for the
+    // root_ scratch space; nodes left out of the result are only collected
+    // in dropped, and destroyed once all threads are done with the arenas.
+    enum SetOperation { SET_UNION, SET_INTERSECTION, SET_DIFFERENCE };
+    static AVLTree setOperation(AVLTree& a, AVLTree& b, SetOperation op, unsigned threads);
+    int combineSubtrees(SetOperation op, AVLNode<Key, Value, OrderStatistics>* a, int aHeight, AVLNode<Key, Value, OrderStatistics>* b, int bHeight,
+        AVLNode<Key, Value, OrderStatistics>*& result, std::vector<AVLNode<Key, Value, OrderStatistics>*>& dropped, unsigned threads);
+    // subtrees of a at least this tall are worth handing half to another thread
+    static const int PARALLEL_MIN_HEIGHT = 14;
+
+    static AVLNode<Key, Value, OrderStatistics>* nodeMin(AVLNode<Key, Value, OrderStatistics>* current);
+    static AVLNode<Key, Value, OrderStatistics>* nodeMax(AVLNode<Key, Value, OrderStatistics>* current);
+    static AVLNode<Key, Value, OrderStatistics>* predecessor(AVLNode<Key, Value, OrderStatistics>* current);
+};
 
-    static bool isZigZag(AVLNode<Key, Value>* g, AVLNode<Key, Value>* p, AVLNode<Key, Value>* n);
+/**
+* Default constructor, sizes the arena's slots for AVLNodes.
+*/
+template<class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::AVLTree() : BinarySearchTree<Key, Value, Compare>(sizeof(AVLNode<Key, Value, OrderStatistics>), alignof(AVLNode<Key, Value, OrderStatistics>))
+{
 
-    void rotateRight(AVLNode<Key, Value>* z);
-    void rotateLeft(AVLNode<Key, Value>* x);
+}
 
+/**
+* Constructs a tree holding the pairs in [first, last), see assign_sorted().
+*/
+template<class Key, class Value, bool OrderStatistics, class Compare>
+template<typename InputIt>
+AVLTree<Key, Value, OrderStatistics, Compare>::AVLTree(InputIt first, InputIt last) : BinarySearchTree<Key, Value, Compare>(sizeof(AVLNode<Key, Value, OrderStatistics>), alignof(AVLNode<Key, Value, OrderStatistics>))
+{
+    this->assign_sorted(first, last);
+}
 
-    void removeFix(AVLNode<Key, Value>* n, uint8_t diff);
+/**
+* Takes over other's nodes, see BinarySearchTree's move constructor.
+*/
+template<class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::AVLTree(AVLTree&& other) : BinarySearchTree<Key, Value, Compare>(std::move(other))
+{
 
-    static AVLNode<Key, Value>* nodeMin(AVLNode<Key, Value>* current);
-    static AVLNode<Key, Value>* nodeMax(AVLNode<Key, Value>* current);
-    static AVLNode<Key, Value>* predecessor(AVLNode<Key, Value>* current);
+}
 
+template<class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>& AVLTree<Key, Value, OrderStatistics, Compare>::operator=(AVLTree&& other)
+{
+    BinarySearchTree<Key, Value, Compare>::operator=(std::move(other));
+    return *this;
+}
 
-};
+/**
+* Clears here rather than leaving it to the base destructor, which could
+* only see BinarySearchTree::destroyNode by the time it runs.
+*/
+template<class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::~AVLTree()
+{
+    this->clear();
+}
 
 /*
  * Recall: If key is already in the tree, you should 
  * overwrite the current value with the updated value.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>::insert (const std::pair<const Key, Value> &new_item)
+template<class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::insert (const std::pair<const Key, Value> &new_item)
 {
-    AVLNode<Key, Value>* val = new AVLNode<Key, Value>(new_item.first, new_item.second, nullptr);
-
-    if (this->root_ == nullptr) {
-        this->root_ = val;
-        return;
-    }
-
-    AVLNode<Key, Value>* p = nullptr;
-    AVLNode<Key, Value>* current = static_cast<AVLNode<Key, Value>*>(this->root_);
-
-
-    while (current != nullptr) {
-        p = current;
-        if (val->getKey() < current->getKey()) {
-            current = current->getLeft();
-        }else if (val->getKey() == current->getKey()) {
-            current->setValue(new_item.second);
-            delete val;
-            return;
-        }else if (val->getKey() > current->getKey()){
-            current = current->getRight();
-        }
-    }
-
-
+    this->insert_or_assign(new_item.first, new_item.second);
+}
 
-    val->setParent(p);
+/**
+* Rebalances after the base class links in a new node.
+*/
+template<class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::afterInsert(Node<Key, Value>* node)
+{
+    AVLNode<Key, Value, OrderStatistics>* val = static_cast<AVLNode<Key, Value, OrderStatistics>*>(node);
+    AVLNode<Key, Value, OrderStatistics>* p = val->getParent();
 
     if (p == nullptr) {
-        this->root_ = val;
-    } else if (val->getKey() < p->getKey()) {
-        p->setLeft(val);
-    } else {
-        p->setRight(val);
+        return;
     }
 
-    val->setBalance(0);
-
-    int8_t opb = p->getBalance();
-
-
-    if (opb == 0) {
-        int leftHeight  = getHeight(p->getLeft());
-        int rightHeight = getHeight(p->getRight());
-
-        int newBalance = rightHeight - leftHeight;
+    //every ancestor's subtree gained the new node, whatever the rotations do next
+    adjustSizesToRoot(p, 1, StatisticsTag());
+    BST_STATS_COUNT(insertRetraces);
+    BST_STATS_COUNT(insertRetraceSteps);
 
-        p->setBalance(newBalance);
-
-        // Key* a = &(new_item.first);
-
-        // std::cout << val->getKey() << ": " << (int)val->getBalance() << "/0" << std::endl;
-        // std::cout << p->getKey() << ": " << (int)p->getBalance() << "/" << newBalance << std::endl;
-        insertFix(p, val/*, dynamic_cast<int*>(&(new_item.first)) && new_item.first == -109*/);
-        return;
-    }else {
+    //p was leaning away from the new node, so its height did not change
+    if (p->getBalance() != 0) {
         p->setBalance(0);
+        return;
     }
 
-
+    //p was a leaf, so it now leans towards the new node and got taller
+    p->setBalance(val == p->getLeft() ? -1 : 1);
+    insertFix(p, val);
 }
 
 /*
  * Recall: The writeup specifies that if a node has 2 children you
  * should swap with the predecessor and then remove.
  */
-template<class Key, class Value>
-void AVLTree<Key, Value>:: remove(const Key& key)
+template<class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::removeNode(Node<Key, Value>* node)
 {
-    // TODO
-
-    //alright let's do this >:(
-
-    AVLNode<Key, Value>* n = dynamic_cast<AVLNode<Key, Value>*>(this->internalFind(key));
-
-    if (n == nullptr) {
-        return;
-    }
-
-    if (n == this->root_ && this->root_->isLeaf()) {
-        this->clear();
-        return;
-    }
-
-    bool leftNull = n->getLeft() == nullptr;
-    bool rightNull = n->getRight() == nullptr;
-
-    bool leftChild = n->getParent() != nullptr &&
-                    n->getParent()->getLeft() != nullptr &&
-                    n->getParent()->getLeft()->getKey() == key;
-
-    if (leftNull) {
-        this->promoteSingleSubtree( n, n->getRight());
-    }else if (rightNull) {
-        this->promoteSingleSubtree(n, n->getLeft());
-    }else {
-        AVLNode<Key, Value>* pred = predecessor(n);
-        nodeSwap(n, pred);
+    this->destroyNode(detachNode(node));
+}
 
-        if (n->getLeft() != nullptr) {
-            this->promoteSingleSubtree(n, n->getLeft());
-        }else if (n->getRight() != nullptr) {
-            this->promoteSingleSubtree(n, n->getRight());
-        }else {
-            AVLNode<Key, Value>* parent = n->getParent();
+/**
+* Unlinks node from the tree and rebalances, returning it to the caller
+* to destroy or relink. O(log n).
+*/
+template<class Key, class Value, bool OrderStatistics, class Compare>
+AVLNode<Key, Value, OrderStatistics>* AVLTree<Key, Value, OrderStatistics, Compare>::detachNode(Node<Key, Value>* node)
+{
+    AVLNode<Key, Value, OrderStatistics>* n = static_cast<AVLNode<Key, Value, OrderStatistics>*>(node);
 
-            //remove references to deleted memory
-            if (parent != nullptr && parent->getRight() != nullptr && parent->getRight()->getKey() == key) {
-                parent->setRight(nullptr);
-            }else if (parent != nullptr && parent->getLeft() != nullptr && parent->getLeft()->getKey() == key) {
-                parent->setLeft(nullptr);
-            }
-        }
+    //two children: swap with the predecessor so n has at most one child
+    if (n->getLeft() != nullptr && n->getRight() != nullptr) {
+        nodeSwap(n, predecessor(n));
     }
 
-    AVLNode<Key, Value>* parent = n->getParent();
-    AVLNode<Key, Value>* &p = parent;
-
-    if (p == nullptr) {
-        delete n;
-    }else {
-
-        int8_t diff = 0;
-
-        if (leftChild) {
-            diff = 1;
-        }else {
-            diff = -1;
-        }
-
-        delete n;
+    AVLNode<Key, Value, OrderStatistics>* child = n->getLeft() != nullptr ? n->getLeft() : n->getRight();
+    AVLNode<Key, Value, OrderStatistics>* p = n->getParent();
 
-        removeFix(p, diff);
+    //losing a node on the left makes p lean right, and vice versa
+    int8_t diff = 0;
+    if (p != nullptr) {
+        diff = (n == p->getLeft()) ? 1 : -1;
     }
 
+    this->promoteSingleSubtree(n, child);
+    this->unthreadNode(n);
+    adjustSizesToRoot(p, -1, StatisticsTag());
 
+    removeFix(p, diff);
+    return n;
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::removeFix(AVLNode<Key, Value>* n, uint8_t diff) {
-    if (n == nullptr) {
-        return;
-    }
-
-    int8_t ndiff = 0;
-
-    AVLNode<Key, Value>* p = n->getParent();
-
-    if (p != nullptr) {
-        bool leftChild = p->getLeft() != nullptr && p->getLeft()->getKey() == n->getKey();
-        if (leftChild) {
-            diff = 1;
-        }else {
-            diff = -1;
+/**
+ * Retraces from n towards the root after a removal, one ancestor per
+ * iteration, until an ancestor's height is unchanged: one that went from
+ * even to leaning, or one whose rotation left it as tall as before.
+ * Unlike insertion, each ancestor that got shorter may need a rotation.
+ * @param n the parent of the removed node (or of a subtree that got shorter)
+ * @param diff +1 if n's left subtree got shorter, -1 if its right subtree did
+ */
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::removeFix(AVLNode<Key, Value, OrderStatistics>* n, int8_t diff) {
+    BST_STATS_COUNT(removeRetraces);
+    while (n != nullptr) {
+        BST_STATS_COUNT(removeRetraceSteps);
+
+        //compute the diff for the next level up before any rotation moves n
+        AVLNode<Key, Value, OrderStatistics>* p = n->getParent();
+        int8_t ndiff = 0;
+        if (p != nullptr) {
+            ndiff = (n == p->getLeft()) ? 1 : -1;
         }
-    }
-
-    int nLeftHeight  =  getHeight(n->getLeft());
-    int nRightHeight = getHeight(n->getRight());
-    int nBalance = nRightHeight - nLeftHeight;
-
-    n->setBalance(nBalance);
 
-    if (nBalance == -2) {
-        AVLNode<Key, Value>* c = n->getLeft();
-        int cLeftHeight  =  getHeight(c->getLeft());
-        int cRightHeight = getHeight(c->getRight());
-        int cbal = cRightHeight - cLeftHeight;
-
-        if (cbal == -1) {
-            rotateRight(n);
-            c->setBalance(0);
-            n->setBalance(0);
-            removeFix(p, ndiff);
-        }else if (cbal == 0) {
-            rotateRight(n);
-            n->setBalance(-1);
-            c->setBalance(1);
-            //done!
-        }else if (cbal == 1) {
-            AVLNode<Key, Value>* g = c->getRight();
-            rotateLeft(c);
-            rotateRight(n);
-
-            if (g->getBalance() == +1) {
-                n->setBalance(0); c->setBalance(-1); g->setBalance(0);
-            }else if (g->getBalance() == +0) {
-                n->setBalance(0); c->setBalance(0); g->setBalance(+0);
-            } else if (g->getBalance() == -1) {
-                n->setBalance(+1); c->setBalance(0); g->setBalance(0);
+        int nBalance = n->getBalance() + diff;
+
+        if (nBalance == -2) {
+            AVLNode<Key, Value, OrderStatistics>* c = n->getLeft();
+            int8_t cbal = c->getBalance();
+
+            if (cbal == -1) {
+                rotateRight(n);
+                n->setBalance(0);
+                c->setBalance(0);
+            }else if (cbal == 0) {
+                rotateRight(n);
+                n->setBalance(-1);
+                c->setBalance(1);
+                //done!
+                return;
+            }else {
+                AVLNode<Key, Value, OrderStatistics>* g = c->getRight();
+                rotateLeft(c);
+                rotateRight(n);
+
+                if (g->getBalance() == 1) {
+                    n->setBalance(0); c->setBalance(-1);
+                }else if (g->getBalance() == 0) {
+                    n->setBalance(0); c->setBalance(0);
+                }else {
+                    n->setBalance(1); c->setBalance(0);
+                }
+                g->setBalance(0);
             }
-
-            removeFix(p, ndiff);
-        }
-    }if (nBalance == 2) {
-
-        AVLNode<Key, Value>* c = n->getRight();
-        int cLeftHeight  =  getHeight(c->getLeft());
-        int cRightHeight = getHeight(c->getRight());
-        int cbal = cRightHeight - cLeftHeight;
-
-        if (cbal == 1) {
-            rotateLeft(n);
-            c->setBalance(0);
-            n->setBalance(0);
-            removeFix(p, ndiff);
-        }else if (cbal == 0) {
-            rotateLeft(n);
-            n->setBalance(1);
-            c->setBalance(-1);
-            //done!
-        }else if (cbal == -1) {
-            AVLNode<Key, Value>* g = c->getLeft();
-            rotateRight(c);
-            rotateLeft(n);
-
-            if (g->getBalance() == -1) {
-                n->setBalance(0); c->setBalance(+1); g->setBalance(0);
-            }else if (g->getBalance() == +0) {
-                n->setBalance(0); c->setBalance(0); g->setBalance(+0);
-            } else if (g->getBalance() == 1) {
-                n->setBalance(-1); c->setBalance(0); g->setBalance(0);
+        }else if (nBalance == 2) {
+            AVLNode<Key, Value, OrderStatistics>* c = n->getRight();
+            int8_t cbal = c->getBalance();
+
+            if (cbal == 1) {
+                rotateLeft(n);
+                n->setBalance(0);
+                c->setBalance(0);
+            }else if (cbal == 0) {
+                rotateLeft(n);
+                n->setBalance(1);
+                c->setBalance(-1);
+                //done!
+                return;
+            }else {
+                AVLNode<Key, Value, OrderStatistics>* g = c->getLeft();
+                rotateRight(c);
+                rotateLeft(n);
+
+                if (g->getBalance() == -1) {
+                    n->setBalance(0); c->setBalance(1);
+                }else if (g->getBalance() == 0) {
+                    n->setBalance(0); c->setBalance(0);
+                }else {
+                    n->setBalance(-1); c->setBalance(0);
+                }
+                g->setBalance(0);
             }
-
-            removeFix(p, ndiff);
+        }else if (nBalance == 0) {
+            //n got shorter
+            n->setBalance(0);
+        }else {
+            //n went from balanced to leaning, its height is unchanged
+            n->setBalance(nBalance);
+            return;
         }
 
-    }else if (nBalance == 0) {
-        removeFix(p, ndiff);
+        //n's subtree got shorter, keep going up
+        n = p;
+        diff = ndiff;
     }
 }
 
-template <typename Key, typename Value>
-AVLNode<Key, Value>* AVLTree<Key, Value>::nodeMin(AVLNode<Key, Value>* current) {
-    AVLNode<Key, Value>* temp = current;
+template <typename Key, typename Value, bool OrderStatistics, class Compare>
+AVLNode<Key, Value, OrderStatistics>* AVLTree<Key, Value, OrderStatistics, Compare>::nodeMin(AVLNode<Key, Value, OrderStatistics>* current) {
+    AVLNode<Key, Value, OrderStatistics>* temp = current;
     while (temp->getLeft() != nullptr) {
         temp = temp->getLeft();
     }
     return temp;
 }
 
-template <typename Key, typename Value>
-AVLNode<Key, Value>* AVLTree<Key, Value>::nodeMax(AVLNode<Key, Value>* current) {
-    AVLNode<Key, Value>* temp = current;
+template <typename Key, typename Value, bool OrderStatistics, class Compare>
+AVLNode<Key, Value, OrderStatistics>* AVLTree<Key, Value, OrderStatistics, Compare>::nodeMax(AVLNode<Key, Value, OrderStatistics>* current) {
+    AVLNode<Key, Value, OrderStatistics>* temp = current;
     while (temp->getRight() != nullptr) {
         temp = temp->getRight();
     }
     return temp;
 }
 
-template <class Key, class Value>
-AVLNode<Key, Value>* AVLTree<Key, Value>::predecessor(AVLNode<Key, Value>* current) {
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLNode<Key, Value, OrderStatistics>* AVLTree<Key, Value, OrderStatistics, Compare>::predecessor(AVLNode<Key, Value, OrderStatistics>* current) {
     //if we have a left child, it's the max in that subtree
     if (current->getLeft() != nullptr) {
         return nodeMax(current->getLeft());
     }
     //if not, walk up
-    AVLNode<Key, Value>* node = current->getParent();
+    AVLNode<Key, Value, OrderStatistics>* node = current->getParent();
     //keep walking up until either the parent is null or we are not the left child
     while (node != nullptr && current == node->getLeft()) {
         current = node;
@@ -443,96 +566,123 @@ AVLNode<Key, Value>* AVLTree<Key, Value>::predecessor(AVLNode<Key, Value>* curre
 
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::insert(const Key& k, const Value& v) {
-    this->insert(std::make_pair(k, v));
+/**
+* Constructs an AVLNode in a slot from the arena, moving the value in.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+Node<Key, Value>* AVLTree<Key, Value, OrderStatistics, Compare>::createNode(const Key& key, Value&& value, Node<Key, Value>* parent) {
+    BST_STATS_COUNT(allocations);
+    void* slot = this->arena_->allocate();
+    try {
+        return new (slot) AVLNode<Key, Value, OrderStatistics>(key, std::move(value), static_cast<AVLNode<Key, Value, OrderStatistics>*>(parent));
+    } catch (...) {
+        this->arena_->deallocate(slot);
+        throw;
+    }
 }
 
+/**
+* Constructs an AVLNode in a slot from the arena, moving both the key and value in.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+Node<Key, Value>* AVLTree<Key, Value, OrderStatistics, Compare>::createNode(Key&& key, Value&& value, Node<Key, Value>* parent) {
+    BST_STATS_COUNT(allocations);
+    void* slot = this->arena_->allocate();
+    try {
+        return new (slot) AVLNode<Key, Value, OrderStatistics>(std::move(key), std::move(value), static_cast<AVLNode<Key, Value, OrderStatistics>*>(parent));
+    } catch (...) {
+        this->arena_->deallocate(slot);
+        throw;
+    }
+}
 
-
-template<class Key, class Value>
-void AVLTree<Key, Value>::nodeSwap( AVLNode<Key,Value>* n1, AVLNode<Key,Value>* n2)
-{
-    BinarySearchTree<Key, Value>::nodeSwap(n1, n2);
-    int8_t tempB = n1->getBalance();
-    n1->setBalance(n2->getBalance());
-    n2->setBalance(tempB);
+/**
+* Bulk-built trees are height-minimal, so the balance is known up front.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::setBuiltShape(Node<Key, Value>* node, int balance, std::size_t size) {
+    AVLNode<Key, Value, OrderStatistics>* n = static_cast<AVLNode<Key, Value, OrderStatistics>*>(node);
+    n->setBalance(balance);
+    n->setSize(size);
 }
 
-//safety wrapper around a node that can be null
-template <class Key, class Value>
-int AVLTree<Key, Value>::getHeight(AVLNode<Key, Value>* node) {
-    if (node == nullptr) {
-        return 0;
-    }
-    return node->height();
+/**
+* Destroys an AVLNode and hands its slot back to the arena.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::destroyNode(Node<Key, Value>* node) {
+    static_cast<AVLNode<Key, Value, OrderStatistics>*>(node)->~AVLNode();
+    this->releaseSlot(node);
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::insertFix(AVLNode<Key, Value>* p, AVLNode<Key, Value>* n) {
-    AVLNode<Key, Value>* g = p->getParent();
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::insert(const Key& k, const Value& v) {
+    this->insert_or_assign(k, v);
+}
 
-    //root base conditions
-    if (p == nullptr) {
-        return;
-    }
-    if (g == nullptr) {
-        return;
-    }
 
-    bool leftP = g->getLeft() != nullptr && g->getLeft()->getKey() == p->getKey();
-    // if (g->getLeft() != nullptr)
-    //     leftP = g->getLeft()->getKey() == p->getKey();
 
-    //recalculate g balance because I don't trust my own code to get it right
-    int glh = getHeight(g->getLeft());
-    int grh = getHeight(g->getRight());
-    int gbal = grh - glh;
+template<class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::nodeSwap( AVLNode<Key, Value, OrderStatistics>* n1, AVLNode<Key, Value, OrderStatistics>* n2)
+{
+    BinarySearchTree<Key, Value, Compare>::nodeSwap(n1, n2);
+    int8_t tempB = n1->getBalance();
+    n1->setBalance(n2->getBalance());
+    n2->setBalance(tempB);
 
-    if (leftP) {
-        // g->updateBalance(-1);
-        g->setBalance(gbal);
+    //sizes belong to positions in the tree, so they move with the balances
+    std::size_t tempS = n1->getSize();
+    n1->setSize(n2->getSize());
+    n2->setSize(tempS);
+}
 
-        //case 1: We're done!
-        if (g->getBalance() == 0) {
+/**
+ * Retraces from p towards the root after an insertion, one ancestor per
+ * iteration. It stops at the first ancestor whose height did not change:
+ * either one that evened out, or the one that needed the (single or
+ * double) rotation, which restores the height it had before the insertion.
+ * @pre p's balance has already been updated for the new node and p got taller
+ * @param p the node whose subtree just grew
+ * @param n the child of p on the path to the inserted node
+ */
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::insertFix(AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n) {
+    while (p != nullptr) {
+        AVLNode<Key, Value, OrderStatistics>* g = p->getParent();
+        if (g == nullptr) {
             return;
         }
+        BST_STATS_COUNT(insertRetraceSteps);
 
-        //case 2: recurse
-        if (g->getBalance() == -1) {
-            insertFix(g, p);
-        }
+        bool leftP = p == g->getLeft();
+        int8_t towardsP = leftP ? -1 : 1;
+        g->updateBalance(towardsP);
 
-        //case 3: swap and finalize
-        if (g->getBalance() == -2) {
-            finishLeftInsert(p, n, g);
-        }
-    }else {
-        // g->updateBalance(1);
-        g->setBalance(gbal);
-
-        //case 1: We're done!
+        //case 1: g was leaning away from p and evened out, we're done!
         if (g->getBalance() == 0) {
             return;
         }
 
-        //case 2: recurse
-        if (g->getBalance() == 1) {
-            insertFix(g, p);
+        //case 2: g was even and now leans towards p, so it got taller too
+        if (g->getBalance() == towardsP) {
+            n = p;
+            p = g;
+            continue;
         }
 
-        //case 3: swap and finalize
-        if (g->getBalance() == 2) {
+        //case 3: rotate, which leaves g's subtree as tall as before
+        if (leftP) {
+            finishLeftInsert(p, n, g);
+        }else {
             finishRightInsert(p, n, g);
         }
-
+        return;
     }
-
 }
 
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::finishLeftInsert(AVLNode<Key, Value>* p, AVLNode<Key, Value>* n, AVLNode<Key, Value>* g) {
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::finishLeftInsert(AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n, AVLNode<Key, Value, OrderStatistics>* g) {
     bool zigzag = isZigZag(g, p, n);
     if (zigzag) {
         rotateLeft(p);
@@ -541,7 +691,6 @@ void AVLTree<Key, Value>::finishLeftInsert(AVLNode<Key, Value>* p, AVLNode<Key,
         rotateRight(g);
         p->setBalance(0);
         g->setBalance(0);
-        // n->setBalance(0);
 
         return;
     }
@@ -550,21 +699,19 @@ void AVLTree<Key, Value>::finishLeftInsert(AVLNode<Key, Value>* p, AVLNode<Key,
     if (n->getBalance() == -1) {
         p->setBalance(0);
         g->setBalance(1);
-        n->setBalance(0);
     }else if (n->getBalance() == 0) {
         p->setBalance(0);
         g->setBalance(0);
-        n->setBalance(0);
     }else if (n->getBalance() == 1) {
         p->setBalance(-1);
         g->setBalance(0);
-        n->setBalance(0);
     }
+    n->setBalance(0);
 
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::finishRightInsert(AVLNode<Key, Value>* p, AVLNode<Key, Value>* n, AVLNode<Key, Value>* g) {
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::finishRightInsert(AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n, AVLNode<Key, Value, OrderStatistics>* g) {
     bool zigzag = isZigZag(g, p, n);
     if (zigzag) {
         rotateRight(p);
@@ -573,7 +720,6 @@ void AVLTree<Key, Value>::finishRightInsert(AVLNode<Key, Value>* p, AVLNode<Key,
         rotateLeft(g);
         p->setBalance(0);
         g->setBalance(0);
-        // n->setBalance(0);
         return;
     }
 
@@ -581,16 +727,14 @@ void AVLTree<Key, Value>::finishRightInsert(AVLNode<Key, Value>* p, AVLNode<Key,
     if (n->getBalance() == 1) {
         p->setBalance(0);
         g->setBalance(-1);
-        n->setBalance(0);
     }else if (n->getBalance() == 0) {
         p->setBalance(0);
         g->setBalance(0);
-        n->setBalance(0);
     }else if (n->getBalance() == -1) {
         p->setBalance(1);
         g->setBalance(0);
-        n->setBalance(0);
     }
+    n->setBalance(0);
 
 }
 
@@ -601,40 +745,38 @@ void AVLTree<Key, Value>::finishRightInsert(AVLNode<Key, Value>* p, AVLNode<Key,
  * @param n is the inserted value
  * @return true iff the g->p->n relation is zig zag, false otherwise
  */
-template <class Key, class Value>
-bool AVLTree<Key, Value>::isZigZag(AVLNode<Key, Value>* g, AVLNode<Key, Value>* p, AVLNode<Key, Value>* n) {
-    int pbal = p->getBalance();
-
-    return (pbal < 0 && g->getRight() != nullptr && g->getRight()->getKey() == p->getKey()) ||
-            (pbal > 0 && g->getLeft() != nullptr && g->getLeft()->getKey() == p->getKey());
+template <class Key, class Value, bool OrderStatistics, class Compare>
+bool AVLTree<Key, Value, OrderStatistics, Compare>::isZigZag(AVLNode<Key, Value, OrderStatistics>* g, AVLNode<Key, Value, OrderStatistics>* p, AVLNode<Key, Value, OrderStatistics>* n) {
+    return (p == g->getLeft()) != (n == p->getLeft());
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* z) {
+/**
+ * Rotates z's left child up into z's place.
+ * Only relinks pointers and fixes subtree sizes; callers are responsible
+ * for the balance factors.
+ */
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::rotateRight(AVLNode<Key, Value, OrderStatistics>* z) {
 
     if (z == nullptr) {
         return;
     }
 
-    AVLNode<Key, Value>* zP = z->getParent();
-    AVLNode<Key, Value>* y  = z->getLeft();
+    AVLNode<Key, Value, OrderStatistics>* zP = z->getParent();
+    AVLNode<Key, Value, OrderStatistics>* y  = z->getLeft();
     if (y == nullptr) {
         return;
     }
-    AVLNode<Key, Value>* yR = y->getRight();
-
-    bool zPRoot = zP == nullptr;
-    bool isLeft = /*(!zPRoot && zP->getLeft() == nullptr) || */(!zPRoot && zP->getLeft() != nullptr && zP->getLeft()->getKey() == z->getKey());
+    AVLNode<Key, Value, OrderStatistics>* yR = y->getRight();
 
-    if (!zPRoot && isLeft) {
+    if (zP == nullptr) {
+        this->root_ = y;
+    }else if (zP->getLeft() == z) {
         zP->setLeft(y);
-    }else if (!zPRoot) {
+    }else {
         zP->setRight(y);
     }
     y->setParent(zP);
-    if (zPRoot) {
-        this->root_ = y;
-    }
 
     y->setRight(z);
     z->setParent(y);
@@ -643,42 +785,40 @@ void AVLTree<Key, Value>::rotateRight(AVLNode<Key, Value>* z) {
         yR->setParent(z);
     }
 
-    //update balance factors for y
-    int yHeightLeft  = getHeight(y->getLeft());
-    int yHeightRight = getHeight(y->getRight());
-    int yBalance = yHeightRight - yHeightLeft;
-    y->setBalance(yBalance);
-
-    int zHeightLeft  = getHeight(z->getLeft());
-    int zHeightRight = getHeight(z->getRight());
-    int zBalance = zHeightRight - zHeightLeft;
-    z->setBalance(zBalance);
+    //z is now below y, so it has to be resized first
+    updateSize(z, StatisticsTag());
+    updateSize(y, StatisticsTag());
+    BST_STATS_COUNT(rightRotations);
 
 }
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* x) {
+/**
+ * Rotates x's right child up into x's place.
+ * Only relinks pointers and fixes subtree sizes; callers are responsible
+ * for the balance factors.
+ */
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::rotateLeft(AVLNode<Key, Value, OrderStatistics>* x) {
 
     if (x == nullptr) {
         return;
     }
 
-    AVLNode<Key, Value>* xP = x->getParent();
-    AVLNode<Key, Value>* y  = x->getRight();
-    AVLNode<Key, Value>* yL = y->getLeft();
-
-    bool xPRoot = xP == nullptr;
-    bool isLeft = /*(!xPRoot && xP->getLeft() == nullptr) || */(!xPRoot && xP->getLeft() != nullptr && xP->getLeft()->getKey() == x->getKey());
+    AVLNode<Key, Value, OrderStatistics>* xP = x->getParent();
+    AVLNode<Key, Value, OrderStatistics>* y  = x->getRight();
+    if (y == nullptr) {
+        return;
+    }
+    AVLNode<Key, Value, OrderStatistics>* yL = y->getLeft();
 
-    if (!xPRoot && isLeft) {
+    if (xP == nullptr) {
+        this->root_ = y;
+    }else if (xP->getLeft() == x) {
         xP->setLeft(y);
-    }else if (!xPRoot) {
+    }else {
         xP->setRight(y);
     }
     y->setParent(xP);
-    if (xPRoot) {
-        this->root_ = y;
-    }
 
     y->setLeft(x);
     x->setParent(y);
@@ -687,33 +827,26 @@ void AVLTree<Key, Value>::rotateLeft(AVLNode<Key, Value>* x) {
         yL->setParent(x);
     }
 
-    //update balance factors for y
-    int yHeightLeft  = getHeight(y->getLeft());
-    int yHeightRight = getHeight(y->getRight());
-    int yBalance = yHeightRight - yHeightLeft;
-    y->setBalance(yBalance);
-
-    int xHeightLeft  = getHeight(x->getLeft());
-    int xHeightRight = getHeight(x->getRight());
-    int xBalance = xHeightRight - xHeightLeft;
-    x->setBalance(xBalance);
+    updateSize(x, StatisticsTag());
+    updateSize(y, StatisticsTag());
+    BST_STATS_COUNT(leftRotations);
 
 }
 
 
 
-template <class Key, class Value>
-void AVLTree<Key, Value>::print_placeholders(std::ios::fmtflags origCoutState,
-    std::map<Key, uint8_t> valuePlaceholders) const {
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::print_placeholders(std::ios::fmtflags origCoutState,
+    std::map<Key, uint8_t, Compare> valuePlaceholders) const {
     std::cout << "Tree Placeholders:------------------" << std::endl;
-    for(typename std::map<Key, uint8_t>::iterator placeholdersIter = valuePlaceholders.begin(); placeholdersIter != valuePlaceholders.end(); ++placeholdersIter) {
+    for(typename std::map<Key, uint8_t, Compare>::iterator placeholdersIter = valuePlaceholders.begin(); placeholdersIter != valuePlaceholders.end(); ++placeholdersIter) {
         std::cout << '[' << std::setfill('0') << std::setw(2) << ((uint16_t)placeholdersIter->second) << "] -> ";
 
         // print element with original cout flags
         std::cout.flags(origCoutState);
         std::cout << '(' << placeholdersIter->first << ", ";
 
-        typename BinarySearchTree<Key, Value>::iterator elementIter = this->find(placeholdersIter->first);
+        typename BinarySearchTree<Key, Value, Compare>::const_iterator elementIter = this->find(placeholdersIter->first);
         if(elementIter == this->end())
         {
             std::cout << "<error: lookup failed>";
@@ -727,7 +860,7 @@ void AVLTree<Key, Value>::print_placeholders(std::ios::fmtflags origCoutState,
 
         if (elementIter != this->end()) {
             Node<Key, Value>* cur = elementIter.getCurrent();
-            std::cout << " " << (int)dynamic_cast<AVLNode<Key, Value>*>(cur)->getBalance();
+            std::cout << " " << (int)static_cast<AVLNode<Key, Value, OrderStatistics>*>(cur)->getBalance();
         }
 
 
@@ -737,19 +870,814 @@ void AVLTree<Key, Value>::print_placeholders(std::ios::fmtflags origCoutState,
     }
 }
 
-template <class Key, class Value>
-int AVLTree<Key, Value>::calcBalance(const Key& node) {
-    typename BinarySearchTree<Key, Value>::iterator h = this->find(node);
+/**
+* Returns the number of keys in the tree less than key.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::size_t AVLTree<Key, Value, OrderStatistics, Compare>::rank(const Key& key) const {
+    static_assert(OrderStatistics, "rank() needs an AVLTree<Key, Value, true>");
 
-    if (h == this->end()) {
-        return -1;
+    std::size_t count = 0;
+    AVLNode<Key, Value, OrderStatistics>* current = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    while (current != nullptr) {
+        if (this->keyLess(current->getKey(), key)) {
+            //everything on the left and current itself come before key
+            count += subtreeSize(current->getLeft()) + 1;
+            current = current->getRight();
+        }else {
+            current = current->getLeft();
+        }
     }
+    return count;
+}
+
+/**
+* Returns an iterator to the item with index i in key order,
+* or the end iterator if the tree has no more than i items.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator AVLTree<Key, Value, OrderStatistics, Compare>::select(std::size_t i) {
+    return this->makeIterator(selectNode(i));
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator AVLTree<Key, Value, OrderStatistics, Compare>::select(std::size_t i) const {
+    return this->makeIterator(selectNode(i));
+}
 
-    int hl = getHeight(dynamic_cast<AVLNode<Key, Value>*>(h.getCurrent()->getLeft()));
-    int hr = getHeight(dynamic_cast<AVLNode<Key, Value>*>(h.getCurrent()->getRight()));
-    int bal = hl - hr;
-    return bal;
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLNode<Key, Value, OrderStatistics>* AVLTree<Key, Value, OrderStatistics, Compare>::selectNode(std::size_t i) const {
+    static_assert(OrderStatistics, "select() needs an AVLTree<Key, Value, true>");
 
+    AVLNode<Key, Value, OrderStatistics>* current = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    while (current != nullptr) {
+        std::size_t leftSize = subtreeSize(current->getLeft());
+        if (i < leftSize) {
+            current = current->getLeft();
+        }else if (i == leftSize) {
+            break;
+        }else {
+            i -= leftSize + 1;
+            current = current->getRight();
+        }
+    }
+    return current;
+}
+
+/**
+* Returns the number of keys in [a, b). This is two rank() descents with
+* order statistics, and otherwise the walk over the range that the plain
+* BinarySearchTree does.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::size_t AVLTree<Key, Value, OrderStatistics, Compare>::count_range(const Key& a, const Key& b) const {
+    return countRange(a, b, StatisticsTag());
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::size_t AVLTree<Key, Value, OrderStatistics, Compare>::countRange(const Key& a, const Key& b, std::true_type) const {
+    if (!this->keyLess(a, b)) {
+        return 0;
+    }
+    return rank(b) - rank(a);
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::size_t AVLTree<Key, Value, OrderStatistics, Compare>::countRange(const Key& a, const Key& b, std::false_type) const {
+    return BinarySearchTree<Key, Value, Compare>::count_range(a, b);
+}
+
+//safety wrapper around a node that can be null
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::size_t AVLTree<Key, Value, OrderStatistics, Compare>::subtreeSize(AVLNode<Key, Value, OrderStatistics>* node) {
+    if (node == nullptr) {
+        return 0;
+    }
+    return node->getSize();
+}
+
+/**
+* Recomputes node's size from its children, which must be up to date.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::updateSize(AVLNode<Key, Value, OrderStatistics>* node, std::true_type) {
+    node->setSize(subtreeSize(node->getLeft()) + subtreeSize(node->getRight()) + 1);
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::updateSize(AVLNode<Key, Value, OrderStatistics>* node, std::false_type) {
+
+}
+
+/**
+* Adds diff to the size of node and every one of its ancestors.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::adjustSizesToRoot(AVLNode<Key, Value, OrderStatistics>* node, std::ptrdiff_t diff, std::true_type) {
+    for (; node != nullptr; node = node->getParent()) {
+        node->setSize(node->getSize() + diff);
+    }
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::adjustSizesToRoot(AVLNode<Key, Value, OrderStatistics>* node, std::ptrdiff_t diff, std::false_type) {
+
+}
+
+/**
+* The item count of a tree with the given root: read off the root with
+* order statistics, otherwise whatever the caller already knows.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::size_t AVLTree<Key, Value, OrderStatistics, Compare>::sizeFromRoot(AVLNode<Key, Value, OrderStatistics>* root, std::size_t fallback, std::true_type) {
+    return subtreeSize(root);
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::size_t AVLTree<Key, Value, OrderStatistics, Compare>::sizeFromRoot(AVLNode<Key, Value, OrderStatistics>* root, std::size_t fallback, std::false_type) {
+    return fallback;
+}
+
+/**
+* Returns the items with keys less than key and the items with the rest,
+* leaving this tree empty.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+std::pair<AVLTree<Key, Value, OrderStatistics, Compare>, AVLTree<Key, Value, OrderStatistics, Compare> >
+AVLTree<Key, Value, OrderStatistics, Compare>::split(const Key& key) {
+    AVLNode<Key, Value, OrderStatistics>* whole = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    AVLNode<Key, Value, OrderStatistics>* lower = nullptr;
+    AVLNode<Key, Value, OrderStatistics>* upper = nullptr;
+    AVLNode<Key, Value, OrderStatistics>* match = nullptr;
+    int lowerHeight = 0;
+    int upperHeight = 0;
+    splitSubtree(whole, treeHeight(whole), key, lower, lowerHeight, upper, upperHeight, match);
+    if (match != nullptr) {
+        upperHeight = joinSubtrees(nullptr, 0, match, upper, upperHeight);
+        upper = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    }
+    //both parts keep their own items in order, only the threads across the cut go
+    this->cutThreads(lower, upper);
+
+    //the lower part takes over this tree's arenas, and the upper part keeps
+    //them alive while allocating from a fresh one, so the parts can be
+    //changed from different threads; this tree gets the lower part's fresh
+    //arena, so repeated splits and joins do not pile up arenas
+    std::pair<AVLTree, AVLTree> parts;
+    parts.second.adoptArenas(*this);
+    std::swap(parts.first.arena_, this->arena_);
+    std::swap(parts.first.adoptedArenas_, this->adoptedArenas_);
+
+    parts.first.root_ = lower;
+    parts.first.size_ = sizeFromRoot(lower, BinarySearchTree<Key, Value, Compare>::UNKNOWN_SIZE, StatisticsTag());
+    parts.second.root_ = upper;
+    parts.second.size_ = sizeFromRoot(upper, BinarySearchTree<Key, Value, Compare>::UNKNOWN_SIZE, StatisticsTag());
+
+    this->root_ = nullptr;
+    this->size_ = 0;
+    return parts;
+}
+
+/**
+* Returns a tree of left's items, pivot and right's items, leaving left and right empty.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::join(AVLTree& left, const std::pair<const Key, Value>& pivot, AVLTree& right) {
+    if ((left.root_ != nullptr && !left.keyLess(BinarySearchTree<Key, Value, Compare>::nodeMax(left.root_)->getKey(), pivot.first)) ||
+        (right.root_ != nullptr && !left.keyLess(pivot.first, BinarySearchTree<Key, Value, Compare>::nodeMin(right.root_)->getKey()))) {
+        throw std::invalid_argument("join: keys are not in order");
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* pivotNode =
+        static_cast<AVLNode<Key, Value, OrderStatistics>*>(left.createNode(pivot.first, Value(pivot.second), nullptr));
+    return joinWithPivot(left, pivotNode, right);
+}
+
+/**
+* Returns a tree of left's items followed by right's items, leaving both empty.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::join(AVLTree& left, AVLTree& right) {
+    if (right.root_ == nullptr) {
+        return AVLTree(std::move(left));
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* first =
+        static_cast<AVLNode<Key, Value, OrderStatistics>*>(BinarySearchTree<Key, Value, Compare>::nodeMin(right.root_));
+    if (left.root_ != nullptr && !left.keyLess(BinarySearchTree<Key, Value, Compare>::nodeMax(left.root_)->getKey(), first->getKey())) {
+        throw std::invalid_argument("join: keys are not in order");
+    }
+
+    //the smallest node of right becomes the pivot as it is, so nothing is
+    //allocated or freed and its slot stays in an arena the result keeps
+    AVLNode<Key, Value, OrderStatistics>* pivotNode = right.detachNode(first);
+    right.noteRemoved();
+    return joinWithPivot(left, pivotNode, right);
+}
+
+/**
+* Joins the trees around a detached pivot node from left's or right's
+* arenas. The result takes over left's arena and keeps right's alive.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::joinWithPivot(AVLTree& left, AVLNode<Key, Value, OrderStatistics>* pivot, AVLTree& right) {
+    std::size_t leftSize = left.size_;
+    std::size_t rightSize = right.size_;
+
+    AVLTree result(std::move(left));
+    result.adoptArenas(right);
+
+    AVLNode<Key, Value, OrderStatistics>* lower = static_cast<AVLNode<Key, Value, OrderStatistics>*>(result.root_);
+    AVLNode<Key, Value, OrderStatistics>* upper = static_cast<AVLNode<Key, Value, OrderStatistics>*>(right.root_);
+    right.root_ = nullptr;
+    right.size_ = 0;
+    right.resetArena();
+
+    BinarySearchTree<Key, Value, Compare>::threadPivot(lower, pivot, upper);
+    result.joinSubtrees(lower, treeHeight(lower), pivot, upper, treeHeight(upper));
+
+    if (leftSize == BinarySearchTree<Key, Value, Compare>::UNKNOWN_SIZE || rightSize == BinarySearchTree<Key, Value, Compare>::UNKNOWN_SIZE) {
+        result.size_ = BinarySearchTree<Key, Value, Compare>::UNKNOWN_SIZE;
+    } else {
+        result.size_ = leftSize + rightSize + 1;
+    }
+    return result;
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+template<typename ForwardIt>
+void AVLTree<Key, Value, OrderStatistics, Compare>::apply_batch(ForwardIt first, ForwardIt last) {
+    std::size_t count = 0;
+    if (!this->batchSorted(first, last, count)) {
+        this->applyBatchOneByOne(first, last);
+        return;
+    }
+    if (this->batchRebuilds(count)) {
+        this->applyBatchRebuild(first, last);
+        return;
+    }
+    if (this->size_ != BinarySearchTree<Key, Value, Compare>::UNKNOWN_SIZE && count * BATCH_DESCENT_DIVISOR < this->size_) {
+        this->applyBatchOneByOne(first, last);
+        return;
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* whole = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    AVLNode<Key, Value, OrderStatistics>* result = whole;
+    int resultHeight = 0;
+    try {
+        applyBatchSubtree(whole, treeHeight(whole), first, last, nullptr, nullptr, result, resultHeight);
+    } catch (...) {
+        this->root_ = result;
+        throw;
+    }
+    this->root_ = result;
+}
+
+/**
+* Applies the sorted ops [first, last) to the subtree rooted at node, of
+* the given height, into result and resultHeight. The ops below node's key
+* go to its left subtree and those above to its right one, and node is
+* then joined back between the two results, or they are joined without it
+* if the last op on its key removes it. A result that is node with its
+* height unchanged may still hang off node's parent; any other is detached.
+* prev and next are the subtree's in-order neighbours outside it, for
+* threading new nodes.
+* If Key or Value throws, result still holds a valid subtree with the ops
+* applied so far.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+template<typename ForwardIt>
+void AVLTree<Key, Value, OrderStatistics, Compare>::applyBatchSubtree(AVLNode<Key, Value, OrderStatistics>* node, int height,
+    ForwardIt first, ForwardIt last, AVLNode<Key, Value, OrderStatistics>* prev, AVLNode<Key, Value, OrderStatistics>* next,
+    AVLNode<Key, Value, OrderStatistics>*& result, int& resultHeight) {
+
+    if (first == last) {
+        result = node;
+        resultHeight = height;
+        return;
+    }
+    if (node == nullptr) {
+        insertBatchRun(first, last, prev, next, result, resultHeight);
+        return;
+    }
+
+    //the ops on node's key itself are rarely more than one, so they are
+    //stepped over rather than searched for
+    typedef typename std::iterator_traits<ForwardIt>::value_type Op;
+    ForwardIt lowerEnd = std::lower_bound(first, last, node->getKey(),
+        [this](const Op& op, const Key& key) { return this->keyLess(op.key, key); });
+    ForwardIt upperBegin = lowerEnd;
+    ForwardIt op = last;
+    for (; upperBegin != last && !this->keyLess(node->getKey(), (*upperBegin).key); ++upperBegin) {
+        op = upperBegin;
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* lower = node->getLeft();
+    AVLNode<Key, Value, OrderStatistics>* upper = node->getRight();
+    int lowerHeight = height - ((node->getBalance() > 0) ? 2 : 1);
+    int upperHeight = height - ((node->getBalance() < 0) ? 2 : 1);
+    const int oldLowerHeight = lowerHeight;
+    const int oldUpperHeight = upperHeight;
+
+    //the upper subtree's root is loaded while the lower one is worked on
+    if (upper != nullptr && upperBegin != last) {
+        __builtin_prefetch(upper);
+    }
+
+    bool keep = true;
+    try {
+        if (first != lowerEnd) {
+            applyBatchSubtree(lower, lowerHeight, first, lowerEnd, prev, node, lower, lowerHeight);
+        }
+        if (upperBegin != last) {
+            applyBatchSubtree(upper, upperHeight, upperBegin, last, node, next, upper, upperHeight);
+        }
+        //the last op on node's key wins
+        if (op != last) {
+            if ((*op).remove) {
+                keep = false;
+            } else {
+                node->getValue() = (*op).value;
+            }
+        }
+    } catch (...) {
+        if (lower != nullptr) {
+            lower->setParent(nullptr);
+        }
+        if (upper != nullptr) {
+            upper->setParent(nullptr);
+        }
+        resultHeight = joinSubtrees(lower, lowerHeight, node, upper, upperHeight);
+        result = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+        throw;
+    }
+
+    //subtrees that come back with the same roots and heights fit under node
+    //as they are, so the retracing stops where the heights settle
+    if (keep && lower == node->getLeft() && lowerHeight == oldLowerHeight
+            && upper == node->getRight() && upperHeight == oldUpperHeight) {
+        //a subtree the batch went into may have been relinked on the way
+        //back, the other one is not even read
+        if (lower != nullptr && first != lowerEnd) {
+            lower->setParent(node);
+        }
+        if (upper != nullptr && upperBegin != last) {
+            upper->setParent(node);
+        }
+        updateSize(node, StatisticsTag());
+        result = node;
+        resultHeight = height;
+        return;
+    }
+
+    if (lower != nullptr) {
+        lower->setParent(nullptr);
+    }
+    if (upper != nullptr) {
+        upper->setParent(nullptr);
+    }
+    if (keep) {
+        resultHeight = joinSubtrees(lower, lowerHeight, node, upper, upperHeight);
+        result = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+        return;
+    }
+    this->unthreadNode(node);
+    resultHeight = joinSubtrees(lower, lowerHeight, upper, upperHeight);
+    result = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    this->destroyNode(node);
+    this->noteRemoved();
+}
+
+/**
+* Builds the subtree of the keys the sorted ops [first, last) upsert into
+* a gap of the tree between prev and next, where no key is yet. Each new
+* node goes on the right end of the subtree built so far.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+template<typename ForwardIt>
+void AVLTree<Key, Value, OrderStatistics, Compare>::insertBatchRun(ForwardIt first, ForwardIt last,
+    AVLNode<Key, Value, OrderStatistics>* prev, AVLNode<Key, Value, OrderStatistics>* next,
+    AVLNode<Key, Value, OrderStatistics>*& result, int& resultHeight) {
+
+    result = nullptr;
+    resultHeight = 0;
+    for (ForwardIt op = first; op != last; ++op) {
+        //only the last op on a key counts
+        ForwardIt following = op;
+        if (++following != last && !this->keyLess((*op).key, (*following).key)) {
+            continue;
+        }
+        if ((*op).remove) {
+            continue;
+        }
+
+        AVLNode<Key, Value, OrderStatistics>* val = static_cast<AVLNode<Key, Value, OrderStatistics>*>(
+            this->createNode((*op).key, Value((*op).value), nullptr));
+        this->noteInserted();
+        BinarySearchTree<Key, Value, Compare>::threadNode(val, prev, next);
+        resultHeight = joinSubtrees(result, resultHeight, val, nullptr, 0);
+        result = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+        prev = val;
+    }
+}
+
+/**
+* Height of a valid AVL subtree, following the taller child down: O(log n).
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+int AVLTree<Key, Value, OrderStatistics, Compare>::treeHeight(AVLNode<Key, Value, OrderStatistics>* root) {
+    int height = 0;
+    while (root != nullptr) {
+        ++height;
+        root = root->getBalance() < 0 ? root->getLeft() : root->getRight();
+    }
+    return height;
+}
+
+/**
+* Joins detached subtrees left and right, of the given heights, under the
+* detached node pivot, with all of left's keys below pivot's and all of
+* right's above. The result is left in root_ and its height returned.
+* The pivot goes down the taller tree's inner spine to the first subtree
+* no more than one taller than the other tree, takes that subtree's place,
+* and the growth is retraced upwards. Costs O(|leftHeight - rightHeight| + 1).
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+int AVLTree<Key, Value, OrderStatistics, Compare>::joinSubtrees(AVLNode<Key, Value, OrderStatistics>* left, int leftHeight,
+    AVLNode<Key, Value, OrderStatistics>* pivot, AVLNode<Key, Value, OrderStatistics>* right, int rightHeight) {
+
+    if (leftHeight > rightHeight + 1) {
+        AVLNode<Key, Value, OrderStatistics>* parent = nullptr;
+        AVLNode<Key, Value, OrderStatistics>* current = left;
+        int currentHeight = leftHeight;
+        while (currentHeight > rightHeight + 1) {
+            parent = current;
+            currentHeight -= (current->getBalance() < 0) ? 2 : 1;
+            current = current->getRight();
+        }
+
+        pivot->setLeft(current);
+        pivot->setRight(right);
+        pivot->setParent(parent);
+        pivot->setBalance(rightHeight - currentHeight);
+        if (current != nullptr) {
+            current->setParent(pivot);
+        }
+        if (right != nullptr) {
+            right->setParent(pivot);
+        }
+        parent->setRight(pivot);
+        updateSize(pivot, StatisticsTag());
+        adjustSizesToRoot(parent, subtreeSize(right) + 1, StatisticsTag());
+
+        this->root_ = left;
+        return growFix(pivot) ? leftHeight + 1 : leftHeight;
+    }
+
+    if (rightHeight > leftHeight + 1) {
+        AVLNode<Key, Value, OrderStatistics>* parent = nullptr;
+        AVLNode<Key, Value, OrderStatistics>* current = right;
+        int currentHeight = rightHeight;
+        while (currentHeight > leftHeight + 1) {
+            parent = current;
+            currentHeight -= (current->getBalance() > 0) ? 2 : 1;
+            current = current->getLeft();
+        }
+
+        pivot->setLeft(left);
+        pivot->setRight(current);
+        pivot->setParent(parent);
+        pivot->setBalance(currentHeight - leftHeight);
+        if (left != nullptr) {
+            left->setParent(pivot);
+        }
+        if (current != nullptr) {
+            current->setParent(pivot);
+        }
+        parent->setLeft(pivot);
+        updateSize(pivot, StatisticsTag());
+        adjustSizesToRoot(parent, subtreeSize(left) + 1, StatisticsTag());
+
+        this->root_ = right;
+        return growFix(pivot) ? rightHeight + 1 : rightHeight;
+    }
+
+    //close enough in height for the pivot to simply sit on top
+    pivot->setLeft(left);
+    pivot->setRight(right);
+    pivot->setParent(nullptr);
+    pivot->setBalance(rightHeight - leftHeight);
+    if (left != nullptr) {
+        left->setParent(pivot);
+    }
+    if (right != nullptr) {
+        right->setParent(pivot);
+    }
+    updateSize(pivot, StatisticsTag());
+
+    this->root_ = pivot;
+    return std::max(leftHeight, rightHeight) + 1;
+}
+
+/**
+* Concatenates detached subtrees left and right, all of left's keys being
+* below right's, by splitting off left's last node to join them around.
+* The result is left in root_ and its height returned. O(log n).
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+int AVLTree<Key, Value, OrderStatistics, Compare>::joinSubtrees(AVLNode<Key, Value, OrderStatistics>* left, int leftHeight,
+    AVLNode<Key, Value, OrderStatistics>* right, int rightHeight) {
+
+    if (left == nullptr) {
+        this->root_ = right;
+        return rightHeight;
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* last = static_cast<AVLNode<Key, Value, OrderStatistics>*>(BinarySearchTree<Key, Value, Compare>::nodeMax(left));
+    AVLNode<Key, Value, OrderStatistics>* rest = nullptr;
+    AVLNode<Key, Value, OrderStatistics>* none = nullptr;
+    AVLNode<Key, Value, OrderStatistics>* match = nullptr;
+    int restHeight = 0;
+    int noneHeight = 0;
+    splitSubtree(left, leftHeight, last->getKey(), rest, restHeight, none, noneHeight, match);
+    return joinSubtrees(rest, restHeight, last, right, rightHeight);
+}
+
+/**
+* Retraces from n towards the root after n's subtree got one level taller
+* (not necessarily through an insertion, so n may be balanced).
+* @return true iff the whole tree got taller
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+bool AVLTree<Key, Value, OrderStatistics, Compare>::growFix(AVLNode<Key, Value, OrderStatistics>* n) {
+    while (n->getParent() != nullptr) {
+        AVLNode<Key, Value, OrderStatistics>* p = n->getParent();
+        int diff = (n == p->getLeft()) ? -1 : 1;
+        int pBalance = p->getBalance() + diff;
+
+        if (pBalance == 0) {
+            //p now evens out, its height did not change
+            p->setBalance(0);
+            return false;
+        }
+        if (pBalance == diff) {
+            //p leans towards n and got taller
+            p->setBalance(pBalance);
+            n = p;
+            continue;
+        }
+
+        //p is two taller on n's side
+        int nBalance = n->getBalance();
+        if (nBalance == -diff) {
+            //zig-zag: n's inner child comes up, and the height is back to what p's was
+            AVLNode<Key, Value, OrderStatistics>* g = (diff > 0) ? n->getLeft() : n->getRight();
+            if (diff > 0) {
+                rotateRight(n);
+                rotateLeft(p);
+            } else {
+                rotateLeft(n);
+                rotateRight(p);
+            }
+            int gBalance = g->getBalance();
+            p->setBalance(gBalance == diff ? -diff : 0);
+            n->setBalance(gBalance == -diff ? diff : 0);
+            g->setBalance(0);
+            return false;
+        }
+
+        if (diff > 0) {
+            rotateLeft(p);
+        } else {
+            rotateRight(p);
+        }
+        if (nBalance == diff) {
+            //zig-zig: both even out, the height is back to what p's was
+            p->setBalance(0);
+            n->setBalance(0);
+            return false;
+        }
+
+        //n was balanced, which never happens after an insertion: the
+        //rotation leaves n leaning back towards p and one taller than p was
+        p->setBalance(diff);
+        n->setBalance(-diff);
+    }
+    return true;
+}
+
+/**
+* Splits the detached subtree rooted at node, of the given height, into the
+* keys less than key (left) and greater than key (right), with their heights.
+* The node holding key, if any, comes out detached in match.
+* Each level joins what it keeps with the split of one child, and the joins'
+* costs telescope to O(log n) overall.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+void AVLTree<Key, Value, OrderStatistics, Compare>::splitSubtree(AVLNode<Key, Value, OrderStatistics>* node, int height, const Key& key,
+    AVLNode<Key, Value, OrderStatistics>*& left, int& leftHeight, AVLNode<Key, Value, OrderStatistics>*& right, int& rightHeight, AVLNode<Key, Value, OrderStatistics>*& match) {
+
+    if (node == nullptr) {
+        left = nullptr;
+        right = nullptr;
+        match = nullptr;
+        leftHeight = 0;
+        rightHeight = 0;
+        return;
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* lowerChild = node->getLeft();
+    AVLNode<Key, Value, OrderStatistics>* upperChild = node->getRight();
+    int lowerHeight = height - ((node->getBalance() > 0) ? 2 : 1);
+    int upperHeight = height - ((node->getBalance() < 0) ? 2 : 1);
+
+    if (lowerChild != nullptr) {
+        lowerChild->setParent(nullptr);
+    }
+    if (upperChild != nullptr) {
+        upperChild->setParent(nullptr);
+    }
+
+    if (this->keyLess(node->getKey(), key)) {
+        //node and everything left of it stay below key
+        AVLNode<Key, Value, OrderStatistics>* restLower = nullptr;
+        int restLowerHeight = 0;
+        splitSubtree(upperChild, upperHeight, key, restLower, restLowerHeight, right, rightHeight, match);
+        leftHeight = joinSubtrees(lowerChild, lowerHeight, node, restLower, restLowerHeight);
+        left = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    } else if (this->keyLess(key, node->getKey())) {
+        AVLNode<Key, Value, OrderStatistics>* restUpper = nullptr;
+        int restUpperHeight = 0;
+        splitSubtree(lowerChild, lowerHeight, key, left, leftHeight, restUpper, restUpperHeight, match);
+        rightHeight = joinSubtrees(restUpper, restUpperHeight, node, upperChild, upperHeight);
+        right = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    } else {
+        //found key: its subtrees are the two parts
+        left = lowerChild;
+        leftHeight = lowerHeight;
+        right = upperChild;
+        rightHeight = upperHeight;
+        node->setLeft(nullptr);
+        node->setRight(nullptr);
+        node->setParent(nullptr);
+        match = node;
+    }
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::set_union(AVLTree&& a, AVLTree&& b, unsigned threads) {
+    return setOperation(a, b, SET_UNION, threads);
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::set_intersection(AVLTree&& a, AVLTree&& b, unsigned threads) {
+    return setOperation(a, b, SET_INTERSECTION, threads);
+}
+
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::set_difference(AVLTree&& a, AVLTree&& b, unsigned threads) {
+    return setOperation(a, b, SET_DIFFERENCE, threads);
+}
+
+/**
+* Combines a and b into a tree that takes over both their nodes and arenas.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>
+AVLTree<Key, Value, OrderStatistics, Compare>::setOperation(AVLTree& a, AVLTree& b, SetOperation op, unsigned threads) {
+    if (&a == &b) {
+        //every key of the tree is in both operands, so there is nothing to split
+        AVLTree result(std::move(a));
+        if (op == SET_DIFFERENCE) {
+            result.clear();
+        }
+        return result;
+    }
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    AVLTree result(std::move(a));
+    result.adoptArenas(b);
+
+    AVLNode<Key, Value, OrderStatistics>* aRoot = static_cast<AVLNode<Key, Value, OrderStatistics>*>(result.root_);
+    AVLNode<Key, Value, OrderStatistics>* bRoot = static_cast<AVLNode<Key, Value, OrderStatistics>*>(b.root_);
+    b.root_ = nullptr;
+    b.size_ = 0;
+    b.resetArena();
+
+    AVLNode<Key, Value, OrderStatistics>* combined = nullptr;
+    std::vector<AVLNode<Key, Value, OrderStatistics>*> dropped;
+    result.combineSubtrees(op, aRoot, treeHeight(aRoot), bRoot, treeHeight(bRoot), combined, dropped, threads);
+
+    result.root_ = combined;
+    result.size_ = sizeFromRoot(combined, BinarySearchTree<Key, Value, Compare>::UNKNOWN_SIZE, StatisticsTag());
+    //the result interleaves both trees' nodes, so its threads are laid anew: O(n)
+    BinarySearchTree<Key, Value, Compare>::threadSubtree(combined);
+    for (std::size_t i = 0; i < dropped.size(); ++i) {
+        result.clearSubtree(dropped[i]);
+    }
+    return result;
+}
+
+/**
+* Applies op to the detached subtrees a and b, of the given heights.
+* The result's root goes in result and its height is returned; subtrees
+* left out of it are added to dropped.
+*/
+template <class Key, class Value, bool OrderStatistics, class Compare>
+int AVLTree<Key, Value, OrderStatistics, Compare>::combineSubtrees(SetOperation op, AVLNode<Key, Value, OrderStatistics>* a, int aHeight,
+    AVLNode<Key, Value, OrderStatistics>* b, int bHeight, AVLNode<Key, Value, OrderStatistics>*& result, std::vector<AVLNode<Key, Value, OrderStatistics>*>& dropped, unsigned threads) {
+
+    if (a == nullptr || b == nullptr) {
+        //what is left of b only survives a union, what is left of a a union or
+        //a difference; an intersection keeps neither
+        AVLNode<Key, Value, OrderStatistics>* kept = (a == nullptr) ? b : a;
+        bool keep = (op == SET_UNION) || (op == SET_DIFFERENCE && a != nullptr);
+        if (!keep) {
+            if (kept != nullptr) {
+                dropped.push_back(kept);
+            }
+            result = nullptr;
+            return 0;
+        }
+        result = kept;
+        return (a == nullptr) ? bHeight : aHeight;
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* aLower = a->getLeft();
+    AVLNode<Key, Value, OrderStatistics>* aUpper = a->getRight();
+    int aLowerHeight = aHeight - ((a->getBalance() > 0) ? 2 : 1);
+    int aUpperHeight = aHeight - ((a->getBalance() < 0) ? 2 : 1);
+    if (aLower != nullptr) {
+        aLower->setParent(nullptr);
+    }
+    if (aUpper != nullptr) {
+        aUpper->setParent(nullptr);
+    }
+    a->setLeft(nullptr);
+    a->setRight(nullptr);
+
+    AVLNode<Key, Value, OrderStatistics>* bLower = nullptr;
+    AVLNode<Key, Value, OrderStatistics>* bUpper = nullptr;
+    AVLNode<Key, Value, OrderStatistics>* match = nullptr;
+    int bLowerHeight = 0;
+    int bUpperHeight = 0;
+    splitSubtree(b, bHeight, a->getKey(), bLower, bLowerHeight, bUpper, bUpperHeight, match);
+    if (match != nullptr) {
+        dropped.push_back(match);
+    }
+
+    AVLNode<Key, Value, OrderStatistics>* lower = nullptr;
+    AVLNode<Key, Value, OrderStatistics>* upper = nullptr;
+    int lowerHeight = 0;
+    int upperHeight = 0;
+    if (threads > 1 && aHeight >= PARALLEL_MIN_HEIGHT) {
+        //the lower halves go to another thread, working in a tree of its own
+        AVLTree helper;
+        std::vector<AVLNode<Key, Value, OrderStatistics>*> helperDropped;
+        unsigned helperThreads = threads / 2;
+        std::future<int> helperHeight;
+        try {
+            helperHeight = std::async(std::launch::async, [&]() {
+                return helper.combineSubtrees(op, aLower, aLowerHeight, bLower, bLowerHeight, lower, helperDropped, helperThreads);
+            });
+        } catch (const std::system_error&) {
+            //no thread could be started: both halves are worked on here, as
+            //the subtrees are already taken apart, and no more threads tried
+            threads = 1;
+            helperThreads = 0;
+        }
+        upperHeight = combineSubtrees(op, aUpper, aUpperHeight, bUpper, bUpperHeight, upper, dropped, threads - helperThreads);
+        if (helperHeight.valid()) {
+            lowerHeight = helperHeight.get();
+            helper.root_ = nullptr;
+            dropped.insert(dropped.end(), helperDropped.begin(), helperDropped.end());
+        } else {
+            lowerHeight = combineSubtrees(op, aLower, aLowerHeight, bLower, bLowerHeight, lower, dropped, 1);
+        }
+    } else {
+        lowerHeight = combineSubtrees(op, aLower, aLowerHeight, bLower, bLowerHeight, lower, dropped, 1);
+        upperHeight = combineSubtrees(op, aUpper, aUpperHeight, bUpper, bUpperHeight, upper, dropped, 1);
+    }
+
+    bool keepPivot = (op == SET_UNION) || ((op == SET_INTERSECTION) == (match != nullptr));
+    int height = 0;
+    if (keepPivot) {
+        height = joinSubtrees(lower, lowerHeight, a, upper, upperHeight);
+    } else {
+        dropped.push_back(a);
+        height = joinSubtrees(lower, lowerHeight, upper, upperHeight);
+    }
+    result = static_cast<AVLNode<Key, Value, OrderStatistics>*>(this->root_);
+    return height;
 }
 
 #endif
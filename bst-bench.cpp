@@ -0,0 +1,1058 @@
+// Micro benchmarks for the search trees.
+// Usage: ./bst-bench [--csv | --json] [numKeys] [footprintKeys]
+// Results are printed as text, or with --csv / --json as one record per
+// measurement (benchmark, variant, n, value, unit) for tracking regressions.
+// The frozen lookup sweep goes from 1K keys up to numKeys; 100M needs about 10 GB.
+// The memory footprint comparison loads footprintKeys keys (50M by default,
+// about 2.5 GB at a time) into each tree in turn.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bst.h"
+#include "avlbst.h"
+#include "btree.h"
+#include "compact_avlbst.h"
+#include "concurrent_avlbst.h"
+#include "persistent_avlbst.h"
+#include "snapshot.h"
+
+using namespace std;
+
+// results are written here so the compiler cannot drop the benchmarked work
+volatile long benchSink;
+
+// wall clock stopwatch, reports milliseconds
+class BenchTimer
+{
+public:
+	BenchTimer() : start_(chrono::steady_clock::now()) {}
+
+	double elapsedMs() const
+	{
+		return chrono::duration<double, milli>(chrono::steady_clock::now() - start_).count();
+	}
+
+private:
+	chrono::steady_clock::time_point start_;
+};
+
+enum ReportFormat { REPORT_TEXT, REPORT_CSV, REPORT_JSON };
+ReportFormat reportFormat = REPORT_TEXT;
+size_t reportCount = 0;
+
+void reportValue(const char* benchmark, const char* variant, size_t n, double value, const char* unit)
+{
+	switch(reportFormat) {
+	case REPORT_TEXT:
+		cout << benchmark << "/" << variant << " n=" << n << ": " << value << " " << unit << endl;
+		break;
+	case REPORT_CSV:
+		if(reportCount == 0) {
+			cout << "benchmark,variant,n,value,unit" << endl;
+		}
+		cout << benchmark << "," << variant << "," << n << "," << value << "," << unit << endl;
+		break;
+	case REPORT_JSON:
+		cout << (reportCount == 0 ? "[\n" : ",\n") << "  {\"benchmark\": \"" << benchmark << "\", \"variant\": \"" << variant
+			<< "\", \"n\": " << n << ", \"value\": " << value << ", \"unit\": \"" << unit << "\"}" << flush;
+		break;
+	}
+	++reportCount;
+}
+
+void report(const char* benchmark, const char* variant, size_t n, double ms)
+{
+	reportValue(benchmark, variant, n, ms, "ms");
+}
+
+// closes the JSON array once every benchmark has reported
+void finishReport()
+{
+	if(reportFormat == REPORT_JSON) {
+		cout << (reportCount == 0 ? "[" : "\n") << "]" << endl;
+	}
+}
+
+vector<int> shuffledKeys(size_t n, unsigned seed)
+{
+	vector<int> keys(n);
+	for(size_t i = 0; i < n; ++i) {
+		keys[i] = (int)i;
+	}
+	mt19937 randEngine(seed);
+	shuffle(keys.begin(), keys.end(), randEngine);
+	return keys;
+}
+
+// one heap allocation per node (what the trees used to do) against the slab arena
+void benchNodeAllocation(size_t n)
+{
+	long checksum = 0;
+	vector<AVLNode<int, int>*> nodes(n);
+
+	{
+		BenchTimer timer;
+		for(size_t i = 0; i < n; ++i) {
+			nodes[i] = new AVLNode<int, int>((int)i, (int)i, nullptr);
+		}
+		for(size_t i = 0; i < n; ++i) {
+			checksum += nodes[i]->getKey();
+			delete nodes[i];
+		}
+		report("alloc", "new-delete", n, timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		NodeArena arena(sizeof(AVLNode<int, int>), alignof(AVLNode<int, int>));
+		for(size_t i = 0; i < n; ++i) {
+			nodes[i] = new (arena.allocate()) AVLNode<int, int>((int)i, (int)i, nullptr);
+		}
+		for(size_t i = 0; i < n; ++i) {
+			checksum += nodes[i]->getKey();
+		}
+		arena.release();
+		report("alloc", "arena", n, timer.elapsedMs());
+	}
+
+	benchSink = checksum;
+}
+
+// n draws from a Zipf distribution (exponent 0.99) over n distinct keys, so a
+// few keys come up again and again; the popular keys are scattered over
+// the key range rather than being the smallest
+vector<int> zipfKeys(size_t n, unsigned seed)
+{
+	vector<double> weights(n);
+	for(size_t i = 0; i < n; ++i) {
+		weights[i] = 1.0 / pow((double)(i + 1), 0.99);
+	}
+	discrete_distribution<size_t> rankDist(weights.begin(), weights.end());
+	vector<int> byRank = shuffledKeys(n, seed);
+
+	vector<int> keys(n);
+	mt19937 randEngine(seed + 1);
+	for(size_t i = 0; i < n; ++i) {
+		keys[i] = byRank[rankDist(randEngine)];
+	}
+	return keys;
+}
+
+template<typename Tree>
+void removeKey(Tree& tree, int key)
+{
+	tree.remove(key);
+}
+
+void removeKey(map<int, int>& tree, int key)
+{
+	tree.erase(key);
+}
+
+// the life of a tree fed one key stream: inserting every key (repeats
+// overwrite), finding every key, a full in-order scan, removing every
+// other key of the stream, then clearing what is left
+template<typename Tree>
+void benchOperations(const char* name, const char* stream, const vector<int>& keys)
+{
+	const string suffix = string("-") + stream;
+	Tree tree;
+	long checksum = 0;
+
+	BenchTimer insertTimer;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		tree.insert(std::make_pair(keys[i], keys[i]));
+	}
+	report(("insert" + suffix).c_str(), name, keys.size(), insertTimer.elapsedMs());
+
+	BenchTimer findTimer;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		checksum += tree.find(keys[i])->second;
+	}
+	report(("find" + suffix).c_str(), name, keys.size(), findTimer.elapsedMs());
+
+	BenchTimer iterateTimer;
+	for(typename Tree::iterator it = tree.begin(); it != tree.end(); ++it) {
+		checksum += it->second;
+	}
+	report(("iterate" + suffix).c_str(), name, keys.size(), iterateTimer.elapsedMs());
+
+	BenchTimer removeTimer;
+	for(size_t i = 0; i < keys.size(); i += 2) {
+		removeKey(tree, keys[i]);
+	}
+	report(("remove" + suffix).c_str(), name, keys.size(), removeTimer.elapsedMs());
+
+	BenchTimer clearTimer;
+	tree.clear();
+	report(("clear" + suffix).c_str(), name, keys.size(), clearTimer.elapsedMs());
+
+	benchSink = checksum;
+}
+
+// every tree against std::map on sorted, random and Zipf key streams
+void benchOperationSuite(size_t n)
+{
+	vector<int> sorted(n);
+	for(size_t i = 0; i < n; ++i) {
+		sorted[i] = (int)i;
+	}
+	// the unbalanced tree degenerates into a list on sorted input, so it
+	// only gets a prefix of the stream it can get through in O(n^2)
+	vector<int> sortedPrefix(sorted.begin(), sorted.begin() + min(n, (size_t)20000));
+
+	const char* streams[] = { "sorted", "random", "zipf" };
+	vector<int> keys[] = { sorted, shuffledKeys(n, 104), zipfKeys(n, 151) };
+	for(size_t s = 0; s < 3; ++s) {
+		benchOperations<AVLTree<int, int> >("AVLTree", streams[s], keys[s]);
+		benchOperations<BinarySearchTree<int, int> >("BinarySearchTree", streams[s], s == 0 ? sortedPrefix : keys[s]);
+		benchOperations<BTree<int, int, 16> >("BTree-16", streams[s], keys[s]);
+		benchOperations<BTree<int, int> >("BTree-64", streams[s], keys[s]);
+		benchOperations<BTree<int, int, 256> >("BTree-256", streams[s], keys[s]);
+		benchOperations<CompactAVLTree<int, int> >("CompactAVLTree", streams[s], keys[s]);
+		benchOperations<map<int, int> >("std::map", streams[s], keys[s]);
+	}
+}
+
+// full forward and reverse scans; reverse used to mean copying the items out first.
+// The iterators climb parent links, for_each keeps a stack; the items already
+// laid out in a vector are the bound for either.
+void benchIterateDirections(const vector<int>& keys)
+{
+	AVLTree<int, string> tree;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		tree.insert(std::make_pair(keys[i], to_string(keys[i])));
+	}
+
+	long checksum = 0;
+
+	{
+		BenchTimer timer;
+		for(AVLTree<int, string>::const_iterator it = tree.cbegin(); it != tree.cend(); ++it) {
+			checksum += it->first;
+		}
+		report("iterate-forward", "iterator", keys.size(), timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		tree.for_each([&checksum](const pair<const int, string>& item) { checksum += item.first; });
+		report("iterate-forward", "for_each", keys.size(), timer.elapsedMs());
+	}
+
+	{
+		vector<pair<int, string> > items(tree.cbegin(), tree.cend());
+		BenchTimer timer;
+		for(vector<pair<int, string> >::const_iterator it = items.begin(); it != items.end(); ++it) {
+			checksum += it->first;
+		}
+		report("iterate-forward", "vector", keys.size(), timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		vector<pair<int, string> > items(tree.cbegin(), tree.cend());
+		for(vector<pair<int, string> >::reverse_iterator it = items.rbegin(); it != items.rend(); ++it) {
+			checksum += it->first;
+		}
+		report("iterate-reverse", "copy", keys.size(), timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		for(AVLTree<int, string>::const_reverse_iterator it = tree.rbegin(); it != tree.rend(); ++it) {
+			checksum += it->first;
+		}
+		report("iterate-reverse", "reverse_iterator", keys.size(), timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		tree.for_each_reverse([&checksum](const pair<const int, string>& item) { checksum += item.first; });
+		report("iterate-reverse", "for_each_reverse", keys.size(), timer.elapsedMs());
+	}
+
+	benchSink = checksum;
+}
+
+// short [a, a + 16) scans: filtering a full walk against seeking with range()
+// or for_each_range()
+void benchRangeQuery(const vector<int>& keys)
+{
+	AVLTree<int, int> tree;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		tree.insert(std::make_pair(keys[i], keys[i]));
+	}
+
+	// the full walks are O(n) each, so they get far fewer queries
+	const size_t scanQueries = 10;
+	const size_t rangeQueries = 100000;
+	const int width = 16;
+	long checksum = 0;
+
+	{
+		BenchTimer timer;
+		for(size_t q = 0; q < scanQueries; ++q) {
+			int a = keys[q % keys.size()];
+			for(AVLTree<int, int>::iterator it = tree.begin(); it != tree.end(); ++it) {
+				if(a <= it->first && it->first < a + width) {
+					checksum += it->second;
+				}
+			}
+		}
+		report("range-query", "full-scan", scanQueries, timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		for(size_t q = 0; q < rangeQueries; ++q) {
+			int a = keys[q % keys.size()];
+			for(std::pair<const int, int>& item : tree.range(a, a + width)) {
+				checksum += item.second;
+			}
+		}
+		report("range-query", "range", rangeQueries, timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		for(size_t q = 0; q < rangeQueries; ++q) {
+			int a = keys[q % keys.size()];
+			tree.for_each_range(a, a + width, [&checksum](const pair<const int, int>& item) { checksum += item.second; });
+		}
+		report("range-query", "for_each_range", rangeQueries, timer.elapsedMs());
+	}
+
+	benchSink = checksum;
+}
+
+// percentile lookups: walking the iterator to the i-th item against select(),
+// plus what keeping subtree sizes costs on insert
+void benchOrderStatistics(const vector<int>& keys)
+{
+	AVLTree<int, int, true> ranked;
+	BenchTimer loadTimer;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		ranked.insert(std::make_pair(keys[i], keys[i]));
+	}
+	report("load", "AVLTree-ranked", keys.size(), loadTimer.elapsedMs());
+
+	// the walks are O(n) each, so they get far fewer queries
+	const size_t walkQueries = 10;
+	const size_t selectQueries = 100000;
+	long checksum = 0;
+
+	{
+		BenchTimer timer;
+		for(size_t q = 0; q < walkQueries; ++q) {
+			size_t target = (size_t)keys[q % keys.size()];
+			AVLTree<int, int, true>::iterator it = ranked.begin();
+			for(size_t i = 0; i < target; ++i) {
+				++it;
+			}
+			checksum += it->first;
+		}
+		report("select", "iterator-walk", walkQueries, timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		for(size_t q = 0; q < selectQueries; ++q) {
+			checksum += ranked.select((size_t)keys[q % keys.size()])->first;
+		}
+		report("select", "select", selectQueries, timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		for(size_t q = 0; q < selectQueries; ++q) {
+			checksum += (long)ranked.rank(keys[q % keys.size()]);
+		}
+		report("rank", "rank", selectQueries, timer.elapsedMs());
+	}
+
+	benchSink = checksum;
+}
+
+// sorted ingest batches (4 upserts to every delete): one call per op against apply_batch
+void benchApplyBatch(const vector<int>& keys)
+{
+	size_t batchSizes[] = { 10000, 100000, keys.size(), 4 * keys.size() };
+	mt19937 randEngine(110);
+
+	for(size_t b = 0; b < sizeof(batchSizes) / sizeof(batchSizes[0]); ++b) {
+		size_t k = batchSizes[b];
+		vector<BatchOp<int, int> > ops;
+		for(size_t i = 0; i < k; ++i) {
+			int key = (int)(randEngine() % (2 * keys.size()));
+			if(i % 5 == 4) {
+				ops.push_back(BatchOp<int, int>(key));
+			}else {
+				ops.push_back(BatchOp<int, int>(key, key));
+			}
+		}
+		stable_sort(ops.begin(), ops.end(),
+			[](const BatchOp<int, int>& x, const BatchOp<int, int>& y) { return x.key < y.key; });
+
+		{
+			AVLTree<int, int> tree;
+			for(size_t i = 0; i < keys.size(); ++i) {
+				tree.insert(std::make_pair(keys[i], keys[i]));
+			}
+			BenchTimer timer;
+			for(size_t i = 0; i < ops.size(); ++i) {
+				if(ops[i].remove) {
+					tree.remove(ops[i].key);
+				}else {
+					tree.insert_or_assign(ops[i].key, ops[i].value);
+				}
+			}
+			report("batch", "per-key", k, timer.elapsedMs());
+		}
+
+		{
+			AVLTree<int, int> tree;
+			for(size_t i = 0; i < keys.size(); ++i) {
+				tree.insert(std::make_pair(keys[i], keys[i]));
+			}
+			BenchTimer timer;
+			tree.apply_batch(ops.begin(), ops.end());
+			report("batch", "apply_batch", k, timer.elapsedMs());
+		}
+	}
+}
+
+// splitting at a key and joining back: copying into two trees against split() and join()
+void benchSplitJoin(const vector<int>& keys)
+{
+	AVLTree<int, int> tree;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		tree.insert(std::make_pair(keys[i], keys[i]));
+	}
+
+	// copying into two fresh trees is O(n) per split, so it gets one round
+	const size_t copyRounds = 1;
+	const size_t splitRounds = 100000;
+	long checksum = 0;
+
+	{
+		BenchTimer timer;
+		for(size_t r = 0; r < copyRounds; ++r) {
+			int pivot = keys[r % keys.size()];
+			AVLTree<int, int> lower, upper;
+			for(AVLTree<int, int>::iterator it = tree.begin(); it != tree.end(); ++it) {
+				if(it->first < pivot) {
+					lower.insert(*it);
+				}else {
+					upper.insert(*it);
+				}
+			}
+			checksum += (long)lower.size();
+		}
+		report("split+join", "copy", copyRounds, timer.elapsedMs());
+	}
+
+	{
+		BenchTimer timer;
+		for(size_t r = 0; r < splitRounds; ++r) {
+			std::pair<AVLTree<int, int>, AVLTree<int, int> > parts = tree.split(keys[r % keys.size()]);
+			checksum += parts.first.empty() ? 0 : 1;
+			tree = AVLTree<int, int>::join(parts.first, parts.second);
+		}
+		report("split+join", "split-join", splitRounds, timer.elapsedMs());
+	}
+
+	benchSink = checksum;
+}
+
+AVLTree<int, int> sortedTree(int first, size_t n, int step)
+{
+	vector<pair<int, int> > items(n);
+	for(size_t i = 0; i < n; ++i) {
+		items[i] = make_pair(first + (int)i * step, (int)i);
+	}
+	AVLTree<int, int> tree;
+	tree.assign_sorted(items.begin(), items.end());
+	return tree;
+}
+
+// two n key trees overlapping by half, and a small tree spread over a big one
+void benchSetOperations(size_t n)
+{
+	{
+		AVLTree<int, int> a = sortedTree(0, n, 1);
+		AVLTree<int, int> b = sortedTree((int)n / 2, n, 1);
+		BenchTimer timer;
+		for(AVLTree<int, int>::iterator it = b.begin(); it != b.end(); ++it) {
+			if(a.find(it->first) == a.end()) {
+				a.insert(*it);
+			}
+		}
+		report("set-union", "insert", n, timer.elapsedMs());
+	}
+
+	unsigned maxThreads = max(4u, thread::hardware_concurrency());
+	for(unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+		string variant = "set_union-t" + to_string(threads);
+		AVLTree<int, int> a = sortedTree(0, n, 1);
+		AVLTree<int, int> b = sortedTree((int)n / 2, n, 1);
+		BenchTimer timer;
+		AVLTree<int, int> result = AVLTree<int, int>::set_union(std::move(a), std::move(b), threads);
+		report("set-union", variant.c_str(), n, timer.elapsedMs());
+		benchSink = (long)result.size();
+	}
+
+	for(unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+		string variant = "set_intersection-t" + to_string(threads);
+		AVLTree<int, int> a = sortedTree(0, n, 1);
+		AVLTree<int, int> b = sortedTree((int)n / 2, n, 1);
+		BenchTimer timer;
+		AVLTree<int, int> result = AVLTree<int, int>::set_intersection(std::move(a), std::move(b), threads);
+		report("set-intersection", variant.c_str(), n, timer.elapsedMs());
+		benchSink = (long)result.size();
+	}
+
+	const size_t small = max((size_t)1, n / 1000);
+	{
+		AVLTree<int, int> a = sortedTree(0, n, 1);
+		AVLTree<int, int> b = sortedTree(1, small, 1000);
+		BenchTimer timer;
+		for(AVLTree<int, int>::iterator it = b.begin(); it != b.end(); ++it) {
+			a.insert(*it);
+		}
+		report("set-union-small", "insert", small, timer.elapsedMs());
+	}
+
+	{
+		AVLTree<int, int> a = sortedTree(0, n, 1);
+		AVLTree<int, int> b = sortedTree(1, small, 1000);
+		BenchTimer timer;
+		AVLTree<int, int> result = AVLTree<int, int>::set_union(std::move(b), std::move(a), 1);
+		report("set-union-small", "set_union", small, timer.elapsedMs());
+		benchSink = (long)result.size();
+	}
+}
+
+// the usual workaround, one mutex around a plain AVLTree
+class LockedAVLTree
+{
+public:
+	bool find(int key, int& value)
+	{
+		lock_guard<mutex> guard(lock_);
+		AVLTree<int, int>::iterator it = tree_.find(key);
+		if(it == tree_.end()) {
+			return false;
+		}
+		value = it->second;
+		return true;
+	}
+
+	void insert(const pair<const int, int>& item)
+	{
+		lock_guard<mutex> guard(lock_);
+		tree_.insert(item);
+	}
+
+	void remove(int key)
+	{
+		lock_guard<mutex> guard(lock_);
+		tree_.remove(key);
+	}
+
+private:
+	mutex lock_;
+	AVLTree<int, int> tree_;
+};
+
+// every thread runs ops operations over keys [0, 2 * prefilled), readPercent
+// of them finds and the rest split evenly between inserts and removes
+template<class TreeType>
+double runMixedWorkload(TreeType& tree, size_t prefilled, size_t ops, unsigned threads, unsigned readPercent)
+{
+	vector<thread> workers;
+	BenchTimer timer;
+	for(unsigned t = 0; t < threads; ++t) {
+		workers.push_back(thread([&tree, prefilled, ops, readPercent, t]() {
+			mt19937 randEngine(1000 + t);
+			uniform_int_distribution<int> keyDist(0, (int)(2 * prefilled) - 1);
+			uniform_int_distribution<unsigned> opDist(0, 199);
+			long found = 0;
+			int value = 0;
+			for(size_t i = 0; i < ops; ++i) {
+				int key = keyDist(randEngine);
+				unsigned op = opDist(randEngine);
+				if(op < 2 * readPercent) {
+					found += tree.find(key, value);
+				}else if(op % 2 == 0) {
+					tree.insert(make_pair(key, key));
+				}else {
+					tree.remove(key);
+				}
+			}
+			benchSink = found;
+		}));
+	}
+	for(size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+	return timer.elapsedMs();
+}
+
+// throughput of the lock based and the concurrent tree on a read heavy, a
+// mostly read and a write heavy mix, with the same total work at every thread count
+void benchConcurrentMixed(size_t n)
+{
+	const unsigned readPercents[] = { 100, 90, 50 };
+	unsigned maxThreads = max(4u, thread::hardware_concurrency());
+	vector<int> keys = shuffledKeys(n, 113);
+	for(size_t r = 0; r < sizeof(readPercents) / sizeof(readPercents[0]); ++r) {
+		for(unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+			string suffix = "-r" + to_string(readPercents[r]) + "-t" + to_string(threads);
+			{
+				LockedAVLTree tree;
+				for(size_t i = 0; i < n; i += 2) {
+					tree.insert(make_pair(keys[i], keys[i]));
+				}
+				double ms = runMixedWorkload(tree, n / 2, n / threads, threads, readPercents[r]);
+				report("concurrent-mixed", ("mutex" + suffix).c_str(), n, ms);
+			}
+			{
+				ConcurrentAVLTree<int, int> tree;
+				for(size_t i = 0; i < n; i += 2) {
+					tree.insert(make_pair(keys[i], keys[i]));
+				}
+				double ms = runMixedWorkload(tree, n / 2, n / threads, threads, readPercents[r]);
+				report("concurrent-mixed", ("concurrent" + suffix).c_str(), n, ms);
+			}
+		}
+	}
+}
+
+// a reader taking a consistent view between writes: copying the whole tree
+// against an O(1) snapshot, and what path copying costs each write
+void benchPersistentSnapshots(const vector<int>& keys)
+{
+	const size_t writes = 100000;
+	const size_t viewEvery = 10000;
+	long checksum = 0;
+
+	{
+		AVLTree<int, int> tree;
+		for(size_t i = 0; i < keys.size(); ++i) {
+			tree.insert(make_pair(keys[i], keys[i]));
+		}
+		BenchTimer timer;
+		for(size_t i = 0; i < writes; ++i) {
+			if(i % viewEvery == 0) {
+				AVLTree<int, int> view(tree.begin(), tree.end());
+				checksum += (long)view.size();
+			}
+			tree.insert(make_pair(keys[i % keys.size()], (int)i));
+		}
+		report("snapshot-writes", "AVLTree-copy", writes, timer.elapsedMs());
+	}
+
+	{
+		PersistentAVLTree<int, int> tree;
+		for(size_t i = 0; i < keys.size(); ++i) {
+			tree.insert(make_pair(keys[i], keys[i]));
+		}
+		BenchTimer timer;
+		for(size_t i = 0; i < writes; ++i) {
+			if(i % viewEvery == 0) {
+				PersistentAVLTree<int, int> view = tree.snapshot();
+				checksum += (long)view.size();
+			}
+			tree.insert(make_pair(keys[i % keys.size()], (int)i));
+		}
+		report("snapshot-writes", "PersistentAVLTree", writes, timer.elapsedMs());
+	}
+
+	{
+		// every snapshot is kept alive, so no copied path is ever freed
+		PersistentAVLTree<int, int> tree;
+		for(size_t i = 0; i < keys.size(); ++i) {
+			tree.insert(make_pair(keys[i], keys[i]));
+		}
+		vector<PersistentAVLTree<int, int> > views;
+		BenchTimer timer;
+		for(size_t i = 0; i < writes; ++i) {
+			views.push_back(tree.snapshot());
+			tree.insert(make_pair(keys[i % keys.size()], (int)i));
+		}
+		report("snapshot-writes", "PersistentAVLTree-keep-all", writes, timer.elapsedMs());
+		checksum += (long)views.size();
+	}
+
+	benchSink = checksum;
+}
+
+// random lookups in the pointer tree against its frozen Eytzinger copy,
+// from 1K keys up to maxKeys in steps of 10x
+void benchFrozenLookups(size_t maxKeys)
+{
+	const size_t lookups = 1000000;
+	for(size_t n = 1000; n <= maxKeys; n *= 10) {
+		AVLTree<int, int> tree;
+		{
+			vector<int> keys = shuffledKeys(n, 127);
+			for(size_t i = 0; i < n; ++i) {
+				tree.insert(make_pair(2 * keys[i], keys[i]));
+			}
+		}
+		FrozenMap<int, int> frozen = tree.freeze();
+
+		// odd probes miss, so half the lookups fail
+		vector<int> probes(lookups);
+		mt19937 randEngine(131);
+		uniform_int_distribution<int> probeDist(0, (int)(2 * n) - 1);
+		for(size_t i = 0; i < lookups; ++i) {
+			probes[i] = probeDist(randEngine);
+		}
+
+		long found = 0;
+		{
+			BenchTimer timer;
+			for(size_t i = 0; i < lookups; ++i) {
+				found += tree.find(probes[i]) != tree.end();
+			}
+			report("frozen-find", "AVLTree", n, timer.elapsedMs());
+		}
+		{
+			BenchTimer timer;
+			for(size_t i = 0; i < lookups; ++i) {
+				found += frozen.find(probes[i]) != frozen.end();
+			}
+			report("frozen-find", "FrozenMap", n, timer.elapsedMs());
+		}
+		{
+			BenchTimer timer;
+			for(size_t i = 0; i < lookups; ++i) {
+				AVLTree<int, int>::iterator it = tree.lower_bound(probes[i]);
+				found += it != tree.end() ? it->second : 0;
+			}
+			report("frozen-lower_bound", "AVLTree", n, timer.elapsedMs());
+		}
+		{
+			BenchTimer timer;
+			for(size_t i = 0; i < lookups; ++i) {
+				FrozenMap<int, int>::const_iterator it = frozen.lower_bound(probes[i]);
+				found += it != frozen.end() ? it->second : 0;
+			}
+			report("frozen-lower_bound", "FrozenMap", n, timer.elapsedMs());
+		}
+		benchSink = found;
+	}
+}
+
+// string keys looked up by C string: std::less builds a std::string per lookup,
+// TransparentLess compares the C string with the stored keys as is
+template<typename Compare>
+void benchStringLookup(const char* name, const vector<string>& keys, const vector<const char*>& probes)
+{
+	AVLTree<string, int, false, Compare> tree;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		tree.insert(make_pair(keys[i], (int)i));
+	}
+
+	long found = 0;
+	BenchTimer timer;
+	for(size_t i = 0; i < probes.size(); ++i) {
+		found += tree.find(probes[i]) != tree.end();
+	}
+	report("string-find", name, keys.size(), timer.elapsedMs());
+	benchSink = found;
+}
+
+void benchStringLookups(size_t n)
+{
+	// longer than the small string buffer, so each temporary allocates
+	vector<string> keys(n);
+	vector<int> order = shuffledKeys(n, 137);
+	for(size_t i = 0; i < n; ++i) {
+		keys[i] = "session/" + to_string(100000000 + 2 * order[i]);
+	}
+
+	const size_t lookups = 1000000;
+	vector<string> probeText(lookups);
+	vector<const char*> probes(lookups);
+	mt19937 randEngine(139);
+	uniform_int_distribution<int> probeDist(0, (int)(2 * n) - 1);
+	for(size_t i = 0; i < lookups; ++i) {
+		probeText[i] = "session/" + to_string(100000000 + probeDist(randEngine));
+		probes[i] = probeText[i].c_str();
+	}
+
+	benchStringLookup<less<string> >("std::less", keys, probes);
+	benchStringLookup<TransparentLess>("TransparentLess", keys, probes);
+}
+
+// startup from an already sorted dump: one insert per key against a bulk build
+void benchSortedLoad(size_t n)
+{
+	vector<pair<int, int> > dump(n);
+	for(size_t i = 0; i < n; ++i) {
+		dump[i] = make_pair((int)i, (int)i);
+	}
+
+	{
+		AVLTree<int, int> tree;
+		BenchTimer timer;
+		for(size_t i = 0; i < n; ++i) {
+			tree.insert(dump[i]);
+		}
+		report("sorted-load", "insert", n, timer.elapsedMs());
+	}
+
+	{
+		AVLTree<int, int> tree;
+		BenchTimer timer;
+		tree.assign_sorted(dump.begin(), dump.end());
+		report("sorted-load", "assign_sorted", n, timer.elapsedMs());
+	}
+
+	{
+		vector<pair<int, int> > shuffled(dump);
+		mt19937 randEngine(106);
+		shuffle(shuffled.begin(), shuffled.end(), randEngine);
+		AVLTree<int, int> tree;
+		BenchTimer timer;
+		tree.assign_sorted(shuffled.begin(), shuffled.end());
+		report("sorted-load", "assign_unsorted", n, timer.elapsedMs());
+	}
+}
+
+// restarting with n items: inserting them all again against loading a
+// snapshot, as a tree or queried in place. The file stays in the page
+// cache, so this measures the CPU side of a cold start, not the disk.
+void benchSnapshot(size_t n)
+{
+	const char* path = "bst-bench.snapshot";
+	vector<int> keys = shuffledKeys(n, 157);
+
+	AVLTree<int, int> tree;
+	{
+		BenchTimer timer;
+		for(size_t i = 0; i < n; ++i) {
+			tree.insert(make_pair(keys[i], keys[i]));
+		}
+		report("snapshot", "reinsert", n, timer.elapsedMs());
+	}
+	{
+		BenchTimer timer;
+		Snapshot::save(path, tree);
+		report("snapshot", "save", n, timer.elapsedMs());
+	}
+	tree.clear();
+
+	{
+		BenchTimer timer;
+		Snapshot::load(path, tree);
+		report("snapshot", "load-AVLTree", n, timer.elapsedMs());
+	}
+	{
+		BenchTimer timer;
+		Snapshot::load(path, tree, false);
+		report("snapshot", "load-AVLTree-unverified", n, timer.elapsedMs());
+	}
+
+	// time to the first answers: mapping the file, then 1M lookups that
+	// fault in the pages they touch
+	const size_t lookups = 1000000;
+	long found = 0;
+	for(int verify = 1; verify >= 0; --verify) {
+		BenchTimer timer;
+		FrozenMap<int, int> frozen = Snapshot::load<int, int>(path, verify != 0);
+		for(size_t i = 0; i < lookups; ++i) {
+			found += frozen.find(keys[i % n]) != frozen.end();
+		}
+		report("snapshot", verify ? "map-and-find" : "map-and-find-unverified", n, timer.elapsedMs());
+	}
+	benchSink = found;
+
+	remove(path);
+}
+
+// a value with a non-trivial destructor, so clear() has to visit every node
+struct Destructible
+{
+	int payload;
+
+	Destructible(int p = 0) : payload(p) {}
+	~Destructible() {}
+
+	bool operator==(const Destructible& rhs) const { return payload == rhs.payload; }
+	bool operator!=(const Destructible& rhs) const { return payload != rhs.payload; }
+};
+
+ostream& operator<<(ostream& out, const Destructible& d)
+{
+	return out << d.payload;
+}
+
+// builds trees of a given shape directly in O(n) through the protected insertion hooks,
+// since inserting sorted keys into a plain BST one by one is O(n^2)
+class ShapedTree : public BinarySearchTree<int, Destructible>
+{
+public:
+	// every key to the right of the last one: a list n nodes deep
+	void buildChain(int n)
+	{
+		Node<int, Destructible>* parent = nullptr;
+		for(int i = 0; i < n; ++i) {
+			Node<int, Destructible>* node = createNode(i, Destructible(i), parent);
+			linkNewNode(node, parent, false);
+			parent = node;
+		}
+	}
+
+	void buildBalanced(int n)
+	{
+		buildBalanced(0, n, nullptr, false);
+	}
+
+private:
+	void buildBalanced(int lo, int hi, Node<int, Destructible>* parent, bool goLeft)
+	{
+		if(lo >= hi) {
+			return;
+		}
+		int mid = lo + (hi - lo) / 2;
+		Node<int, Destructible>* node = createNode(mid, Destructible(mid), parent);
+		linkNewNode(node, parent, goLeft);
+		buildBalanced(lo, mid, node, true);
+		buildBalanced(mid + 1, hi, node, false);
+	}
+};
+
+// resident set size of the process in bytes, 0 where /proc is not available.
+// Free memory the allocator still holds on to is handed back first, so
+// it is not counted, nor reused unseen by the next tree measured.
+size_t residentBytes()
+{
+#if defined(__GLIBC__)
+	malloc_trim(0);
+#endif
+	ifstream statm("/proc/self/statm");
+	size_t pages = 0;
+	size_t resident = 0;
+	if(!(statm >> pages >> resident)) {
+		return 0;
+	}
+	return resident * 4096;
+}
+
+// bytes the process grew by while loading keys into a tree, and the time
+// taken to look every key up again
+template<typename Tree>
+void benchFootprint(const char* name, const vector<int>& keys)
+{
+	size_t before = residentBytes();
+	Tree tree;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		tree.insert(make_pair(keys[i], keys[i]));
+	}
+	size_t grown = residentBytes() - before;
+	reportValue("footprint", name, keys.size(), (double)grown / keys.size(), "bytes/key");
+
+	long found = 0;
+	BenchTimer timer;
+	for(size_t i = 0; i < keys.size(); ++i) {
+		found += tree.find(keys[i]) != tree.end();
+	}
+	report("footprint-find", name, keys.size(), timer.elapsedMs());
+	benchSink = found;
+}
+
+// int/int maps: 40 byte AVLNodes (three links, the pair, the balance)
+// against 16 byte CompactAVLTree nodes
+void benchMemoryFootprint(size_t n)
+{
+	vector<int> keys = shuffledKeys(n, 149);
+	benchFootprint<CompactAVLTree<int, int> >("CompactAVLTree", keys);
+	benchFootprint<AVLTree<int, int> >("AVLTree", keys);
+	benchFootprint<BTree<int, int> >("BTree-64", keys);
+	benchFootprint<map<int, int> >("std::map", keys);
+}
+
+// tearing down degenerate and balanced trees whose values need destroying
+void benchClearShapes(size_t n)
+{
+	{
+		ShapedTree tree;
+		tree.buildChain((int)n);
+		BenchTimer timer;
+		tree.clear();
+		report("clear", "degenerate", n, timer.elapsedMs());
+	}
+
+	{
+		ShapedTree tree;
+		tree.buildBalanced((int)n);
+		BenchTimer timer;
+		tree.clear();
+		report("clear", "balanced", n, timer.elapsedMs());
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t n = 1000000;
+	size_t footprintKeys = 50000000;
+	int counts = 0;
+	for(int i = 1; i < argc; ++i) {
+		if(strcmp(argv[i], "--csv") == 0) {
+			reportFormat = REPORT_CSV;
+		}else if(strcmp(argv[i], "--json") == 0) {
+			reportFormat = REPORT_JSON;
+		}else if(counts++ == 0) {
+			n = strtoul(argv[i], nullptr, 10);
+		}else {
+			footprintKeys = strtoul(argv[i], nullptr, 10);
+		}
+	}
+
+	benchNodeAllocation(n);
+
+	benchOperationSuite(n);
+
+	vector<int> keys = shuffledKeys(n, 104);
+	benchIterateDirections(keys);
+	benchRangeQuery(keys);
+	benchOrderStatistics(keys);
+
+	benchApplyBatch(keys);
+	benchSplitJoin(keys);
+	benchSetOperations(n);
+	benchConcurrentMixed(n);
+	benchPersistentSnapshots(keys);
+	benchFrozenLookups(n);
+	benchStringLookups(n);
+
+	benchSortedLoad(n);
+	benchSnapshot(n);
+
+	benchClearShapes(n);
+
+	benchMemoryFootprint(footprintKeys);
+
+	finishReport();
+	return 0;
+}
@@ -4,24 +4,47 @@
 #include <iostream>
 #include <exception>
 #include <cstdlib>
+#include <algorithm>
 #include <deque>
+#include <functional>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#include "frozen_map.h"
+#include "node_arena.h"
+
 /**
  * A templated class for a Node in a search tree.
- * The getters for parent/left/right are virtual so
- * that they can be overridden for future kinds of
- * search trees, such as Red Black trees, Splay trees,
- * and AVL trees.
+ * Nodes have no vtable. Derived nodes for other kinds
+ * of search trees, such as AVL trees, redeclare the
+ * getters for parent/left/right to return their own
+ * type, so links stay statically typed and every step
+ * of a descent is an inlinable load.
+ *
+ * Trees keep their nodes in a NodeArena whose slots are
+ * padded only to the node's own alignment, so a node's
+ * footprint is its size: 32 bytes for Node<int, int> and
+ * 40 for AVLNode<int, int> on a 64-bit target.
+ *
+ * Built with -DBST_THREADED, every node also links to its
+ * in-order neighbours (null at either end), so iterators
+ * step in O(1) without climbing parent links. The trees
+ * keep these threads up to date; they cost two pointers
+ * per node, and BST_THREADED must be defined the same
+ * way in every translation unit.
  */
 template <typename Key, typename Value>
 class Node
 {
 public:
     Node(const Key& key, const Value& value, Node<Key, Value>* parent);
-    virtual ~Node();
+    template<typename K, typename V>
+    Node(K&& key, V&& value, Node<Key, Value>* parent);
+    ~Node();
 
     const std::pair<const Key, Value>& getItem() const;
     std::pair<const Key, Value>& getItem();
@@ -29,24 +52,34 @@ public:
     const Value& getValue() const;
     Value& getValue();
 
-    virtual Node<Key, Value>* getParent() const;
-    virtual Node<Key, Value>* getLeft() const;
-    virtual Node<Key, Value>* getRight() const;
+    Node<Key, Value>* getParent() const;
+    Node<Key, Value>* getLeft() const;
+    Node<Key, Value>* getRight() const;
 
     void setParent(Node<Key, Value>* parent);
     void setLeft(Node<Key, Value>* left);
     void setRight(Node<Key, Value>* right);
     void setValue(const Value &value);
+    void setValue(Value&& value);
+
+#if defined(BST_THREADED)
+    Node<Key, Value>* getPrev() const;
+    Node<Key, Value>* getNext() const;
+    void setPrev(Node<Key, Value>* prev);
+    void setNext(Node<Key, Value>* next);
+#endif
 
     bool isLeaf();
-    int height();
-    bool isBalanced();
 
 protected:
     std::pair<const Key, Value> item_;
     Node<Key, Value>* parent_;
     Node<Key, Value>* left_;
     Node<Key, Value>* right_;
+#if defined(BST_THREADED)
+    Node<Key, Value>* prev_;
+    Node<Key, Value>* next_;
+#endif
 };
 
 /*
@@ -64,6 +97,29 @@ Node<Key, Value>::Node(const Key& key, const Value& value, Node<Key, Value>* par
     parent_(parent),
     left_(nullptr),
     right_(nullptr)
+#if defined(BST_THREADED)
+    , prev_(nullptr),
+    next_(nullptr)
+#endif
+{
+
+}
+
+/**
+* Forwarding constructor, so keys and values can be moved into the node
+* instead of copied.
+*/
+template<typename Key, typename Value>
+template<typename K, typename V>
+Node<Key, Value>::Node(K&& key, V&& value, Node<Key, Value>* parent) :
+    item_(std::forward<K>(key), std::forward<V>(value)),
+    parent_(parent),
+    left_(nullptr),
+    right_(nullptr)
+#if defined(BST_THREADED)
+    , prev_(nullptr),
+    next_(nullptr)
+#endif
 {
 
 }
@@ -124,7 +180,7 @@ Value& Node<Key, Value>::getValue()
 }
 
 /**
-* An implementation of the virtual function for retreiving the parent.
+* A getter for the parent.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getParent() const
@@ -133,7 +189,7 @@ Node<Key, Value>* Node<Key, Value>::getParent() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the left child.
+* A getter for the left child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getLeft() const
@@ -142,7 +198,7 @@ Node<Key, Value>* Node<Key, Value>::getLeft() const
 }
 
 /**
-* An implementation of the virtual function for retreiving the right child.
+* A getter for the right child.
 */
 template<typename Key, typename Value>
 Node<Key, Value>* Node<Key, Value>::getRight() const
@@ -177,68 +233,58 @@ void Node<Key, Value>::setRight(Node<Key, Value>* right)
     right_ = right;
 }
 
+#if defined(BST_THREADED)
 /**
-* A setter for the value of a node.
+* Getters and setters for the in-order threads.
 */
 template<typename Key, typename Value>
-void Node<Key, Value>::setValue(const Value& value)
+Node<Key, Value>* Node<Key, Value>::getPrev() const
 {
-    item_.second = value;
+    return prev_;
 }
 
-template <typename Key, typename Value>
-bool Node<Key, Value>::isLeaf() {
-    const bool leftNull = this->left_ == nullptr;
-    const bool rightNull = this->right_ == nullptr;
-    return leftNull && rightNull;
+template<typename Key, typename Value>
+Node<Key, Value>* Node<Key, Value>::getNext() const
+{
+    return next_;
 }
 
-template <typename Key, typename Value>
-int Node<Key, Value>::height() {
-    // if ( == nullptr) {
-    //     return 0;
-    // }
-    bool leftNull = this->left_ == nullptr;
-    bool rightNull = this->right_ == nullptr;
-
-    if (leftNull && rightNull) {
-        return 1;
-    }
-    if (leftNull != rightNull) {
-        return (leftNull ? this->right_ : this->left_)->height() + 1;
-    }
+template<typename Key, typename Value>
+void Node<Key, Value>::setPrev(Node<Key, Value>* prev)
+{
+    prev_ = prev;
+}
 
+template<typename Key, typename Value>
+void Node<Key, Value>::setNext(Node<Key, Value>* next)
+{
+    next_ = next;
+}
+#endif
 
-    return std::max(this->left_->height(), this->right_->height()) + 1;
+/**
+* A setter for the value of a node.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setValue(const Value& value)
+{
+    item_.second = value;
+}
 
+/**
+* A setter for the value of a node that moves from its argument.
+*/
+template<typename Key, typename Value>
+void Node<Key, Value>::setValue(Value&& value)
+{
+    item_.second = std::move(value);
 }
 
 template <typename Key, typename Value>
-bool Node<Key, Value>::isBalanced() {
-
-    const Node<Key, Value>* hhhh = this;
-
-    if (hhhh == nullptr) {
-        return true;
-    }
-
+bool Node<Key, Value>::isLeaf() {
     const bool leftNull = this->left_ == nullptr;
     const bool rightNull = this->right_ == nullptr;
-
-    if (leftNull && rightNull) {
-        return true;
-    }
-
-    if (leftNull != rightNull) {
-        return (leftNull ? this->right_ : this->left_)->isLeaf();
-    }
-
-    const int leftHeight = this->left_->height();
-    const int rightHeight = this->right_->height();
-
-    return std::abs(leftHeight - rightHeight) <= 1 && this->left_->isBalanced() && this->right_->isBalanced();
-
-
+    return leftNull && rightNull;
 }
 
 /*
@@ -248,62 +294,338 @@ bool Node<Key, Value>::isBalanced() {
 */
 
 /**
-* A templated unbalanced binary search tree.
+* One entry of a batch for BinarySearchTree::apply_batch(): either an
+* upsert of (key, value) or, when remove is set, a removal of key.
 */
 template <typename Key, typename Value>
+struct BatchOp
+{
+    BatchOp(const Key& k, const Value& v) : key(k), value(v), remove(false) {}
+    explicit BatchOp(const Key& k) : key(k), value(), remove(true) {}
+
+    Key key;
+    Value value;
+    bool remove;
+};
+
+/**
+* Counts of the work done by a tree, kept only when built with -DBST_STATS
+* (all zero otherwise), to see from outside why a tree is slow.
+*/
+struct TreeStats
+{
+    // calls of the tree's Compare
+    std::size_t comparisons = 0;
+    // lookups by key, and the nodes their descents passed through
+    std::size_t finds = 0;
+    std::size_t findNodesVisited = 0;
+    // inserts that linked in a new node and removes that unlinked one
+    std::size_t inserts = 0;
+    std::size_t removes = 0;
+    // AVLTree only: single rotations by direction (a double rotation counts
+    // two), and the retracings after an insert or a removal along with the
+    // ancestors whose balance factor each one looked at. An insert retraces
+    // O(1) ancestors amortized and rotates at most once.
+    std::size_t leftRotations = 0;
+    std::size_t rightRotations = 0;
+    std::size_t insertRetraces = 0;
+    std::size_t insertRetraceSteps = 0;
+    std::size_t removeRetraces = 0;
+    std::size_t removeRetraceSteps = 0;
+    // nodes created and destroyed, including those a clear() drops at once
+    std::size_t allocations = 0;
+    std::size_t frees = 0;
+    std::size_t nodeSwaps = 0;
+};
+
+/**
+* The shape of a tree as BinarySearchTree::shape_stats() measures it.
+* Depths count edges from the root, heights count nodes, so an empty tree
+* has height 0 and a lone root height 1 and depth 0.
+*/
+struct ShapeStats
+{
+    std::size_t nodes = 0;
+    std::size_t leaves = 0;
+    int height = 0;
+    std::size_t maxDepth = 0;
+    double averageDepth = 0.0;
+    // balance factor (right height minus left height) -> nodes that have it
+    std::map<int, std::size_t> balanceHistogram;
+    // no node's subtrees differ in height by more than one, as in an AVL tree
+    bool balanced = true;
+};
+
+// Bump a TreeStats counter of the enclosing tree. Without BST_STATS they
+// expand to nothing, arguments included, so they cost nothing at all.
+#if defined(BST_STATS)
+#define BST_STATS_COUNT(counter) (++this->stats_.counter)
+#define BST_STATS_ADD(counter, amount) (this->stats_.counter += (amount))
+#else
+#define BST_STATS_COUNT(counter) ((void)0)
+#define BST_STATS_ADD(counter, amount) ((void)0)
+#endif
+
+/**
+* A comparator ordering by operator<, for the Compare parameter of the
+* trees below. Unlike std::less<Key> it is transparent: find() and the
+* bounds then accept anything comparable with the keys, so looking up
+* a string literal in a tree of std::string never builds a temporary.
+*/
+struct TransparentLess
+{
+    typedef void is_transparent;
+
+    template<typename A, typename B>
+    bool operator()(const A& a, const B& b) const
+    {
+        return a < b;
+    }
+};
+
+/**
+* A templated unbalanced binary search tree, ordered by Compare, a strict
+* weak ordering in the style of std::map's.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
 class BinarySearchTree
 {
 public:
     BinarySearchTree();
+    template<typename InputIt>
+    BinarySearchTree(InputIt first, InputIt last);
+    BinarySearchTree(BinarySearchTree&& other);
+    BinarySearchTree& operator=(BinarySearchTree&& other);
     virtual ~BinarySearchTree();
     virtual void insert(const std::pair<const Key, Value>& keyValuePair);
     virtual void remove(const Key& key);
     void clear();
     bool isBalanced() const;
+    // Height, depths and balance factors in one O(n) pass.
+    ShapeStats shape_stats() const;
     virtual void print() const;
     bool empty() const;
+    std::size_t size() const;
+    // A read-only copy laid out for fast lookups, O(n).
+    FrozenMap<Key, Value, Compare> freeze() const;
 
-    virtual void print_placeholders(std::ios::fmtflags origCoutState, std::map<Key, uint8_t> valuePlaceholders) const;
+    virtual void print_placeholders(std::ios::fmtflags origCoutState, std::map<Key, uint8_t, Compare> valuePlaceholders) const;
 
     Node<Key, Value>* root();
 
     template<typename PPKey, typename PPValue>
     friend void prettyPrintBST(BinarySearchTree<PPKey, PPValue> & tree);
+    // loads snapshot files straight into the tree with buildTree()
+    friend class Snapshot;
 public:
     /**
     * An internal iterator class for traversing the contents of the BST.
+    * Bidirectional: decrementing end() gives the largest item. The const
+    * flavour only hands out const items and can be made from a plain one.
+    * Two iterators are equal iff they point at the same node.
     */
-    class iterator
+    template<bool IsConst>
+    class basic_iterator
     {
     public:
-        iterator();
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename std::conditional<IsConst, const value_type*, value_type*>::type pointer;
+        typedef typename std::conditional<IsConst, const value_type&, value_type&>::type reference;
+
+        basic_iterator();
+        basic_iterator(const basic_iterator<false>& other);
 
-        std::pair<const Key,Value>& operator*() const;
-        std::pair<const Key,Value>* operator->() const;
+        reference operator*() const;
+        pointer operator->() const;
 
-        bool operator==(const iterator& rhs) const;
-        bool operator!=(const iterator& rhs) const;
+        template<bool RhsConst>
+        bool operator==(const basic_iterator<RhsConst>& rhs) const;
+        template<bool RhsConst>
+        bool operator!=(const basic_iterator<RhsConst>& rhs) const;
 
-        iterator& operator++();
+        basic_iterator& operator++();
+        basic_iterator operator++(int);
+        basic_iterator& operator--();
+        basic_iterator operator--(int);
 
-        Node<Key, Value>* getCurrent();
+        Node<Key, Value>* getCurrent() const;
 
     protected:
-        friend class BinarySearchTree<Key, Value>;
-        explicit iterator(Node<Key,Value>* ptr);
+        friend class BinarySearchTree<Key, Value, Compare>;
+        template<bool> friend class basic_iterator;
+        basic_iterator(Node<Key,Value>* ptr, const BinarySearchTree<Key, Value, Compare>* tree);
         Node<Key, Value> *current_;
+        // needed to step back from end(), where current_ is NULL
+        const BinarySearchTree<Key, Value, Compare>* tree_;
+    };
+
+    typedef basic_iterator<false> iterator;
+    typedef basic_iterator<true> const_iterator;
+    typedef std::reverse_iterator<iterator> reverse_iterator;
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    /**
+    * A view of the items with keys in a half-open interval [a, b),
+    * usable in range-based for loops.
+    */
+    template<typename Iterator>
+    class basic_range_view
+    {
+    public:
+        Iterator begin() const;
+        Iterator end() const;
+        bool empty() const;
+
+    protected:
+        friend class BinarySearchTree<Key, Value, Compare>;
+        basic_range_view(Iterator first, Iterator last);
+        Iterator first_;
+        Iterator last_;
     };
 
+    typedef basic_range_view<iterator> range_view;
+    typedef basic_range_view<const_iterator> const_range_view;
+
 public:
-    iterator begin() const;
-    iterator end() const;
-    iterator find(const Key& key) const;
+    iterator begin();
+    const_iterator begin() const;
+    const_iterator cbegin() const;
+    iterator end();
+    const_iterator end() const;
+    const_iterator cend() const;
+    reverse_iterator rbegin();
+    const_reverse_iterator rbegin() const;
+    reverse_iterator rend();
+    const_reverse_iterator rend() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+
+    // Ordered queries, each a single O(log n) descent. Scanning the
+    // k items of a range costs O(k) more on top.
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+
+    // Heterogeneous lookup, only offered when Compare declares is_transparent,
+    // so e.g. find("literal") on string keys compares without building a Key.
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator find(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator find(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator lower_bound(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator lower_bound(const K& key) const;
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    iterator upper_bound(const K& key);
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    const_iterator upper_bound(const K& key) const;
+    Compare key_comp() const;
+
+    // Operation counts, see TreeStats. reset_stats() zeroes them.
+    const TreeStats& stats() const;
+    void reset_stats();
+    std::pair<iterator, iterator> equal_range(const Key& key);
+    std::pair<const_iterator, const_iterator> equal_range(const Key& key) const;
+    range_view range(const Key& a, const Key& b);
+    const_range_view range(const Key& a, const Key& b) const;
+    std::size_t count_range(const Key& a, const Key& b) const;
+
+    // Internal traversal: fn(item) is called on every item in key order
+    // (for_each_reverse: descending), or on those with keys in [a, b).
+    // The walk keeps its own stack of ancestors instead of climbing parent
+    // links, and fn is inlined into it, so full scans run close to a
+    // vector's. fn must not insert into or remove from the tree.
+    template<typename Fn>
+    void for_each(Fn fn);
+    template<typename Fn>
+    void for_each(Fn fn) const;
+    template<typename Fn>
+    void for_each_reverse(Fn fn);
+    template<typename Fn>
+    void for_each_reverse(Fn fn) const;
+    template<typename Fn>
+    void for_each_range(const Key& a, const Key& b, Fn fn);
+    template<typename Fn>
+    void for_each_range(const Key& a, const Key& b, Fn fn) const;
+
     Value& operator[](const Key& key);
     Value const & operator[](const Key& key) const;
 
+    // Single-descent insertion. A node is only allocated when the key is new,
+    // and keys/values are moved into it when given as rvalues.
+    // The bool in each result is true iff a node was inserted.
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args);
+    template<typename... Args>
+    std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj);
+    template<typename M>
+    std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj);
+    template<typename F>
+    std::pair<iterator, bool> update(const Key& key, F fn);
+
+    // Replaces the contents with the key/value pairs in [first, last).
+    // Input sorted by strictly increasing key is built in O(n) without any
+    // rebalancing; anything else is sorted first, and for duplicate keys the
+    // last pair wins, as with repeated insert(). The range must not refer
+    // to this tree's own elements.
+    template<typename InputIt>
+    void assign_sorted(InputIt first, InputIt last);
+
+    // Applies a batch of BatchOps sorted by key, in order, so for repeated
+    // keys the last op wins. Batches at least twice the size of the tree
+    // are merged with its items in a single in-order pass and the tree is
+    // rebuilt balanced. Smaller or unsorted batches are applied one
+    // insert_or_assign()/remove() per op; AVLTree applies the denser of the
+    // smaller sorted batches in one descent instead.
+    // If Key or Value throws, a rebuild leaves the tree unchanged, while
+    // ops already applied one at a time stay applied.
+    template<typename ForwardIt>
+    void apply_batch(ForwardIt first, ForwardIt last);
+
 protected:
-    // Mandatory helper functions
-    Node<Key, Value>* internalFind(const Key& k) const;
+    // Mandatory helper functions. Every descent calls keyLess() once per
+    // level and leaves the equality test to a single call at the end.
+    template<typename K>
+    Node<Key, Value>* internalFind(const K& k) const;
+    template<typename K>
+    Node<Key, Value>* lowerBoundNode(const K& key) const;
+    template<typename K>
+    Node<Key, Value>* upperBoundNode(const K& key) const;
+    iterator makeIterator(Node<Key, Value>* node);
+    const_iterator makeIterator(Node<Key, Value>* node) const;
+    Node<Key, Value>* equalRangeEnd(Node<Key, Value>* first, const Key& key) const;
+    void rangeNodes(const Key& a, const Key& b, Node<Key, Value>*& first, Node<Key, Value>*& last) const;
+
+    // The ancestors a for_each() walk has yet to visit, held inline for
+    // trees up to INLINE_DEPTH levels tall and spilled to the heap below.
+    class NodeStack
+    {
+    public:
+        NodeStack();
+        bool empty() const;
+        void push(Node<Key, Value>* node);
+        Node<Key, Value>* pop();
+
+    private:
+        static const std::size_t INLINE_DEPTH = 64;
+        Node<Key, Value>* inline_[INLINE_DEPTH];
+        std::vector<Node<Key, Value>*> spilled_;
+        std::size_t size_;
+    };
+
+    // Item is the possibly const pair type fn is handed.
+    template<bool Reverse, typename Item, typename Fn>
+    void visitInOrder(Fn& fn) const;
+    template<typename Item, typename Fn>
+    void visitRange(const Key& a, const Key& b, Fn& fn) const;
     Node<Key, Value> *getSmallestNode() const;
     static Node<Key, Value>* predecessor(Node<Key, Value>* current);
     // Note:  static means these functions don't have a "this" pointer
@@ -321,13 +643,94 @@ protected:
 
     void promoteSingleSubtree(Node<Key, Value>* target, Node<Key, Value>* subtree);
 
-    void recursiveClearTree(Node<Key, Value>* current);
-
+    void clearSubtree(Node<Key, Value>* current);
+
+    // Upkeep of the in-order threads, see Node. Without BST_THREADED these
+    // do nothing. Rotations keep the in-order sequence as it is, so they
+    // never need to touch the threads.
+    static void threadLeaf(Node<Key, Value>* leaf);
+    static void threadNode(Node<Key, Value>* node, Node<Key, Value>* prev, Node<Key, Value>* next);
+    static void unthreadNode(Node<Key, Value>* node);
+    static void swapThreads(Node<Key, Value>* n1, Node<Key, Value>* n2);
+    static void threadSubtree(Node<Key, Value>* root);
+    // for split and join: cuts the threads between two detached subtrees,
+    // or runs them through a pivot to go between them
+    static void cutThreads(Node<Key, Value>* lowerRoot, Node<Key, Value>* upperRoot);
+    static void threadPivot(Node<Key, Value>* lowerRoot, Node<Key, Value>* pivot, Node<Key, Value>* upperRoot);
+
+    // Node storage. New nodes come from arena_, which no other tree
+    // allocates from or frees into, so trees never race on it. Trees that
+    // move, split or join nodes out of this one keep arena_ alive among
+    // their adoptedArenas_, and every tree frees the slots of whatever
+    // nodes it holds into its own arena_.
+    BinarySearchTree(std::size_t nodeSize, std::size_t nodeAlign);
+    std::shared_ptr<NodeArena> newArena() const;
+    void resetArena();
+    virtual Node<Key, Value>* createNode(const Key& key, Value&& value, Node<Key, Value>* parent);
+    virtual Node<Key, Value>* createNode(Key&& key, Value&& value, Node<Key, Value>* parent);
+    virtual void destroyNode(Node<Key, Value>* node);
+    void releaseSlot(Node<Key, Value>* node);
+    void adoptArenas(BinarySearchTree<Key, Value, Compare>& other);
+    void takeContents(BinarySearchTree<Key, Value, Compare>& other);
+
+    // size_ is only counted while it is known; splitting a tree leaves
+    // it UNKNOWN_SIZE until size() next counts the nodes
+    static const std::size_t UNKNOWN_SIZE = static_cast<std::size_t>(-1);
+    void noteInserted();
+    void noteRemoved();
+
+    // Insertion is split into a descent, which allocates nothing, and linking in
+    // a freshly created node, after which derived trees get to rebalance.
+    Node<Key, Value>* findInsertPosition(const Key& key, Node<Key, Value>*& parent, bool& goLeft) const;
+    void linkNewNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool goLeft);
+    virtual void afterInsert(Node<Key, Value>* node);
+    // Unlinks and destroys a node of this tree, rebalancing as needed.
+    virtual void removeNode(Node<Key, Value>* node);
+    template<typename K, typename... Args>
+    std::pair<iterator, bool> tryEmplaceImpl(K&& key, Args&&... args);
+    template<typename K, typename M>
+    std::pair<iterator, bool> insertOrAssignImpl(K&& key, M&& obj);
+
+    // Bulk construction from sorted input
+    template<typename ForwardIt>
+    void assignSorted(ForwardIt first, ForwardIt last, std::forward_iterator_tag);
+    template<typename InputIt>
+    void assignSorted(InputIt first, InputIt last, std::input_iterator_tag);
+    template<typename It>
+    void buildTree(It& it, std::size_t n);
+    template<typename It>
+    Node<Key, Value>* buildSubtree(It& it, std::size_t n, Node<Key, Value>* parent);
+    template<typename Item>
+    Node<Key, Value>* createItemNode(const Item& item, Node<Key, Value>* parent);
+    Node<Key, Value>* createItemNode(std::pair<Key, Value>&& item, Node<Key, Value>* parent);
+    virtual void setBuiltShape(Node<Key, Value>* node, int balance, std::size_t size);
+    static int minimalHeight(std::size_t n);
+
+    // Batched updates
+    template<typename ForwardIt>
+    bool batchSorted(ForwardIt first, ForwardIt last, std::size_t& count) const;
+    bool batchRebuilds(std::size_t count) const;
+    template<typename ForwardIt>
+    void applyBatchOneByOne(ForwardIt first, ForwardIt last);
+    template<typename ForwardIt>
+    void applyBatchRebuild(ForwardIt first, ForwardIt last);
+    template<typename A, typename B>
+    bool keyLess(const A& a, const B& b) const;
+    // batches of at least BATCH_REBUILD_FACTOR * size() ops rebuild the tree;
+    // the in-order walk of a tree whose nodes are scattered in memory costs
+    // about as much as applying twice the tree's size in ops one by one
+    static const std::size_t BATCH_REBUILD_FACTOR = 2;
 
 
 protected:
     Node<Key, Value>* root_;
-    // You should not need other data members
+    std::shared_ptr<NodeArena> arena_;
+    std::vector<std::shared_ptr<NodeArena> > adoptedArenas_;
+    mutable std::size_t size_;
+    Compare compare_;
+#if defined(BST_STATS)
+    mutable TreeStats stats_;
+#endif
 };
 
 /*
@@ -339,27 +742,46 @@ Begin implementations for the BinarySearchTree::iterator class.
 /**
 * Explicit constructor that initializes an iterator with a given node pointer.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator(Node<Key,Value> *ptr)
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::basic_iterator(Node<Key,Value> *ptr, const BinarySearchTree<Key, Value, Compare>* tree) :
+    current_(ptr),
+    tree_(tree)
 {
-    this->current_ = ptr;
+
 }
 
 /**
 * A default constructor that initializes the iterator to NULL.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::iterator::iterator()
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::basic_iterator() :
+    current_(nullptr),
+    tree_(nullptr)
+{
+
+}
+
+/**
+* Copies an iterator, turning a plain iterator into a const one if needed.
+*/
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::basic_iterator(const basic_iterator<false>& other) :
+    current_(other.current_),
+    tree_(other.tree_)
 {
-    this->current_ = nullptr;
+
 }
 
 /**
 * Provides access to the item.
 */
-template<class Key, class Value>
-std::pair<const Key,Value> &
-BinarySearchTree<Key, Value>::iterator::operator*() const
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+typename BinarySearchTree<Key, Value, Compare>::template basic_iterator<IsConst>::reference
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator*() const
 {
     return current_->getItem();
 }
@@ -367,51 +789,48 @@ BinarySearchTree<Key, Value>::iterator::operator*() const
 /**
 * Provides access to the address of the item.
 */
-template<class Key, class Value>
-std::pair<const Key,Value> *
-BinarySearchTree<Key, Value>::iterator::operator->() const
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+typename BinarySearchTree<Key, Value, Compare>::template basic_iterator<IsConst>::pointer
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator->() const
 {
     return &(current_->getItem());
 }
 
 /**
-* Checks if 'this' iterator's internals have the same value
-* as 'rhs'
+* Checks if 'this' iterator points at the same node as 'rhs'.
+* Comparing values instead would stop a range scan early at any
+* item whose value happens to equal the one at the range's end.
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+template<bool RhsConst>
 bool
-BinarySearchTree<Key, Value>::iterator::operator==(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator==(const basic_iterator<RhsConst>& rhs) const
 {
-    if (this->current_ != nullptr && (rhs.current_ != nullptr))
-        return this->current_->getValue() == rhs.current_->getValue();
-    return this->current_ == nullptr && rhs.current_ == nullptr;
+    return this->current_ == rhs.current_;
 }
 
 /**
-* Checks if 'this' iterator's internals have a different value
-* as 'rhs'
+* Checks if 'this' iterator points at a different node than 'rhs'
 */
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+template<bool RhsConst>
 bool
-BinarySearchTree<Key, Value>::iterator::operator!=(
-    const BinarySearchTree<Key, Value>::iterator& rhs) const
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator!=(const basic_iterator<RhsConst>& rhs) const
 {
-    if ((this->current_ == nullptr) != (rhs.current_ == nullptr))
-        return true;
-    else if ((this->current_ == nullptr) && (rhs.current_ == nullptr))
-        return false;
-    return this->current_->getValue() != rhs.current_->getValue();
-
+    return this->current_ != rhs.current_;
 }
 
 
 /**
 * Advances the iterator's location using an in-order sequencing
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator&
-BinarySearchTree<Key, Value>::iterator::operator++()
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+typename BinarySearchTree<Key, Value, Compare>::template basic_iterator<IsConst>&
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator++()
 {
     if (this->current_ == nullptr) {
         return *this;
@@ -421,8 +840,49 @@ BinarySearchTree<Key, Value>::iterator::operator++()
     return *this;
 }
 
-template <typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::iterator::getCurrent() {
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+typename BinarySearchTree<Key, Value, Compare>::template basic_iterator<IsConst>
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator++(int)
+{
+    basic_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Moves the iterator back one item in order. Stepping back from end()
+* lands on the largest item.
+*/
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+typename BinarySearchTree<Key, Value, Compare>::template basic_iterator<IsConst>&
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator--()
+{
+    if (this->current_ == nullptr) {
+        if (this->tree_ != nullptr && this->tree_->root_ != nullptr) {
+            this->current_ = nodeMax(this->tree_->root_);
+        }
+        return *this;
+    }
+
+    this->current_ = predecessor(this->current_);
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+typename BinarySearchTree<Key, Value, Compare>::template basic_iterator<IsConst>
+BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::operator--(int)
+{
+    basic_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+template<class Key, class Value, class Compare>
+template<bool IsConst>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::basic_iterator<IsConst>::getCurrent() const {
     return this->current_;
 }
 
@@ -433,6 +893,36 @@ End implementations for the BinarySearchTree::iterator class.
 -------------------------------------------------------------
 */
 
+template<class Key, class Value, class Compare>
+template<typename Iterator>
+BinarySearchTree<Key, Value, Compare>::basic_range_view<Iterator>::basic_range_view(Iterator first, Iterator last) :
+    first_(first),
+    last_(last)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+template<typename Iterator>
+Iterator BinarySearchTree<Key, Value, Compare>::basic_range_view<Iterator>::begin() const
+{
+    return first_;
+}
+
+template<class Key, class Value, class Compare>
+template<typename Iterator>
+Iterator BinarySearchTree<Key, Value, Compare>::basic_range_view<Iterator>::end() const
+{
+    return last_;
+}
+
+template<class Key, class Value, class Compare>
+template<typename Iterator>
+bool BinarySearchTree<Key, Value, Compare>::basic_range_view<Iterator>::empty() const
+{
+    return first_ == last_;
+}
+
 /*
 -----------------------------------------------------
 Begin implementations for the BinarySearchTree class.
@@ -442,14 +932,55 @@ Begin implementations for the BinarySearchTree class.
 /**
 * Default constructor for a BinarySearchTree, which sets the root to NULL.
 */
-template<class Key, class Value>
-BinarySearchTree<Key, Value>::BinarySearchTree() : root_(nullptr)
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree() : root_(nullptr), arena_(std::make_shared<NodeArena>(sizeof(Node<Key, Value>), alignof(Node<Key, Value>))), size_(0)
 {
     // this->root_ = nullptr;
 }
 
-template<typename Key, typename Value>
-BinarySearchTree<Key, Value>::~BinarySearchTree()
+/**
+* Constructor for derived trees whose nodes are larger than a plain Node,
+* so the arena hands out slots big enough and aligned for them.
+*/
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(std::size_t nodeSize, std::size_t nodeAlign) : root_(nullptr), arena_(std::make_shared<NodeArena>(nodeSize, nodeAlign)), size_(0)
+{
+
+}
+
+/**
+* Constructs a tree holding the pairs in [first, last), see assign_sorted().
+*/
+template<class Key, class Value, class Compare>
+template<typename InputIt>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(InputIt first, InputIt last) : root_(nullptr), arena_(std::make_shared<NodeArena>(sizeof(Node<Key, Value>), alignof(Node<Key, Value>))), size_(0)
+{
+    assign_sorted(first, last);
+}
+
+/**
+* Takes over other's nodes along with the arena they were allocated from.
+* other is left empty, with a fresh arena of its own.
+*/
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::BinarySearchTree(BinarySearchTree&& other) : root_(nullptr), arena_(other.arena_), size_(0)
+{
+    takeContents(other);
+}
+
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>& BinarySearchTree<Key, Value, Compare>::operator=(BinarySearchTree&& other)
+{
+    if (this != &other) {
+        clear();
+        arena_ = other.arena_;
+        takeContents(other);
+    }
+    return *this;
+}
+
+template<typename Key, typename Value, typename Compare>
+BinarySearchTree<Key, Value, Compare>::~BinarySearchTree()
 {
 
     clear();
@@ -458,19 +989,59 @@ BinarySearchTree<Key, Value>::~BinarySearchTree()
 /**
  * Returns true if tree is empty
 */
-template<class Key, class Value>
-bool BinarySearchTree<Key, Value>::empty() const
+template<class Key, class Value, class Compare>
+bool BinarySearchTree<Key, Value, Compare>::empty() const
 {
     return root_ == nullptr;
 }
 
-template <typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::root() {
+/**
+ * Returns the number of items in the tree
+*/
+template<class Key, class Value, class Compare>
+std::size_t BinarySearchTree<Key, Value, Compare>::size() const
+{
+    if (size_ == UNKNOWN_SIZE) {
+        std::size_t count = 0;
+        for (const_iterator it = begin(); it != end(); ++it) {
+            ++count;
+        }
+        size_ = count;
+    }
+    return size_;
+}
+
+template<class Key, class Value, class Compare>
+FrozenMap<Key, Value, Compare> BinarySearchTree<Key, Value, Compare>::freeze() const
+{
+    return FrozenMap<Key, Value, Compare>(begin(), end(), compare_);
+}
+
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::noteInserted()
+{
+    BST_STATS_COUNT(inserts);
+    if (size_ != UNKNOWN_SIZE) {
+        ++size_;
+    }
+}
+
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::noteRemoved()
+{
+    BST_STATS_COUNT(removes);
+    if (size_ != UNKNOWN_SIZE) {
+        --size_;
+    }
+}
+
+template <typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::root() {
     return this->root_;
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print() const
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::print() const
 {
     printRoot(root_);
     std::cout << "\n";
@@ -479,100 +1050,893 @@ void BinarySearchTree<Key, Value>::print() const
 /**
 * Returns an iterator to the "smallest" item in the tree
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::begin() const
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::begin()
+{
+    return makeIterator(getSmallestNode());
+}
+
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::begin() const
+{
+    return makeIterator(getSmallestNode());
+}
+
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::cbegin() const
 {
-    iterator begin(getSmallestNode());
-    return begin;
+    return begin();
 }
 
 /**
 * Returns an iterator whose value means INVALID
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::end() const
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::end()
+{
+    return makeIterator(nullptr);
+}
+
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::end() const
 {
-    iterator end(nullptr);
-    return end;
+    return makeIterator(nullptr);
+}
+
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::cend() const
+{
+    return end();
 }
 
 /**
-* Returns an iterator to the item with the given key, k
-* or the end iterator if k does not exist in the tree
+* Reverse iteration starts at the largest item, by stepping back from end()
 */
-template<class Key, class Value>
-typename BinarySearchTree<Key, Value>::iterator
-BinarySearchTree<Key, Value>::find(const Key & k) const
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Compare>::rbegin()
 {
-    Node<Key, Value> *curr = internalFind(k);
-    iterator it(curr);
-    return it;
+    return reverse_iterator(end());
 }
 
-/**
- * @precondition The key exists in the map
- * Returns the value associated with the key
- */
-template<class Key, class Value>
-Value& BinarySearchTree<Key, Value>::operator[](const Key& key)
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare>::rbegin() const
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == nullptr) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    return const_reverse_iterator(end());
 }
-template<class Key, class Value>
-Value const & BinarySearchTree<Key, Value>::operator[](const Key& key) const
+
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::reverse_iterator
+BinarySearchTree<Key, Value, Compare>::rend()
 {
-    Node<Key, Value> *curr = internalFind(key);
-    if(curr == nullptr) throw std::out_of_range("Invalid key");
-    return curr->getValue();
+    return reverse_iterator(begin());
+}
+
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_reverse_iterator
+BinarySearchTree<Key, Value, Compare>::rend() const
+{
+    return const_reverse_iterator(begin());
 }
 
 /**
-* An insert method to insert into a Binary Search Tree.
-* The tree will not remain balanced when inserting.
-* Recall: If key is already in the tree, you should
-* overwrite the current value with the updated value.
+* Returns an iterator to the item with the given key, k
+* or the end iterator if k does not exist in the tree
 */
-template<class Key, class Value>
-void BinarySearchTree<Key, Value>::insert(const std::pair<const Key, Value> &keyValuePair)
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::find(const Key & k)
 {
-    Node<Key, Value>* val = new Node<Key, Value>(keyValuePair.first, keyValuePair.second, nullptr);
-    Node<Key, Value>* parent = nullptr;
-    Node<Key, Value>* current = this->root_;
-
+    return makeIterator(internalFind(k));
+}
 
-    while (current != nullptr) {
-        parent = current;
-        if (val->getKey() < current->getKey()) {
-            current = current->getLeft();
-        }else if (val->getKey() == current->getKey()) {
-            current->setValue(keyValuePair.second);
-            delete val;
-            return;
-        }else /*if (current->getRight() != nullptr)*/{
-            current = current->getRight();
-        }
-    }
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::find(const Key & k) const
+{
+    return makeIterator(internalFind(k));
+}
 
-    val->setParent(parent);
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or the end iterator if there is none
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::lower_bound(const Key& key)
+{
+    return makeIterator(lowerBoundNode(key));
+}
 
-    if (parent == nullptr) {
-        this->root_ = val;
-    } else if (val->getKey() < parent->getKey()) {
-        parent->setLeft(val);
-    } else {
-        parent->setRight(val);
-    }
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return makeIterator(lowerBoundNode(key));
+}
 
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or the end iterator if there is none
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::upper_bound(const Key& key)
+{
+    return makeIterator(upperBoundNode(key));
+}
 
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    return makeIterator(upperBoundNode(key));
 }
 
+/**
+* Heterogeneous versions of find(), lower_bound() and upper_bound(), for
+* a transparent Compare: key is compared with the stored keys as is.
+*/
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::find(const K& key)
+{
+    return makeIterator(internalFind(key));
+}
 
-template <typename Key, typename Value>
-void BinarySearchTree<Key, Value>::promoteSingleSubtree(Node<Key, Value>* target, Node<Key, Value>* subtree) {
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::find(const K& key) const
+{
+    return makeIterator(internalFind(key));
+}
+
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::lower_bound(const K& key)
+{
+    return makeIterator(lowerBoundNode(key));
+}
+
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::lower_bound(const K& key) const
+{
+    return makeIterator(lowerBoundNode(key));
+}
+
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::upper_bound(const K& key)
+{
+    return makeIterator(upperBoundNode(key));
+}
+
+template<class Key, class Value, class Compare>
+template<typename K, typename C, typename>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::upper_bound(const K& key) const
+{
+    return makeIterator(upperBoundNode(key));
+}
+
+/**
+* Returns a copy of the comparator ordering the keys.
+*/
+template<class Key, class Value, class Compare>
+Compare BinarySearchTree<Key, Value, Compare>::key_comp() const
+{
+    return compare_;
+}
+
+template<class Key, class Value, class Compare>
+const TreeStats& BinarySearchTree<Key, Value, Compare>::stats() const
+{
+#if defined(BST_STATS)
+    return stats_;
+#else
+    static const TreeStats none;
+    return none;
+#endif
+}
+
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::reset_stats()
+{
+#if defined(BST_STATS)
+    stats_ = TreeStats();
+#endif
+}
+
+/**
+* Returns the range of items with the given key, which holds one item
+* if the key is present and none otherwise
+*/
+template<class Key, class Value, class Compare>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, typename BinarySearchTree<Key, Value, Compare>::iterator>
+BinarySearchTree<Key, Value, Compare>::equal_range(const Key& key)
+{
+    Node<Key, Value>* first = lowerBoundNode(key);
+    return std::make_pair(makeIterator(first), makeIterator(equalRangeEnd(first, key)));
+}
+
+template<class Key, class Value, class Compare>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::const_iterator, typename BinarySearchTree<Key, Value, Compare>::const_iterator>
+BinarySearchTree<Key, Value, Compare>::equal_range(const Key& key) const
+{
+    Node<Key, Value>* first = lowerBoundNode(key);
+    return std::make_pair(makeIterator(first), makeIterator(equalRangeEnd(first, key)));
+}
+
+/**
+* Returns a view of the items with keys in [a, b). The view is empty
+* unless a < b, and is invalidated by the same changes as its iterators.
+*/
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::range_view
+BinarySearchTree<Key, Value, Compare>::range(const Key& a, const Key& b)
+{
+    Node<Key, Value>* first;
+    Node<Key, Value>* last;
+    rangeNodes(a, b, first, last);
+    return range_view(makeIterator(first), makeIterator(last));
+}
+
+template<class Key, class Value, class Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_range_view
+BinarySearchTree<Key, Value, Compare>::range(const Key& a, const Key& b) const
+{
+    Node<Key, Value>* first;
+    Node<Key, Value>* last;
+    rangeNodes(a, b, first, last);
+    return const_range_view(makeIterator(first), makeIterator(last));
+}
+
+/**
+* Returns the number of items with keys in [a, b), walking them in order.
+*/
+template<class Key, class Value, class Compare>
+std::size_t BinarySearchTree<Key, Value, Compare>::count_range(const Key& a, const Key& b) const
+{
+    std::size_t count = 0;
+    for_each_range(a, b, [&count](const std::pair<const Key, Value>&) { ++count; });
+    return count;
+}
+
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare>::for_each(Fn fn)
+{
+    visitInOrder<false, std::pair<const Key, Value> >(fn);
+}
+
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare>::for_each(Fn fn) const
+{
+    visitInOrder<false, const std::pair<const Key, Value> >(fn);
+}
+
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare>::for_each_reverse(Fn fn)
+{
+    visitInOrder<true, std::pair<const Key, Value> >(fn);
+}
+
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare>::for_each_reverse(Fn fn) const
+{
+    visitInOrder<true, const std::pair<const Key, Value> >(fn);
+}
+
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare>::for_each_range(const Key& a, const Key& b, Fn fn)
+{
+    visitRange<std::pair<const Key, Value> >(a, b, fn);
+}
+
+template<class Key, class Value, class Compare>
+template<typename Fn>
+void BinarySearchTree<Key, Value, Compare>::for_each_range(const Key& a, const Key& b, Fn fn) const
+{
+    visitRange<const std::pair<const Key, Value> >(a, b, fn);
+}
+
+template<class Key, class Value, class Compare>
+BinarySearchTree<Key, Value, Compare>::NodeStack::NodeStack() : size_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+bool BinarySearchTree<Key, Value, Compare>::NodeStack::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::NodeStack::push(Node<Key, Value>* node)
+{
+    if (size_ < INLINE_DEPTH) {
+        inline_[size_] = node;
+    }else {
+        spilled_.push_back(node);
+    }
+    ++size_;
+}
+
+template<class Key, class Value, class Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::NodeStack::pop()
+{
+    --size_;
+    if (size_ < INLINE_DEPTH) {
+        return inline_[size_];
+    }
+    Node<Key, Value>* node = spilled_.back();
+    spilled_.pop_back();
+    return node;
+}
+
+/**
+* Stacks the path down the near edge of each subtree, then pops a node,
+* visits it and does the same for its far subtree. Every link is followed
+* once downwards and never back up, so each step costs one load from the
+* node just visited rather than a climb through its ancestors.
+*/
+template<class Key, class Value, class Compare>
+template<bool Reverse, typename Item, typename Fn>
+void BinarySearchTree<Key, Value, Compare>::visitInOrder(Fn& fn) const
+{
+    NodeStack stack;
+    Node<Key, Value>* node = this->root_;
+    for (;;) {
+        for (; node != nullptr; node = Reverse ? node->getRight() : node->getLeft()) {
+            stack.push(node);
+        }
+        if (stack.empty()) {
+            return;
+        }
+        node = stack.pop();
+        Item& item = node->getItem();
+        fn(item);
+        node = Reverse ? node->getLeft() : node->getRight();
+    }
+}
+
+/**
+* The descent to a stacks every node not less than a that it turns left
+* at, which are exactly the ancestors an in-order walk from lower_bound(a)
+* returns to. The walk then stops at the first key not less than b.
+*/
+template<class Key, class Value, class Compare>
+template<typename Item, typename Fn>
+void BinarySearchTree<Key, Value, Compare>::visitRange(const Key& a, const Key& b, Fn& fn) const
+{
+    NodeStack stack;
+    for (Node<Key, Value>* node = this->root_; node != nullptr; ) {
+        if (keyLess(node->getKey(), a)) {
+            node = node->getRight();
+        }else {
+            stack.push(node);
+            node = node->getLeft();
+        }
+    }
+
+    while (!stack.empty()) {
+        Node<Key, Value>* node = stack.pop();
+        if (!keyLess(node->getKey(), b)) {
+            return;
+        }
+        Item& item = node->getItem();
+        fn(item);
+        for (node = node->getRight(); node != nullptr; node = node->getLeft()) {
+            stack.push(node);
+        }
+    }
+}
+
+/**
+ * @precondition The key exists in the map
+ * Returns the value associated with the key
+ */
+template<class Key, class Value, class Compare>
+Value& BinarySearchTree<Key, Value, Compare>::operator[](const Key& key)
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+template<class Key, class Value, class Compare>
+Value const & BinarySearchTree<Key, Value, Compare>::operator[](const Key& key) const
+{
+    Node<Key, Value> *curr = internalFind(key);
+    if(curr == nullptr) throw std::out_of_range("Invalid key");
+    return curr->getValue();
+}
+
+/**
+* An insert method to insert into a Binary Search Tree.
+* The tree will not remain balanced when inserting.
+* Recall: If key is already in the tree, you should
+* overwrite the current value with the updated value.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::insert(const std::pair<const Key, Value> &keyValuePair)
+{
+    insert_or_assign(keyValuePair.first, keyValuePair.second);
+}
+
+/**
+* Constructs a pair from args and inserts it unless its key is already present,
+* in which case the tree is left unchanged.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::emplace(Args&&... args)
+{
+    // the key is only known once the pair is built, like std::map::emplace
+    std::pair<Key, Value> item(std::forward<Args>(args)...);
+    return tryEmplaceImpl(std::move(item.first), std::move(item.second));
+}
+
+/**
+* Inserts a value constructed from args unless key is already present.
+* Nothing is constructed or moved from when the key exists.
+*/
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::try_emplace(const Key& key, Args&&... args)
+{
+    return tryEmplaceImpl(key, std::forward<Args>(args)...);
+}
+
+template<class Key, class Value, class Compare>
+template<typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::try_emplace(Key&& key, Args&&... args)
+{
+    return tryEmplaceImpl(std::move(key), std::forward<Args>(args)...);
+}
+
+/**
+* Inserts obj under key, or assigns it to the existing value.
+*/
+template<class Key, class Value, class Compare>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::insert_or_assign(const Key& key, M&& obj)
+{
+    return insertOrAssignImpl(key, std::forward<M>(obj));
+}
+
+template<class Key, class Value, class Compare>
+template<typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::insert_or_assign(Key&& key, M&& obj)
+{
+    return insertOrAssignImpl(std::move(key), std::forward<M>(obj));
+}
+
+/**
+* Calls fn on the value stored under key, modifying it in place.
+* If key is missing, a value-initialized Value is inserted first.
+*/
+template<class Key, class Value, class Compare>
+template<typename F>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::update(const Key& key, F fn)
+{
+    std::pair<iterator, bool> result = tryEmplaceImpl(key);
+    fn(result.first->second);
+    return result;
+}
+
+template<class Key, class Value, class Compare>
+template<typename K, typename... Args>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::tryEmplaceImpl(K&& key, Args&&... args)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool goLeft = false;
+    Node<Key, Value>* existing = findInsertPosition(key, parent, goLeft);
+    if (existing != nullptr) {
+        return std::make_pair(makeIterator(existing), false);
+    }
+
+    Node<Key, Value>* val = createNode(std::forward<K>(key), Value(std::forward<Args>(args)...), parent);
+    linkNewNode(val, parent, goLeft);
+    return std::make_pair(makeIterator(val), true);
+}
+
+template<class Key, class Value, class Compare>
+template<typename K, typename M>
+std::pair<typename BinarySearchTree<Key, Value, Compare>::iterator, bool>
+BinarySearchTree<Key, Value, Compare>::insertOrAssignImpl(K&& key, M&& obj)
+{
+    Node<Key, Value>* parent = nullptr;
+    bool goLeft = false;
+    Node<Key, Value>* existing = findInsertPosition(key, parent, goLeft);
+    if (existing != nullptr) {
+        existing->getValue() = std::forward<M>(obj);
+        return std::make_pair(makeIterator(existing), false);
+    }
+
+    Node<Key, Value>* val = createNode(std::forward<K>(key), Value(std::forward<M>(obj)), parent);
+    linkNewNode(val, parent, goLeft);
+    return std::make_pair(makeIterator(val), true);
+}
+
+/**
+* Walks down from the root looking for key.
+* Returns the node holding key if there is one. Otherwise returns nullptr,
+* with parent and goLeft describing where a new node for key belongs.
+*/
+template<class Key, class Value, class Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::findInsertPosition(const Key& key, Node<Key, Value>*& parent, bool& goLeft) const
+{
+    Node<Key, Value>* current = this->root_;
+    // the last node the descent went right from, the only one that can hold key
+    Node<Key, Value>* candidate = nullptr;
+    parent = nullptr;
+    goLeft = false;
+
+    while (current != nullptr) {
+        parent = current;
+        goLeft = keyLess(key, current->getKey());
+        if (goLeft) {
+            current = current->getLeft();
+        }else {
+            candidate = current;
+            current = current->getRight();
+        }
+    }
+
+    if (candidate != nullptr && !keyLess(candidate->getKey(), key)) {
+        return candidate;
+    }
+    return nullptr;
+}
+
+/**
+* Hangs a new node off parent (or makes it the root), then lets
+* derived trees fix up their invariants.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::linkNewNode(Node<Key, Value>* node, Node<Key, Value>* parent, bool goLeft)
+{
+    noteInserted();
+    node->setParent(parent);
+
+    if (parent == nullptr) {
+        this->root_ = node;
+    } else if (goLeft) {
+        parent->setLeft(node);
+    } else {
+        parent->setRight(node);
+    }
+
+    threadLeaf(node);
+    afterInsert(node);
+}
+
+/**
+* Called after a new node has been linked in. A plain BST has nothing to fix.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::afterInsert(Node<Key, Value>* node)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+template<typename InputIt>
+void BinarySearchTree<Key, Value, Compare>::assign_sorted(InputIt first, InputIt last)
+{
+    assignSorted(first, last, typename std::iterator_traits<InputIt>::iterator_category());
+}
+
+/**
+* Forward ranges can be checked in place, so sorted input is built
+* straight from the caller's range without an intermediate copy.
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+void BinarySearchTree<Key, Value, Compare>::assignSorted(ForwardIt first, ForwardIt last, std::forward_iterator_tag)
+{
+    ForwardIt prev = first;
+    ForwardIt current = first;
+    bool sorted = true;
+    std::size_t n = 0;
+    if (current != last) {
+        ++current;
+        ++n;
+        for (; current != last; ++prev, ++current, ++n) {
+            if (!keyLess((*prev).first, (*current).first)) {
+                sorted = false;
+                break;
+            }
+        }
+    }
+
+    if (!sorted) {
+        assignSorted(first, last, std::input_iterator_tag());
+        return;
+    }
+
+    clear();
+    buildTree(first, n);
+}
+
+/**
+* The sort-then-build path: copies the range, stable sorts it by key,
+* keeps the last pair of each run of equal keys and builds from that.
+*/
+template<class Key, class Value, class Compare>
+template<typename InputIt>
+void BinarySearchTree<Key, Value, Compare>::assignSorted(InputIt first, InputIt last, std::input_iterator_tag)
+{
+    std::vector<std::pair<Key, Value> > items;
+    for (; first != last; ++first) {
+        items.push_back(std::pair<Key, Value>((*first).first, (*first).second));
+    }
+
+    std::stable_sort(items.begin(), items.end(),
+        [this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) { return keyLess(a.first, b.first); });
+
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < items.size(); ++i) {
+        if (kept > 0 && !keyLess(items[kept - 1].first, items[i].first)) {
+            items[kept - 1] = std::move(items[i]);
+        } else {
+            if (kept != i) {
+                items[kept] = std::move(items[i]);
+            }
+            ++kept;
+        }
+    }
+
+    clear();
+    std::move_iterator<typename std::vector<std::pair<Key, Value> >::iterator> it(items.begin());
+    buildTree(it, kept);
+}
+
+/**
+* Makes the tree, which must be empty, a height-minimal one holding the
+* next n items of it, which must be sorted by strictly increasing key.
+*/
+template<class Key, class Value, class Compare>
+template<typename It>
+void BinarySearchTree<Key, Value, Compare>::buildTree(It& it, std::size_t n)
+{
+    this->root_ = buildSubtree(it, n, nullptr);
+    this->size_ = n;
+    threadSubtree(this->root_);
+}
+
+/**
+* Builds a height-minimal subtree out of the next n items of it, consuming
+* them in order, and returns its root.
+* The left side gets the extra item when n - 1 is odd, so every node
+* leans left by at most one.
+*/
+template<class Key, class Value, class Compare>
+template<typename It>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::buildSubtree(It& it, std::size_t n, Node<Key, Value>* parent)
+{
+    if (n == 0) {
+        return nullptr;
+    }
+
+    std::size_t leftSize = n / 2;
+    std::size_t rightSize = n - 1 - leftSize;
+
+    Node<Key, Value>* left = buildSubtree(it, leftSize, nullptr);
+    Node<Key, Value>* node = nullptr;
+    try {
+        node = createItemNode(*it, parent);
+    } catch (...) {
+        clearSubtree(left);
+        throw;
+    }
+    ++it;
+
+    node->setLeft(left);
+    if (left != nullptr) {
+        left->setParent(node);
+    }
+
+    try {
+        node->setRight(buildSubtree(it, rightSize, node));
+    } catch (...) {
+        clearSubtree(node);
+        throw;
+    }
+
+    setBuiltShape(node, minimalHeight(rightSize) - minimalHeight(leftSize), n);
+    return node;
+}
+
+template<class Key, class Value, class Compare>
+template<typename Item>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::createItemNode(const Item& item, Node<Key, Value>* parent)
+{
+    return createNode(item.first, Value(item.second), parent);
+}
+
+template<class Key, class Value, class Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::createItemNode(std::pair<Key, Value>&& item, Node<Key, Value>* parent)
+{
+    return createNode(std::move(item.first), std::move(item.second), parent);
+}
+
+/**
+* Called for each node built by assign_sorted() with the height difference
+* of its subtrees (right minus left) and the number of nodes in its subtree.
+* A plain BST tracks neither.
+*/
+template<class Key, class Value, class Compare>
+void BinarySearchTree<Key, Value, Compare>::setBuiltShape(Node<Key, Value>* node, int balance, std::size_t size)
+{
+
+}
+
+/**
+* Height of a height-minimal tree with n nodes, i.e. the bit length of n.
+*/
+template<class Key, class Value, class Compare>
+int BinarySearchTree<Key, Value, Compare>::minimalHeight(std::size_t n)
+{
+    int height = 0;
+    while (n != 0) {
+        ++height;
+        n >>= 1;
+    }
+    return height;
+}
+
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+void BinarySearchTree<Key, Value, Compare>::apply_batch(ForwardIt first, ForwardIt last)
+{
+    std::size_t count = 0;
+    if (batchSorted(first, last, count) && batchRebuilds(count)) {
+        applyBatchRebuild(first, last);
+    } else {
+        applyBatchOneByOne(first, last);
+    }
+}
+
+/**
+* Counts the ops of a batch into count and tells whether their keys are
+* in non-decreasing order, in one walk.
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+bool BinarySearchTree<Key, Value, Compare>::batchSorted(ForwardIt first, ForwardIt last, std::size_t& count) const
+{
+    bool sorted = true;
+    count = 0;
+    for (ForwardIt prev = first, current = first; current != last; prev = current, ++current, ++count) {
+        if (current != first && keyLess((*current).key, (*prev).key)) {
+            sorted = false;
+        }
+    }
+    return sorted;
+}
+
+/**
+* Whether a sorted batch of count ops is better merged into a rebuilt tree.
+* Applying ops costs about count * log(size / count) steps, a rebuild always
+* costs size + count but touches memory in order. Without a known size,
+* counting first would already cost a full walk.
+*/
+template<class Key, class Value, class Compare>
+bool BinarySearchTree<Key, Value, Compare>::batchRebuilds(std::size_t count) const
+{
+    return size_ != UNKNOWN_SIZE && count >= BATCH_REBUILD_FACTOR * size_;
+}
+
+/**
+* Applies a batch as one insert_or_assign() or remove() per op, each with
+* a descent from the root and rebalancing of its own.
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+void BinarySearchTree<Key, Value, Compare>::applyBatchOneByOne(ForwardIt first, ForwardIt last)
+{
+    for (; first != last; ++first) {
+        if ((*first).remove) {
+            remove((*first).key);
+        } else {
+            insert_or_assign((*first).key, (*first).value);
+        }
+    }
+}
+
+/**
+* Compares keys, or a key and a lookup key, with the tree's Compare.
+* Every key comparison of the tree goes through here.
+*/
+template<class Key, class Value, class Compare>
+template<typename A, typename B>
+bool BinarySearchTree<Key, Value, Compare>::keyLess(const A& a, const B& b) const
+{
+    BST_STATS_COUNT(comparisons);
+    return compare_(a, b);
+}
+
+/**
+* Merges the tree's items with a sorted batch in a single in-order pass,
+* then rebuilds the tree height-minimal from the result. Values are copied
+* out of the old nodes, which are only destroyed once the new tree is
+* built, so if Key or Value throws the tree is left as it was.
+*/
+template<class Key, class Value, class Compare>
+template<typename ForwardIt>
+void BinarySearchTree<Key, Value, Compare>::applyBatchRebuild(ForwardIt first, ForwardIt last)
+{
+    std::vector<std::pair<Key, Value> > items;
+
+    items.reserve(size_ + std::distance(first, last));
+    Node<Key, Value>* current = getSmallestNode();
+
+    for (; first != last; ++first) {
+        const Key& key = (*first).key;
+
+        while (current != nullptr && keyLess(current->getKey(), key)) {
+            items.push_back(std::pair<Key, Value>(current->getKey(), current->getValue()));
+            current = successor(current);
+        }
+
+        bool haveKey = !items.empty() && !keyLess(items.back().first, key);
+        if (!haveKey && current != nullptr && !keyLess(key, current->getKey())) {
+            items.push_back(std::pair<Key, Value>(current->getKey(), current->getValue()));
+            current = successor(current);
+            haveKey = true;
+        }
+
+        if ((*first).remove) {
+            if (haveKey) {
+                items.pop_back();
+            }
+        } else if (haveKey) {
+            items.back().second = (*first).value;
+        } else {
+            items.push_back(std::pair<Key, Value>(key, (*first).value));
+        }
+    }
+
+    while (current != nullptr) {
+        items.push_back(std::pair<Key, Value>(current->getKey(), current->getValue()));
+        current = successor(current);
+    }
+
+    Node<Key, Value>* old = this->root_;
+    std::move_iterator<typename std::vector<std::pair<Key, Value> >::iterator> it(items.begin());
+    buildTree(it, items.size());
+    clearSubtree(old);
+}
+
+
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::promoteSingleSubtree(Node<Key, Value>* target, Node<Key, Value>* subtree) {
 
     if (target == nullptr) {
         return;
@@ -600,8 +1964,8 @@ void BinarySearchTree<Key, Value>::promoteSingleSubtree(Node<Key, Value>* target
 * Recall: The writeup specifies that if a node has 2 children you
 * should swap with the predecessor and then remove.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::remove(const Key& key)
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::remove(const Key& key)
 {
     Node<Key, Value>* val = internalFind(key);
 
@@ -609,13 +1973,16 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
         return;
     }
 
-    if (val == root_ && root_->isLeaf()) {
-        clear();
-
-        return;
-    }
-
+    removeNode(val);
+    noteRemoved();
+}
 
+/**
+* Unlinks val and destroys it. The caller keeps size_ up to date.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::removeNode(Node<Key, Value>* val)
+{
     bool leftNull = val->getLeft() == nullptr;
     bool rightNull = val->getRight() == nullptr;
 
@@ -636,24 +2003,28 @@ void BinarySearchTree<Key, Value>::remove(const Key& key)
             Node<Key, Value>* parent = val->getParent();
 
             //remove references to deleted memory
-            if (parent != nullptr && parent->getRight() != nullptr && parent->getRight()->getKey() == key) {
+            if (parent != nullptr && parent->getRight() == val) {
                 parent->setRight(nullptr);
-            }else if (parent != nullptr && parent->getLeft() != nullptr && parent->getLeft()->getKey() == key) {
+            }else if (parent != nullptr && parent->getLeft() == val) {
                 parent->setLeft(nullptr);
             }
         }
     }
 
-    delete val;
+    unthreadNode(val);
+    destroyNode(val);
 
 }
 
 
 
-template<class Key, class Value>
+template<class Key, class Value, class Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
+BinarySearchTree<Key, Value, Compare>::predecessor(Node<Key, Value>* current)
 {
+#if defined(BST_THREADED)
+    return current->getPrev();
+#else
     //if we have a left child, it's the max in that subtree
     if (current->getLeft() != nullptr) {
         return nodeMax(current->getLeft());
@@ -667,41 +2038,329 @@ BinarySearchTree<Key, Value>::predecessor(Node<Key, Value>* current)
     }
 
     return node;
+#endif
 }
 
-template <typename Key, typename Value>
-void BinarySearchTree<Key, Value>::recursiveClearTree(Node<Key, Value>* current) {
-    if (current != nullptr) {
-        recursiveClearTree(current->getLeft());
-        current->setLeft(nullptr);
-        recursiveClearTree(current->getRight());
-        current->setRight(nullptr);
-        delete current;
+/**
+* Destroys every node in the subtree rooted at current without recursion
+* or an auxiliary stack, so even a tree degenerated into a list millions
+* of nodes long can be torn down.
+* While the current node has a left child, that child is rotated up into
+* its place; once there is no left child the node is destroyed and its
+* right child takes over. Each node is rotated past at most once, so this
+* is O(n) time and O(1) extra space. Parent pointers are left stale since
+* every node is going away.
+*/
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::clearSubtree(Node<Key, Value>* current) {
+    while (current != nullptr) {
+        Node<Key, Value>* left = current->getLeft();
+        if (left != nullptr) {
+            current->setLeft(left->getRight());
+            left->setRight(current);
+            current = left;
+        } else {
+            Node<Key, Value>* right = current->getRight();
+            destroyNode(current);
+            current = right;
+        }
+    }
+}
+
+
+/**
+* Threads a node just hung off its parent as a leaf: a left child comes
+* right before its parent in order, a right child right after it.
+*/
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::threadLeaf(Node<Key, Value>* leaf)
+{
+#if defined(BST_THREADED)
+    Node<Key, Value>* parent = leaf->getParent();
+    if (parent == nullptr) {
+        threadNode(leaf, nullptr, nullptr);
+    }else if (leaf == parent->getLeft()) {
+        threadNode(leaf, parent->getPrev(), parent);
+    }else {
+        threadNode(leaf, parent, parent->getNext());
+    }
+#endif
+}
+
+/**
+* Links node in between prev and next, either of which may be null.
+*/
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::threadNode(Node<Key, Value>* node, Node<Key, Value>* prev, Node<Key, Value>* next)
+{
+#if defined(BST_THREADED)
+    node->setPrev(prev);
+    node->setNext(next);
+    if (prev != nullptr) {
+        prev->setNext(node);
+    }
+    if (next != nullptr) {
+        next->setPrev(node);
+    }
+#endif
+}
+
+/**
+* Links node's neighbours to each other, leaving node out.
+*/
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::unthreadNode(Node<Key, Value>* node)
+{
+#if defined(BST_THREADED)
+    Node<Key, Value>* prev = node->getPrev();
+    Node<Key, Value>* next = node->getNext();
+    if (prev != nullptr) {
+        prev->setNext(next);
+    }
+    if (next != nullptr) {
+        next->setPrev(prev);
+    }
+    node->setPrev(nullptr);
+    node->setNext(nullptr);
+#endif
+}
+
+/**
+* Swaps the places of n1 and n2 in the threads, to follow nodeSwap().
+* When they are neighbours, each one's link to the other is turned around.
+*/
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::swapThreads(Node<Key, Value>* n1, Node<Key, Value>* n2)
+{
+#if defined(BST_THREADED)
+    if (n2->getNext() == n1) {
+        std::swap(n1, n2);
+    }
+
+    Node<Key, Value>* prev1 = n1->getPrev();
+    Node<Key, Value>* next1 = n1->getNext();
+    Node<Key, Value>* prev2 = n2->getPrev();
+    Node<Key, Value>* next2 = n2->getNext();
+
+    if (next1 == n2) {
+        //prev1, n1, n2, next2 becomes prev1, n2, n1, next2
+        threadNode(n2, prev1, n1);
+        threadNode(n1, n2, next2);
+        return;
+    }
+
+    threadNode(n2, prev1, next1);
+    threadNode(n1, prev2, next2);
+#endif
+}
+
+/**
+* Threads the detached subtree under root in one in-order walk, with its
+* first and last nodes' outer threads null. O(n).
+*/
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::threadSubtree(Node<Key, Value>* root)
+{
+#if defined(BST_THREADED)
+    NodeStack stack;
+    Node<Key, Value>* prev = nullptr;
+    Node<Key, Value>* node = root;
+    for (;;) {
+        for (; node != nullptr; node = node->getLeft()) {
+            stack.push(node);
+        }
+        if (stack.empty()) {
+            break;
+        }
+        node = stack.pop();
+        node->setPrev(prev);
+        if (prev != nullptr) {
+            prev->setNext(node);
+        }
+        prev = node;
+        node = node->getRight();
+    }
+    if (prev != nullptr) {
+        prev->setNext(nullptr);
+    }
+#endif
+}
+
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::cutThreads(Node<Key, Value>* lowerRoot, Node<Key, Value>* upperRoot)
+{
+#if defined(BST_THREADED)
+    if (lowerRoot != nullptr) {
+        nodeMax(lowerRoot)->setNext(nullptr);
+    }
+    if (upperRoot != nullptr) {
+        nodeMin(upperRoot)->setPrev(nullptr);
     }
+#endif
 }
 
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::threadPivot(Node<Key, Value>* lowerRoot, Node<Key, Value>* pivot, Node<Key, Value>* upperRoot)
+{
+#if defined(BST_THREADED)
+    threadNode(pivot, lowerRoot != nullptr ? nodeMax(lowerRoot) : nullptr, upperRoot != nullptr ? nodeMin(upperRoot) : nullptr);
+#endif
+}
 
 /**
 * A method to remove all contents of the tree and
 * reset the values in the tree for use again.
+* When neither the key nor the value needs its destructor run,
+* the nodes are not visited at all and the arena just drops its blocks.
+* An arena still shared with another tree is left to that tree, and this
+* one starts over with a fresh arena.
 */
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::clear()
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::clear()
 {
-
-    recursiveClearTree(this->root_);
+    if (!(std::is_trivially_destructible<Key>::value && std::is_trivially_destructible<Value>::value)) {
+        clearSubtree(this->root_);
+    }else {
+        BST_STATS_ADD(frees, size());
+    }
     this->root_ = nullptr;
+    this->size_ = 0;
+    this->adoptedArenas_.clear();
+    if (this->arena_.use_count() == 1) {
+        this->arena_->release();
+    } else {
+        this->arena_ = newArena();
+    }
+
+}
+
+/**
+* Constructs a node in a slot from the arena, moving the value in.
+*/
+template<typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::createNode(const Key& key, Value&& value, Node<Key, Value>* parent)
+{
+    BST_STATS_COUNT(allocations);
+    void* slot = arena_->allocate();
+    try {
+        return new (slot) Node<Key, Value>(key, std::move(value), parent);
+    } catch (...) {
+        arena_->deallocate(slot);
+        throw;
+    }
+}
+
+/**
+* Constructs a node in a slot from the arena, moving both the key and value in.
+*/
+template<typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::createNode(Key&& key, Value&& value, Node<Key, Value>* parent)
+{
+    BST_STATS_COUNT(allocations);
+    void* slot = arena_->allocate();
+    try {
+        return new (slot) Node<Key, Value>(std::move(key), std::move(value), parent);
+    } catch (...) {
+        arena_->deallocate(slot);
+        throw;
+    }
+}
+
+/**
+* Destroys a node and hands its slot back to the arena.
+* Virtual since nodes have no virtual destructor; derived trees
+* override this to destroy their own node type.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::destroyNode(Node<Key, Value>* node)
+{
+    node->~Node();
+    releaseSlot(node);
+}
+
+/**
+* Hands the slot of a destroyed node back to arena_ for reuse, in O(1).
+* A slot from an adopted arena goes on arena_'s free list as well: all
+* slots of a tree are the same size, and adoptedArenas_ keeps the block
+* it lies in alive for as long as arena_'s free list can hand it out,
+* until clear() drops both together.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::releaseSlot(Node<Key, Value>* node)
+{
+    BST_STATS_COUNT(frees);
+    arena_->deallocate(node);
+}
+
+/**
+* An empty arena with the same slots as arena_.
+*/
+template<typename Key, typename Value, typename Compare>
+std::shared_ptr<NodeArena> BinarySearchTree<Key, Value, Compare>::newArena() const
+{
+    return std::make_shared<NodeArena>(arena_->slotSize(), arena_->alignment());
+}
+
+/**
+* Gives this tree, which holds no nodes any more, a fresh arena and drops
+* the ones it adopted. The old arena is left to the trees that took the
+* nodes: its free list may hand out slots only they keep alive.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::resetArena()
+{
+    arena_ = newArena();
+    adoptedArenas_.clear();
+}
+
+/**
+* Makes this tree keep alive every arena other's nodes may live in. An
+* arena without blocks holds none of them and is left out, so the list
+* stays as short as the number of arenas actually in use.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::adoptArenas(BinarySearchTree<Key, Value, Compare>& other)
+{
+    std::vector<std::shared_ptr<NodeArena> > incoming(other.adoptedArenas_);
+    incoming.push_back(other.arena_);
+
+    for (std::size_t i = 0; i < incoming.size(); ++i) {
+        if (incoming[i] == arena_ || incoming[i]->blockCount() == 0) {
+            continue;
+        }
+        if (std::find(adoptedArenas_.begin(), adoptedArenas_.end(), incoming[i]) == adoptedArenas_.end()) {
+            adoptedArenas_.push_back(incoming[i]);
+        }
+    }
+}
 
+/**
+* Moves other's nodes into this empty tree, whose arena_ is already set up
+* to be the one new nodes come from.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::takeContents(BinarySearchTree<Key, Value, Compare>& other)
+{
+    adoptArenas(other);
+    root_ = other.root_;
+    size_ = other.size_;
+    compare_ = other.compare_;
+    other.root_ = nullptr;
+    other.size_ = 0;
+    other.resetArena();
 }
 
 
 /**
 * A helper function to find the smallest node in the tree.
 */
-template<typename Key, typename Value>
+template<typename Key, typename Value, typename Compare>
 Node<Key, Value>*
-BinarySearchTree<Key, Value>::getSmallestNode() const
+BinarySearchTree<Key, Value, Compare>::getSmallestNode() const
 {
+    if (root_ == nullptr) {
+        return nullptr;
+    }
     return nodeMin(root_);
 }
 
@@ -710,42 +2369,207 @@ BinarySearchTree<Key, Value>::getSmallestNode() const
 * return a pointer to it or NULL if no item with that key
 * exists
 */
-template<typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::internalFind(const Key& key) const
+template<typename Key, typename Value, typename Compare>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::internalFind(const K& key) const
+{
+    //the lower bound is the only node that can hold key, so the descent
+    //compares once per level and equality is checked once at the end
+    Node<Key, Value>* currentNode = this->root_;
+    Node<Key, Value>* bound = nullptr;
+    BST_STATS_COUNT(finds);
+
+    while (currentNode != nullptr) {
+        BST_STATS_COUNT(findNodesVisited);
+        if (keyLess(currentNode->getKey(), key)) {
+            currentNode = currentNode->getRight();
+        }else {
+            bound = currentNode;
+            currentNode = currentNode->getLeft();
+        }
+    }
+
+    if (bound != nullptr && !keyLess(key, bound->getKey())) {
+        return bound;
+    }
+    return nullptr;
+}
+
+/**
+* Wraps a node in an iterator over this tree.
+*/
+template<typename Key, typename Value, typename Compare>
+typename BinarySearchTree<Key, Value, Compare>::iterator
+BinarySearchTree<Key, Value, Compare>::makeIterator(Node<Key, Value>* node)
+{
+    return iterator(node, this);
+}
+
+template<typename Key, typename Value, typename Compare>
+typename BinarySearchTree<Key, Value, Compare>::const_iterator
+BinarySearchTree<Key, Value, Compare>::makeIterator(Node<Key, Value>* node) const
+{
+    return const_iterator(node, this);
+}
+
+/**
+* Given the lower bound of key, returns the node just past the items with
+* that key: the bound's successor if it holds key, the bound itself if not.
+*/
+template<typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::equalRangeEnd(Node<Key, Value>* first, const Key& key) const
+{
+    if (first != nullptr && !keyLess(key, first->getKey())) {
+        return successor(first);
+    }
+    return first;
+}
+
+/**
+* Finds the first node of [a, b) and the node just past it.
+*/
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::rangeNodes(const Key& a, const Key& b, Node<Key, Value>*& first, Node<Key, Value>*& last) const
+{
+    first = lowerBoundNode(a);
+    last = keyLess(a, b) ? lowerBoundNode(b) : first;
+}
+
+/**
+* Returns the node with the smallest key not less than key, or NULL.
+* Descends once, remembering the last node where it turned left.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::lowerBoundNode(const K& key) const
 {
     Node<Key, Value>* currentNode = this->root_;
+    Node<Key, Value>* bound = nullptr;
+
+    while (currentNode != nullptr) {
+        if (keyLess(currentNode->getKey(), key)) {
+            currentNode = currentNode->getRight();
+        }else {
+            bound = currentNode;
+            currentNode = currentNode->getLeft();
+        }
+    }
 
-    //iff curentNode is not null and the keys do not match
-    while (currentNode != nullptr && currentNode->getKey() != key) {
+    return bound;
+}
+
+/**
+* Returns the node with the smallest key greater than key, or NULL.
+*/
+template<typename Key, typename Value, typename Compare>
+template<typename K>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::upperBoundNode(const K& key) const
+{
+    Node<Key, Value>* currentNode = this->root_;
+    Node<Key, Value>* bound = nullptr;
 
-        if (key < currentNode->getKey()) {
-            //go down the left subtree if key is less than the current node's key
+    while (currentNode != nullptr) {
+        if (keyLess(key, currentNode->getKey())) {
+            bound = currentNode;
             currentNode = currentNode->getLeft();
         }else {
-            //go down the right subtree if key is larger than the current node's key
             currentNode = currentNode->getRight();
         }
-
     }
 
+    return bound;
+}
 
-    return currentNode;
+/**
+ * Return true iff the BST is balanced. An empty tree is.
+ */
+template<typename Key, typename Value, typename Compare>
+bool BinarySearchTree<Key, Value, Compare>::isBalanced() const
+{
+    return shape_stats().balanced;
 }
 
 /**
- * Return true iff the BST is balanced.
+ * Walks the tree once in post-order with an explicit stack, so a
+ * degenerate tree cannot overflow the call stack. Each node is pushed
+ * twice: first to push its children, then, once their heights sit on top
+ * of the height stack, to combine them. O(n) time, O(height) space.
  */
-template<typename Key, typename Value>
-bool BinarySearchTree<Key, Value>::isBalanced() const
+template<typename Key, typename Value, typename Compare>
+ShapeStats BinarySearchTree<Key, Value, Compare>::shape_stats() const
 {
-    return this->root_->isBalanced();
+    struct Frame
+    {
+        Node<Key, Value>* node;
+        std::size_t depth;
+        bool expanded;
+    };
+
+    ShapeStats shape;
+    if (this->root_ == nullptr) {
+        return shape;
+    }
+
+    std::vector<Frame> frames;
+    std::vector<int> heights;
+    std::size_t depthSum = 0;
+    frames.push_back(Frame{this->root_, 0, false});
+
+    while (!frames.empty()) {
+        Frame frame = frames.back();
+        frames.pop_back();
+        Node<Key, Value>* node = frame.node;
+
+        if (!frame.expanded) {
+            frames.push_back(Frame{node, frame.depth, true});
+            // left is pushed last so it finishes first, leaving the right
+            // height on top
+            if (node->getRight() != nullptr) {
+                frames.push_back(Frame{node->getRight(), frame.depth + 1, false});
+            }
+            if (node->getLeft() != nullptr) {
+                frames.push_back(Frame{node->getLeft(), frame.depth + 1, false});
+            }
+            continue;
+        }
+
+        int rightHeight = 0;
+        int leftHeight = 0;
+        if (node->getRight() != nullptr) {
+            rightHeight = heights.back();
+            heights.pop_back();
+        }
+        if (node->getLeft() != nullptr) {
+            leftHeight = heights.back();
+            heights.pop_back();
+        }
+        heights.push_back(std::max(leftHeight, rightHeight) + 1);
+
+        const int balance = rightHeight - leftHeight;
+        ++shape.balanceHistogram[balance];
+        if (balance < -1 || balance > 1) {
+            shape.balanced = false;
+        }
+
+        ++shape.nodes;
+        if (leftHeight == 0 && rightHeight == 0) {
+            ++shape.leaves;
+        }
+        depthSum += frame.depth;
+        shape.maxDepth = std::max(shape.maxDepth, frame.depth);
+    }
+
+    shape.height = heights.back();
+    shape.averageDepth = static_cast<double>(depthSum) / shape.nodes;
+    return shape;
 }
 
 
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value>* n2)
 {
+    BST_STATS_COUNT(nodeSwaps);
     if((n1 == n2) || (n1 == nullptr) || (n2 == nullptr) ) {
         return;
     }
@@ -825,10 +2649,12 @@ void BinarySearchTree<Key, Value>::nodeSwap( Node<Key,Value>* n1, Node<Key,Value
         this->root_ = n1;
     }
 
+    swapThreads(n1, n2);
+
 }
 
-template <typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::nodeMin(Node<Key, Value>* current) {
+template <typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::nodeMin(Node<Key, Value>* current) {
     Node<Key, Value>* temp = current;
     while (temp->getLeft() != nullptr) {
         temp = temp->getLeft();
@@ -836,8 +2662,8 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::nodeMin(Node<Key, Value>* curren
     return temp;
 }
 
-template <typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::nodeMax(Node<Key, Value>* current) {
+template <typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::nodeMax(Node<Key, Value>* current) {
     Node<Key, Value>* temp = current;
     while (temp->getRight() != nullptr) {
         temp = temp->getRight();
@@ -845,8 +2671,11 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::nodeMax(Node<Key, Value>* curren
     return temp;
 }
 
-template <typename Key, typename Value>
-Node<Key, Value>* BinarySearchTree<Key, Value>::successor(Node<Key, Value>* current) {
+template <typename Key, typename Value, typename Compare>
+Node<Key, Value>* BinarySearchTree<Key, Value, Compare>::successor(Node<Key, Value>* current) {
+#if defined(BST_THREADED)
+    return current->getNext();
+#else
     //if we have a right subtree, get the minimum from there
     if (current->getRight() != nullptr) {
         return nodeMin(current->getRight());
@@ -863,7 +2692,7 @@ Node<Key, Value>* BinarySearchTree<Key, Value>::successor(Node<Key, Value>* curr
     //then return either null(we walked all the way up)
     //or the parent of the subtree we just exited
     return node;
-
+#endif
 }
 
 
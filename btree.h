@@ -0,0 +1,896 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+* The default BTree fanout, enough keys to fill 256 bytes (four cache
+* lines) per node, and never less than 8.
+*/
+template <typename Key>
+constexpr std::size_t btreeDefaultFanout()
+{
+    return 256 / sizeof(Key) < 8 ? 8 : 256 / sizeof(Key);
+}
+
+/**
+* A B+ tree map with the insert/remove/find/iterator/operator[] surface of
+* BinarySearchTree, so code can switch between them with a typedef.
+*
+* Every item lives in a leaf, leaves are linked in key order for iteration,
+* and internal nodes only hold separator keys to route searches. Nodes have
+* room for Fanout keys, so a search reads a few whole cache lines per level
+* instead of one mostly wasted line per binary node, over log_{Fanout/2} n
+* levels at most. Within a node keys are scanned linearly; for 32-bit
+* integral keys the scan compares four keys at a time with SSE2.
+*
+* Keys and values are kept in separate arrays, so Key and Value must be
+* default constructible and assignable, and iterators hand out a pair of
+* references instead of a reference to a pair. Inserting or removing moves
+* items within and between nodes, so it invalidates every iterator.
+*/
+template <typename Key, typename Value, std::size_t Fanout = btreeDefaultFanout<Key>()>
+class BTree
+{
+    static_assert(Fanout >= 4, "BTree nodes need room for at least 4 keys");
+
+protected:
+    struct Leaf;
+
+public:
+    BTree();
+    BTree(BTree&& other);
+    BTree& operator=(BTree&& other);
+    ~BTree();
+
+    /**
+    * Iterators over the items in key order. As with BinarySearchTree,
+    * the const flavour only hands out const values and can be made from a
+    * plain one, and end() can be stepped back from.
+    */
+    template<bool IsConst>
+    class basic_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef std::pair<const Key&, typename std::conditional<IsConst, const Value&, Value&>::type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type reference;
+
+        // keys and values are stored apart, so -> hands out a pair of references
+        class pointer
+        {
+        public:
+            const value_type* operator->() const;
+
+        private:
+            friend class basic_iterator;
+            explicit pointer(const value_type& item);
+            value_type item_;
+        };
+
+        basic_iterator();
+        basic_iterator(const basic_iterator<false>& other);
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        template<bool RhsConst>
+        bool operator==(const basic_iterator<RhsConst>& rhs) const;
+        template<bool RhsConst>
+        bool operator!=(const basic_iterator<RhsConst>& rhs) const;
+
+        basic_iterator& operator++();
+        basic_iterator operator++(int);
+        basic_iterator& operator--();
+        basic_iterator operator--(int);
+
+    protected:
+        friend class BTree<Key, Value, Fanout>;
+        template<bool> friend class basic_iterator;
+        basic_iterator(Leaf* leaf, std::size_t index, const BTree* tree);
+
+        // null past the end
+        Leaf* leaf_;
+        std::size_t index_;
+        // needed to step back from end()
+        const BTree* tree_;
+    };
+
+    typedef basic_iterator<false> iterator;
+    typedef basic_iterator<true> const_iterator;
+
+    // Inserting an existing key replaces its value.
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool empty() const;
+    std::size_t size() const;
+
+    iterator begin();
+    const_iterator begin() const;
+    iterator end();
+    const_iterator end() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+protected:
+    // Non-root nodes never drop below this many items (in a leaf) or
+    // children (in an internal node). Two minimal nodes fit in one.
+    static const std::size_t MIN_COUNT = Fanout / 2;
+
+    struct Node
+    {
+        explicit Node(bool isLeaf);
+
+        // items in a leaf, children in an internal node
+        std::size_t count;
+        bool isLeaf;
+        // a leaf's keys, or an internal node's count - 1 separators, where
+        // keys[i] is no greater than any key below children[i + 1]
+        Key keys[Fanout];
+    };
+
+    struct Leaf : Node
+    {
+        Leaf();
+
+        Value values[Fanout];
+        Leaf* prev;
+        Leaf* next;
+    };
+
+    struct Internal : Node
+    {
+        Internal();
+
+        Node* children[Fanout];
+    };
+
+    // picks the vectorized scan where there is one for Key
+#if defined(__SSE2__)
+    typedef std::integral_constant<bool,
+        std::is_integral<Key>::value && std::is_signed<Key>::value && sizeof(Key) == 4> SimdSearchTag;
+#else
+    typedef std::false_type SimdSearchTag;
+#endif
+
+    // How many of the sorted keys[0, count) are less than key, or no
+    // greater than it if OrEqual.
+    template<bool OrEqual>
+    static std::size_t countBelow(const Key* keys, std::size_t count, const Key& key);
+    template<bool OrEqual>
+    static std::size_t countBelow(const Key* keys, std::size_t count, const Key& key, std::false_type);
+#if defined(__SSE2__)
+    template<bool OrEqual>
+    static std::size_t countBelow(const Key* keys, std::size_t count, const Key& key, std::true_type);
+#endif
+
+    static std::size_t childIndex(const Internal* node, const Key& key);
+    Leaf* findLeaf(const Key& key) const;
+    template<bool OrEqual>
+    iterator bound(const Key& key) const;
+
+    void splitChild(Internal* parent, std::size_t i);
+    std::size_t fixChild(Internal* parent, std::size_t i);
+    void borrowFromLeft(Internal* parent, std::size_t i);
+    void borrowFromRight(Internal* parent, std::size_t i);
+    void mergeChildren(Internal* parent, std::size_t i);
+    static void destroySubtree(Node* node);
+
+    Node* root_;
+    // ends of the leaf list
+    Leaf* first_;
+    Leaf* last_;
+    std::size_t size_;
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for the BTree iterator.
+  ---------------------------------------------
+*/
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::pointer::pointer(const value_type& item) : item_(item)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+const typename BTree<Key, Value, Fanout>::template basic_iterator<IsConst>::value_type*
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::pointer::operator->() const
+{
+    return &item_;
+}
+
+/**
+* Constructs a past the end iterator belonging to no tree.
+*/
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::basic_iterator() : leaf_(nullptr), index_(0), tree_(nullptr)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::basic_iterator(const basic_iterator<false>& other) :
+    leaf_(other.leaf_),
+    index_(other.index_),
+    tree_(other.tree_)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::basic_iterator(Leaf* leaf, std::size_t index, const BTree* tree) :
+    leaf_(leaf),
+    index_(index),
+    tree_(tree)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+typename BTree<Key, Value, Fanout>::template basic_iterator<IsConst>::reference
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator*() const
+{
+    return reference(leaf_->keys[index_], leaf_->values[index_]);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+typename BTree<Key, Value, Fanout>::template basic_iterator<IsConst>::pointer
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+template<bool RhsConst>
+bool BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator==(const basic_iterator<RhsConst>& rhs) const
+{
+    return leaf_ == rhs.leaf_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+template<bool RhsConst>
+bool BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator!=(const basic_iterator<RhsConst>& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Steps to the next item, moving on to the next leaf after a leaf's last.
+*/
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+typename BTree<Key, Value, Fanout>::template basic_iterator<IsConst>&
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator++()
+{
+    if (++index_ == leaf_->count) {
+        leaf_ = leaf_->next;
+        index_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+typename BTree<Key, Value, Fanout>::template basic_iterator<IsConst>
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator++(int)
+{
+    basic_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/**
+* Steps to the previous item. From end() that is the last item.
+*/
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+typename BTree<Key, Value, Fanout>::template basic_iterator<IsConst>&
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator--()
+{
+    if (leaf_ == nullptr) {
+        leaf_ = tree_->last_;
+        index_ = leaf_->count - 1;
+    }else if (index_ == 0) {
+        leaf_ = leaf_->prev;
+        index_ = leaf_->count - 1;
+    }else {
+        --index_;
+    }
+    return *this;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool IsConst>
+typename BTree<Key, Value, Fanout>::template basic_iterator<IsConst>
+BTree<Key, Value, Fanout>::basic_iterator<IsConst>::operator--(int)
+{
+    basic_iterator old(*this);
+    --(*this);
+    return old;
+}
+
+/*
+  -------------------------------------------
+  End implementations for the BTree iterator.
+  -------------------------------------------
+*/
+
+/*
+  ------------------------------------------
+  Begin implementations for the BTree class.
+  ------------------------------------------
+*/
+
+template<class Key, class Value, std::size_t Fanout>
+BTree<Key, Value, Fanout>::Node::Node(bool isLeaf) : count(0), isLeaf(isLeaf)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+BTree<Key, Value, Fanout>::Leaf::Leaf() : Node(true), prev(nullptr), next(nullptr)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+BTree<Key, Value, Fanout>::Internal::Internal() : Node(false)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+BTree<Key, Value, Fanout>::BTree() : root_(nullptr), first_(nullptr), last_(nullptr), size_(0)
+{
+
+}
+
+template<class Key, class Value, std::size_t Fanout>
+BTree<Key, Value, Fanout>::BTree(BTree&& other) :
+    root_(other.root_),
+    first_(other.first_),
+    last_(other.last_),
+    size_(other.size_)
+{
+    other.root_ = nullptr;
+    other.first_ = nullptr;
+    other.last_ = nullptr;
+    other.size_ = 0;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+BTree<Key, Value, Fanout>& BTree<Key, Value, Fanout>::operator=(BTree&& other)
+{
+    if (this != &other) {
+        clear();
+        std::swap(root_, other.root_);
+        std::swap(first_, other.first_);
+        std::swap(last_, other.last_);
+        std::swap(size_, other.size_);
+    }
+    return *this;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+BTree<Key, Value, Fanout>::~BTree()
+{
+    clear();
+}
+
+/**
+* Descends once from the root, splitting every full node on the way down
+* so there is always room to split the one below, then puts the item into
+* its leaf, or overwrites the value if the key is already there.
+*/
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    const Key& key = keyValuePair.first;
+    if (root_ == nullptr) {
+        Leaf* leaf = new Leaf();
+        root_ = first_ = last_ = leaf;
+    }else if (root_->count == Fanout) {
+        Internal* root = new Internal();
+        root->children[0] = root_;
+        root->count = 1;
+        root_ = root;
+        splitChild(root, 0);
+    }
+
+    Node* node = root_;
+    while (!node->isLeaf) {
+        Internal* parent = static_cast<Internal*>(node);
+        std::size_t i = childIndex(parent, key);
+        if (parent->children[i]->count == Fanout) {
+            splitChild(parent, i);
+            if (!(key < parent->keys[i])) {
+                ++i;
+            }
+        }
+        node = parent->children[i];
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    std::size_t i = countBelow<false>(leaf->keys, leaf->count, key);
+    if (i < leaf->count && !(key < leaf->keys[i])) {
+        leaf->values[i] = keyValuePair.second;
+        return;
+    }
+    std::move_backward(leaf->keys + i, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+    std::move_backward(leaf->values + i, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+    leaf->keys[i] = key;
+    leaf->values[i] = keyValuePair.second;
+    ++leaf->count;
+    ++size_;
+}
+
+/**
+* Descends once from the root, topping up every minimal node on the way down
+* from a sibling, or merging it with one, so the leaf can lose an item
+* without any fixing up afterwards. Does nothing if the key is not present.
+*/
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::remove(const Key& key)
+{
+    if (root_ == nullptr) {
+        return;
+    }
+
+    Node* node = root_;
+    while (!node->isLeaf) {
+        Internal* parent = static_cast<Internal*>(node);
+        std::size_t i = childIndex(parent, key);
+        if (parent->children[i]->count <= MIN_COUNT) {
+            i = fixChild(parent, i);
+        }
+        node = parent->children[i];
+        if (parent == root_ && parent->count == 1) {
+            //the root's last two children were merged
+            root_ = node;
+            delete parent;
+        }
+    }
+
+    Leaf* leaf = static_cast<Leaf*>(node);
+    std::size_t i = countBelow<false>(leaf->keys, leaf->count, key);
+    if (i == leaf->count || key < leaf->keys[i]) {
+        return;
+    }
+    std::move(leaf->keys + i + 1, leaf->keys + leaf->count, leaf->keys + i);
+    std::move(leaf->values + i + 1, leaf->values + leaf->count, leaf->values + i);
+    --leaf->count;
+    --size_;
+
+    if (leaf->count == 0) {
+        //only the root can run empty
+        delete leaf;
+        root_ = first_ = last_ = nullptr;
+    }
+}
+
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::clear()
+{
+    destroySubtree(root_);
+    root_ = nullptr;
+    first_ = nullptr;
+    last_ = nullptr;
+    size_ = 0;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+bool BTree<Key, Value, Fanout>::empty() const
+{
+    return root_ == nullptr;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+std::size_t BTree<Key, Value, Fanout>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::iterator
+BTree<Key, Value, Fanout>::begin()
+{
+    return iterator(first_, 0, this);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::const_iterator
+BTree<Key, Value, Fanout>::begin() const
+{
+    return const_iterator(first_, 0, this);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::iterator
+BTree<Key, Value, Fanout>::end()
+{
+    return iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::const_iterator
+BTree<Key, Value, Fanout>::end() const
+{
+    return const_iterator(nullptr, 0, this);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::iterator
+BTree<Key, Value, Fanout>::find(const Key& key)
+{
+    iterator it = bound<false>(key);
+    if (it.leaf_ == nullptr || key < it.leaf_->keys[it.index_]) {
+        return end();
+    }
+    return it;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::const_iterator
+BTree<Key, Value, Fanout>::find(const Key& key) const
+{
+    return const_cast<BTree*>(this)->find(key);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::iterator
+BTree<Key, Value, Fanout>::lower_bound(const Key& key)
+{
+    return bound<false>(key);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::const_iterator
+BTree<Key, Value, Fanout>::lower_bound(const Key& key) const
+{
+    return bound<false>(key);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::iterator
+BTree<Key, Value, Fanout>::upper_bound(const Key& key)
+{
+    return bound<true>(key);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::const_iterator
+BTree<Key, Value, Fanout>::upper_bound(const Key& key) const
+{
+    return bound<true>(key);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+Value& BTree<Key, Value, Fanout>::operator[](const Key& key)
+{
+    iterator it = find(key);
+    if (it == end()) {
+        throw std::out_of_range("Invalid key");
+    }
+    return it->second;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+Value const & BTree<Key, Value, Fanout>::operator[](const Key& key) const
+{
+    return (*const_cast<BTree*>(this))[key];
+}
+
+template<class Key, class Value, std::size_t Fanout>
+template<bool OrEqual>
+std::size_t BTree<Key, Value, Fanout>::countBelow(const Key* keys, std::size_t count, const Key& key)
+{
+    return countBelow<OrEqual>(keys, count, key, SimdSearchTag());
+}
+
+/**
+* Plain linear scan, stopping at the first key past key.
+*/
+template<class Key, class Value, std::size_t Fanout>
+template<bool OrEqual>
+std::size_t BTree<Key, Value, Fanout>::countBelow(const Key* keys, std::size_t count, const Key& key, std::false_type)
+{
+    std::size_t i = 0;
+    while (i < count && (OrEqual ? !(key < keys[i]) : keys[i] < key)) {
+        ++i;
+    }
+    return i;
+}
+
+#if defined(__SSE2__)
+/**
+* Compares four keys per instruction, stopping at the first group of four
+* that is not entirely below key. Keys are sorted, so the count of those
+* below key in that group finishes the answer.
+*/
+template<class Key, class Value, std::size_t Fanout>
+template<bool OrEqual>
+std::size_t BTree<Key, Value, Fanout>::countBelow(const Key* keys, std::size_t count, const Key& key, std::true_type)
+{
+    const __m128i needle = _mm_set1_epi32(static_cast<int>(key));
+    std::size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+        //OrEqual counts the keys not greater than key
+        __m128i mask = OrEqual ? _mm_cmpgt_epi32(group, needle) : _mm_cmplt_epi32(group, needle);
+        int below = _mm_movemask_ps(_mm_castsi128_ps(mask));
+        if (OrEqual) {
+            below ^= 0xF;
+        }
+        if (below != 0xF) {
+            return i + __builtin_popcount(below);
+        }
+    }
+    return i + countBelow<OrEqual>(keys + i, count - i, key, std::false_type());
+}
+#endif
+
+/**
+* The child of node whose keys range covers key: the number of separators
+* no greater than key.
+*/
+template<class Key, class Value, std::size_t Fanout>
+std::size_t BTree<Key, Value, Fanout>::childIndex(const Internal* node, const Key& key)
+{
+    return countBelow<true>(node->keys, node->count - 1, key);
+}
+
+template<class Key, class Value, std::size_t Fanout>
+typename BTree<Key, Value, Fanout>::Leaf* BTree<Key, Value, Fanout>::findLeaf(const Key& key) const
+{
+    Node* node = root_;
+    while (node != nullptr && !node->isLeaf) {
+        const Internal* internal = static_cast<const Internal*>(node);
+        node = internal->children[childIndex(internal, key)];
+    }
+    return static_cast<Leaf*>(node);
+}
+
+/**
+* The first item with a key not less than key, or greater than it if
+* OrEqual. Separators send equal keys right, so it is in the leaf key
+* leads to, or else first in the next leaf.
+*/
+template<class Key, class Value, std::size_t Fanout>
+template<bool OrEqual>
+typename BTree<Key, Value, Fanout>::iterator BTree<Key, Value, Fanout>::bound(const Key& key) const
+{
+    Leaf* leaf = findLeaf(key);
+    if (leaf == nullptr) {
+        return iterator(nullptr, 0, this);
+    }
+    std::size_t i = countBelow<OrEqual>(leaf->keys, leaf->count, key);
+    if (i == leaf->count) {
+        return iterator(leaf->next, 0, this);
+    }
+    return iterator(leaf, i, this);
+}
+
+/**
+* Splits parent's full i-th child in two halves, adding the right half as
+* child i + 1. A leaf's right half starts with the new separator; an
+* internal node hands its middle separator up to parent.
+*/
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::splitChild(Internal* parent, std::size_t i)
+{
+    Node* child = parent->children[i];
+    const std::size_t half = Fanout / 2;
+    Node* right = nullptr;
+    Key separator;
+
+    if (child->isLeaf) {
+        Leaf* leaf = static_cast<Leaf*>(child);
+        Leaf* sibling = new Leaf();
+        std::move(leaf->keys + half, leaf->keys + Fanout, sibling->keys);
+        std::move(leaf->values + half, leaf->values + Fanout, sibling->values);
+        sibling->count = Fanout - half;
+        leaf->count = half;
+        separator = sibling->keys[0];
+
+        sibling->prev = leaf;
+        sibling->next = leaf->next;
+        if (leaf->next != nullptr) {
+            leaf->next->prev = sibling;
+        }else {
+            last_ = sibling;
+        }
+        leaf->next = sibling;
+        right = sibling;
+    }else {
+        Internal* internal = static_cast<Internal*>(child);
+        Internal* sibling = new Internal();
+        separator = internal->keys[half - 1];
+        std::move(internal->keys + half, internal->keys + Fanout - 1, sibling->keys);
+        std::copy(internal->children + half, internal->children + Fanout, sibling->children);
+        sibling->count = Fanout - half;
+        internal->count = half;
+        right = sibling;
+    }
+
+    std::move_backward(parent->keys + i, parent->keys + parent->count - 1, parent->keys + parent->count);
+    std::copy_backward(parent->children + i + 1, parent->children + parent->count, parent->children + parent->count + 1);
+    parent->keys[i] = separator;
+    parent->children[i + 1] = right;
+    ++parent->count;
+}
+
+/**
+* Gives parent's minimal i-th child an item or child more, from a sibling
+* that can spare one, or else merges it with a sibling. Returns the index
+* the child's range is at afterwards.
+*/
+template<class Key, class Value, std::size_t Fanout>
+std::size_t BTree<Key, Value, Fanout>::fixChild(Internal* parent, std::size_t i)
+{
+    if (i > 0 && parent->children[i - 1]->count > MIN_COUNT) {
+        borrowFromLeft(parent, i);
+        return i;
+    }
+    if (i + 1 < parent->count && parent->children[i + 1]->count > MIN_COUNT) {
+        borrowFromRight(parent, i);
+        return i;
+    }
+    if (i > 0) {
+        mergeChildren(parent, i - 1);
+        return i - 1;
+    }
+    mergeChildren(parent, i);
+    return i;
+}
+
+/**
+* Moves the last item or child of child i - 1 to the front of child i.
+*/
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::borrowFromLeft(Internal* parent, std::size_t i)
+{
+    Node* child = parent->children[i];
+    Node* left = parent->children[i - 1];
+
+    if (child->isLeaf) {
+        Leaf* to = static_cast<Leaf*>(child);
+        Leaf* from = static_cast<Leaf*>(left);
+        std::move_backward(to->keys, to->keys + to->count, to->keys + to->count + 1);
+        std::move_backward(to->values, to->values + to->count, to->values + to->count + 1);
+        to->keys[0] = std::move(from->keys[from->count - 1]);
+        to->values[0] = std::move(from->values[from->count - 1]);
+        parent->keys[i - 1] = to->keys[0];
+    }else {
+        Internal* to = static_cast<Internal*>(child);
+        Internal* from = static_cast<Internal*>(left);
+        std::move_backward(to->keys, to->keys + to->count - 1, to->keys + to->count);
+        std::copy_backward(to->children, to->children + to->count, to->children + to->count + 1);
+        //the parent's separator comes down, the left sibling's last goes up
+        to->keys[0] = std::move(parent->keys[i - 1]);
+        to->children[0] = from->children[from->count - 1];
+        parent->keys[i - 1] = std::move(from->keys[from->count - 2]);
+    }
+    --left->count;
+    ++child->count;
+}
+
+/**
+* Moves the first item or child of child i + 1 to the back of child i.
+*/
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::borrowFromRight(Internal* parent, std::size_t i)
+{
+    Node* child = parent->children[i];
+    Node* right = parent->children[i + 1];
+
+    if (child->isLeaf) {
+        Leaf* to = static_cast<Leaf*>(child);
+        Leaf* from = static_cast<Leaf*>(right);
+        to->keys[to->count] = std::move(from->keys[0]);
+        to->values[to->count] = std::move(from->values[0]);
+        std::move(from->keys + 1, from->keys + from->count, from->keys);
+        std::move(from->values + 1, from->values + from->count, from->values);
+        parent->keys[i] = from->keys[0];
+    }else {
+        Internal* to = static_cast<Internal*>(child);
+        Internal* from = static_cast<Internal*>(right);
+        //the parent's separator comes down, the right sibling's first goes up
+        to->keys[to->count - 1] = std::move(parent->keys[i]);
+        to->children[to->count] = from->children[0];
+        parent->keys[i] = std::move(from->keys[0]);
+        std::move(from->keys + 1, from->keys + from->count - 1, from->keys);
+        std::copy(from->children + 1, from->children + from->count, from->children);
+    }
+    --right->count;
+    ++child->count;
+}
+
+/**
+* Appends child i + 1 to child i, both minimal or less, and drops it and
+* their separator from parent.
+*/
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::mergeChildren(Internal* parent, std::size_t i)
+{
+    Node* left = parent->children[i];
+    Node* right = parent->children[i + 1];
+
+    if (left->isLeaf) {
+        Leaf* to = static_cast<Leaf*>(left);
+        Leaf* from = static_cast<Leaf*>(right);
+        std::move(from->keys, from->keys + from->count, to->keys + to->count);
+        std::move(from->values, from->values + from->count, to->values + to->count);
+        to->next = from->next;
+        if (from->next != nullptr) {
+            from->next->prev = to;
+        }else {
+            last_ = to;
+        }
+        to->count += from->count;
+        delete from;
+    }else {
+        Internal* to = static_cast<Internal*>(left);
+        Internal* from = static_cast<Internal*>(right);
+        to->keys[to->count - 1] = std::move(parent->keys[i]);
+        std::move(from->keys, from->keys + from->count - 1, to->keys + to->count);
+        std::copy(from->children, from->children + from->count, to->children + to->count);
+        to->count += from->count;
+        delete from;
+    }
+    std::move(parent->keys + i + 1, parent->keys + parent->count - 1, parent->keys + i);
+    std::copy(parent->children + i + 2, parent->children + parent->count, parent->children + i + 1);
+    --parent->count;
+}
+
+template<class Key, class Value, std::size_t Fanout>
+void BTree<Key, Value, Fanout>::destroySubtree(Node* node)
+{
+    if (node == nullptr) {
+        return;
+    }
+    if (node->isLeaf) {
+        delete static_cast<Leaf*>(node);
+        return;
+    }
+    Internal* internal = static_cast<Internal*>(node);
+    for (std::size_t i = 0; i < internal->count; ++i) {
+        destroySubtree(internal->children[i]);
+    }
+    delete internal;
+}
+
+/*
+  ----------------------------------------
+  End implementations for the BTree class.
+  ----------------------------------------
+*/
+
+#endif
@@ -0,0 +1,834 @@
+#ifndef COMPACT_AVLBST_H
+#define COMPACT_AVLBST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+* An AVL tree map with the insert/remove/find/iterator/operator[] surface of
+* BinarySearchTree, built for memory footprint rather than for the stable
+* node addresses the pointer based trees have.
+*
+* Nodes live in one pool vector and refer to each other by 32-bit index.
+* There is no parent link, and the balance factor sits in the top two bits
+* of the left link, so a node is its key and value plus 8 bytes: 16 bytes
+* for int/int, against 40 for an AVLNode. Updates keep the path from the
+* root on a small stack instead, and so do iterators, which only build it
+* on their first step.
+*
+* Keys and values are stored as separate members, so Key and Value must be
+* default constructible and assignable, and iterators hand out a pair of
+* references instead of a reference to a pair. Inserting or removing may
+* move nodes within the pool, so it invalidates every iterator.
+*/
+template <typename Key, typename Value>
+class CompactAVLTree
+{
+public:
+    CompactAVLTree();
+    CompactAVLTree(CompactAVLTree&& other);
+    CompactAVLTree& operator=(CompactAVLTree&& other);
+
+    /**
+    * Forward iterators over the items in key order. As with
+    * BinarySearchTree, the const flavour only hands out const values and
+    * can be made from a plain one.
+    */
+    template<bool IsConst>
+    class basic_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key&, typename std::conditional<IsConst, const Value&, Value&>::type> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type reference;
+
+        // keys and values are separate members, so -> hands out a pair of references
+        class pointer
+        {
+        public:
+            const value_type* operator->() const;
+
+        private:
+            friend class basic_iterator;
+            explicit pointer(const value_type& item);
+            value_type item_;
+        };
+
+        basic_iterator();
+        basic_iterator(const basic_iterator<false>& other);
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        template<bool RhsConst>
+        bool operator==(const basic_iterator<RhsConst>& rhs) const;
+        template<bool RhsConst>
+        bool operator!=(const basic_iterator<RhsConst>& rhs) const;
+
+        basic_iterator& operator++();
+        basic_iterator operator++(int);
+
+    protected:
+        friend class CompactAVLTree<Key, Value>;
+        template<bool> friend class basic_iterator;
+        basic_iterator(std::uint32_t node, const CompactAVLTree* tree);
+
+        // 0 past the end
+        std::uint32_t node_;
+        const CompactAVLTree* tree_;
+        // the ancestors still ahead of node_, nearest last; only valid
+        // once pathBuilt_ is set, which lookups leave to the first ++
+        std::vector<std::uint32_t> path_;
+        bool pathBuilt_;
+    };
+
+    typedef basic_iterator<false> iterator;
+    typedef basic_iterator<true> const_iterator;
+
+    // Inserting an existing key replaces its value.
+    void insert(const std::pair<const Key, Value>& keyValuePair);
+    void remove(const Key& key);
+    void clear();
+    bool empty() const;
+    std::size_t size() const;
+
+    // Makes room for n items in the pool, so loading them reallocates nothing.
+    void reserve(std::size_t n);
+    // Bytes held by the pool, the tree's whole footprint besides the object.
+    std::size_t memory_usage() const;
+
+    iterator begin();
+    const_iterator begin() const;
+    iterator end();
+    const_iterator end() const;
+    iterator find(const Key& key);
+    const_iterator find(const Key& key) const;
+    iterator lower_bound(const Key& key);
+    const_iterator lower_bound(const Key& key) const;
+    iterator upper_bound(const Key& key);
+    const_iterator upper_bound(const Key& key) const;
+    Value& operator[](const Key& key);
+    Value const & operator[](const Key& key) const;
+
+    // Links take 30 bits, leaving room for about a billion items.
+    static const std::size_t MAX_ITEMS = (std::size_t(1) << 30) - 2;
+
+protected:
+    struct Node
+    {
+        Node(const Key& key, const Value& value);
+
+        std::uint32_t getLeft() const;
+        std::uint32_t getRight() const;
+        int getBalance() const;
+        void setLeft(std::uint32_t left);
+        void setRight(std::uint32_t right);
+        void setBalance(int balance);
+
+        Key key;
+        Value value;
+        // the left child's index, with the balance factor + 1 in the top
+        // two bits; 0 is no child
+        std::uint32_t left;
+        std::uint32_t right;
+    };
+
+    static const std::uint32_t INDEX_MASK = (std::uint32_t(1) << 30) - 1;
+    // an AVL tree of MAX_ITEMS items is less than 44 levels tall
+    static const int MAX_DEPTH = 48;
+
+    // The nodes on the way down from the root and the side taken at each.
+    struct Path
+    {
+        Path();
+
+        std::uint32_t nodes[MAX_DEPTH];
+        bool wentLeft[MAX_DEPTH];
+        int depth;
+    };
+
+    Node& node(std::uint32_t index);
+    const Node& node(std::uint32_t index) const;
+    std::uint32_t allocateNode(const Key& key, const Value& value);
+    void freeNode(std::uint32_t index);
+
+    template<bool OrEqual>
+    std::uint32_t bound(const Key& key) const;
+    std::uint32_t findNode(const Key& key) const;
+    void relink(const Path& path, int level, std::uint32_t subtree);
+
+    std::uint32_t rotateLeft(std::uint32_t n);
+    std::uint32_t rotateRight(std::uint32_t n);
+    std::uint32_t rotateFix(std::uint32_t n, int balance, bool& shorter);
+
+    // slot 0 is a placeholder, so that index 0 can mean no node
+    std::vector<Node> nodes_;
+    // freed slots, chained through their right links
+    std::uint32_t freeList_;
+    std::uint32_t root_;
+    std::size_t size_;
+};
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the CompactAVLTree iterator.
+  -----------------------------------------------------
+*/
+
+template<class Key, class Value>
+template<bool IsConst>
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::pointer::pointer(const value_type& item) : item_(item)
+{
+
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+const typename CompactAVLTree<Key, Value>::template basic_iterator<IsConst>::value_type*
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::pointer::operator->() const
+{
+    return &item_;
+}
+
+/**
+* Constructs a past the end iterator belonging to no tree.
+*/
+template<class Key, class Value>
+template<bool IsConst>
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::basic_iterator() : node_(0), tree_(nullptr), pathBuilt_(false)
+{
+
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::basic_iterator(const basic_iterator<false>& other) :
+    node_(other.node_),
+    tree_(other.tree_),
+    path_(other.path_),
+    pathBuilt_(other.pathBuilt_)
+{
+
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::basic_iterator(std::uint32_t node, const CompactAVLTree* tree) :
+    node_(node),
+    tree_(tree),
+    pathBuilt_(false)
+{
+
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+typename CompactAVLTree<Key, Value>::template basic_iterator<IsConst>::reference
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::operator*() const
+{
+    // the pool is only const through the iterator when IsConst is
+    Node& current = const_cast<CompactAVLTree*>(tree_)->node(node_);
+    return reference(current.key, current.value);
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+typename CompactAVLTree<Key, Value>::template basic_iterator<IsConst>::pointer
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+template<bool RhsConst>
+bool CompactAVLTree<Key, Value>::basic_iterator<IsConst>::operator==(const basic_iterator<RhsConst>& rhs) const
+{
+    return node_ == rhs.node_;
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+template<bool RhsConst>
+bool CompactAVLTree<Key, Value>::basic_iterator<IsConst>::operator!=(const basic_iterator<RhsConst>& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Moves to the next node in order: the leftmost of the right subtree if
+* there is one, else the nearest ancestor still ahead. An iterator that
+* came from a lookup first finds those ancestors again from the root.
+* O(1) amortized, O(log n) worst case.
+*/
+template<class Key, class Value>
+template<bool IsConst>
+typename CompactAVLTree<Key, Value>::template basic_iterator<IsConst>&
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::operator++()
+{
+    const CompactAVLTree& tree = *tree_;
+    if (!pathBuilt_) {
+        const Key& key = tree.node(node_).key;
+        path_.clear();
+        std::uint32_t current = tree.root_;
+        while (current != node_) {
+            if (key < tree.node(current).key) {
+                path_.push_back(current);
+                current = tree.node(current).getLeft();
+            }else {
+                current = tree.node(current).getRight();
+            }
+        }
+        pathBuilt_ = true;
+    }
+
+    std::uint32_t next = tree.node(node_).getRight();
+    if (next != 0) {
+        for (std::uint32_t left = tree.node(next).getLeft(); left != 0; left = tree.node(next).getLeft()) {
+            path_.push_back(next);
+            next = left;
+        }
+    }else if (!path_.empty()) {
+        next = path_.back();
+        path_.pop_back();
+    }
+    node_ = next;
+    return *this;
+}
+
+template<class Key, class Value>
+template<bool IsConst>
+typename CompactAVLTree<Key, Value>::template basic_iterator<IsConst>
+CompactAVLTree<Key, Value>::basic_iterator<IsConst>::operator++(int)
+{
+    basic_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/*
+  ---------------------------------------------------
+  End implementations for the CompactAVLTree iterator.
+  ---------------------------------------------------
+*/
+
+/*
+  --------------------------------------------------
+  Begin implementations for the CompactAVLTree class.
+  --------------------------------------------------
+*/
+
+template<class Key, class Value>
+CompactAVLTree<Key, Value>::Node::Node(const Key& key, const Value& value) : key(key), value(value), left(1u << 30), right(0)
+{
+
+}
+
+template<class Key, class Value>
+std::uint32_t CompactAVLTree<Key, Value>::Node::getLeft() const
+{
+    return left & INDEX_MASK;
+}
+
+template<class Key, class Value>
+std::uint32_t CompactAVLTree<Key, Value>::Node::getRight() const
+{
+    return right;
+}
+
+template<class Key, class Value>
+int CompactAVLTree<Key, Value>::Node::getBalance() const
+{
+    return static_cast<int>(left >> 30) - 1;
+}
+
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::Node::setLeft(std::uint32_t index)
+{
+    left = (left & ~INDEX_MASK) | index;
+}
+
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::Node::setRight(std::uint32_t index)
+{
+    right = index;
+}
+
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::Node::setBalance(int balance)
+{
+    left = (left & INDEX_MASK) | (static_cast<std::uint32_t>(balance + 1) << 30);
+}
+
+template<class Key, class Value>
+CompactAVLTree<Key, Value>::Path::Path() : depth(0)
+{
+
+}
+
+template<class Key, class Value>
+CompactAVLTree<Key, Value>::CompactAVLTree() : nodes_(1, Node(Key(), Value())), freeList_(0), root_(0), size_(0)
+{
+
+}
+
+template<class Key, class Value>
+CompactAVLTree<Key, Value>::CompactAVLTree(CompactAVLTree&& other) :
+    nodes_(std::move(other.nodes_)),
+    freeList_(other.freeList_),
+    root_(other.root_),
+    size_(other.size_)
+{
+    other.nodes_.assign(1, Node(Key(), Value()));
+    other.freeList_ = 0;
+    other.root_ = 0;
+    other.size_ = 0;
+}
+
+template<class Key, class Value>
+CompactAVLTree<Key, Value>& CompactAVLTree<Key, Value>::operator=(CompactAVLTree&& other)
+{
+    if (this != &other) {
+        clear();
+        std::swap(nodes_, other.nodes_);
+        std::swap(freeList_, other.freeList_);
+        std::swap(root_, other.root_);
+        std::swap(size_, other.size_);
+    }
+    return *this;
+}
+
+/**
+* Descends once from the root, remembering the path, and either overwrites
+* the value or links in a new leaf and retraces up the path. Retracing
+* stops at the first node whose height did not change, after at most one
+* (single or double) rotation.
+*/
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& keyValuePair)
+{
+    const Key& key = keyValuePair.first;
+    Path path;
+    std::uint32_t current = root_;
+    while (current != 0) {
+        Node& n = node(current);
+        bool goLeft = key < n.key;
+        if (!goLeft && !(n.key < key)) {
+            n.value = keyValuePair.second;
+            return;
+        }
+        path.nodes[path.depth] = current;
+        path.wentLeft[path.depth] = goLeft;
+        ++path.depth;
+        current = goLeft ? n.getLeft() : n.getRight();
+    }
+
+    std::uint32_t added = allocateNode(key, keyValuePair.second);
+    relink(path, path.depth, added);
+    ++size_;
+
+    for (int level = path.depth - 1; level >= 0; --level) {
+        Node& n = node(path.nodes[level]);
+        int balance = n.getBalance() + (path.wentLeft[level] ? -1 : 1);
+        if (balance == 0) {
+            //n was leaning away from the new node, its height is unchanged
+            n.setBalance(0);
+            return;
+        }
+        if (balance == 1 || balance == -1) {
+            //n was even, so it got taller
+            n.setBalance(balance);
+            continue;
+        }
+        //the rotation restores n's height from before the insertion
+        bool shorter;
+        relink(path, level, rotateFix(path.nodes[level], balance, shorter));
+        return;
+    }
+}
+
+/**
+* Descends once from the root, remembering the path. A node with two
+* children takes its predecessor's item, and the predecessor, which has
+* at most one child, is unlinked instead. Retracing up the path stops at
+* the first node whose height did not change. Does nothing if the key is
+* not present.
+*/
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::remove(const Key& key)
+{
+    Path path;
+    std::uint32_t current = root_;
+    while (current != 0) {
+        Node& n = node(current);
+        bool goLeft = key < n.key;
+        if (!goLeft && !(n.key < key)) {
+            break;
+        }
+        path.nodes[path.depth] = current;
+        path.wentLeft[path.depth] = goLeft;
+        ++path.depth;
+        current = goLeft ? n.getLeft() : n.getRight();
+    }
+    if (current == 0) {
+        return;
+    }
+
+    if (node(current).getLeft() != 0 && node(current).getRight() != 0) {
+        std::uint32_t target = current;
+        path.nodes[path.depth] = current;
+        path.wentLeft[path.depth] = true;
+        ++path.depth;
+        current = node(current).getLeft();
+        while (node(current).getRight() != 0) {
+            path.nodes[path.depth] = current;
+            path.wentLeft[path.depth] = false;
+            ++path.depth;
+            current = node(current).getRight();
+        }
+        node(target).key = std::move(node(current).key);
+        node(target).value = std::move(node(current).value);
+    }
+
+    std::uint32_t child = node(current).getLeft() != 0 ? node(current).getLeft() : node(current).getRight();
+    relink(path, path.depth, child);
+    freeNode(current);
+    --size_;
+
+    for (int level = path.depth - 1; level >= 0; --level) {
+        Node& n = node(path.nodes[level]);
+        //losing height on the left makes n lean right, and vice versa
+        int balance = n.getBalance() + (path.wentLeft[level] ? 1 : -1);
+        if (balance == 1 || balance == -1) {
+            //n went from even to leaning, its height is unchanged
+            n.setBalance(balance);
+            return;
+        }
+        if (balance == 0) {
+            //n got shorter
+            n.setBalance(0);
+            continue;
+        }
+        bool shorter;
+        relink(path, level, rotateFix(path.nodes[level], balance, shorter));
+        if (!shorter) {
+            return;
+        }
+    }
+}
+
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::clear()
+{
+    nodes_.assign(1, Node(Key(), Value()));
+    nodes_.shrink_to_fit();
+    freeList_ = 0;
+    root_ = 0;
+    size_ = 0;
+}
+
+template<class Key, class Value>
+bool CompactAVLTree<Key, Value>::empty() const
+{
+    return root_ == 0;
+}
+
+template<class Key, class Value>
+std::size_t CompactAVLTree<Key, Value>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::reserve(std::size_t n)
+{
+    if (n > MAX_ITEMS) {
+        throw std::length_error("CompactAVLTree: too many items");
+    }
+    nodes_.reserve(n + 1);
+}
+
+template<class Key, class Value>
+std::size_t CompactAVLTree<Key, Value>::memory_usage() const
+{
+    return nodes_.capacity() * sizeof(Node);
+}
+
+/**
+* Returns an iterator to the smallest item, which starts out with the
+* ancestors still ahead of it already on its path.
+*/
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::iterator
+CompactAVLTree<Key, Value>::begin()
+{
+    iterator it(0, this);
+    it.pathBuilt_ = true;
+    for (std::uint32_t current = root_; current != 0; current = node(current).getLeft()) {
+        if (it.node_ != 0) {
+            it.path_.push_back(it.node_);
+        }
+        it.node_ = current;
+    }
+    return it;
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::const_iterator
+CompactAVLTree<Key, Value>::begin() const
+{
+    return const_cast<CompactAVLTree*>(this)->begin();
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::iterator
+CompactAVLTree<Key, Value>::end()
+{
+    return iterator(0, this);
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::const_iterator
+CompactAVLTree<Key, Value>::end() const
+{
+    return const_iterator(0, this);
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::iterator
+CompactAVLTree<Key, Value>::find(const Key& key)
+{
+    return iterator(findNode(key), this);
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::const_iterator
+CompactAVLTree<Key, Value>::find(const Key& key) const
+{
+    return const_iterator(findNode(key), this);
+}
+
+/**
+* Returns an iterator to the first item whose key is not less than key,
+* or the end iterator if there is none
+*/
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::iterator
+CompactAVLTree<Key, Value>::lower_bound(const Key& key)
+{
+    return iterator(bound<false>(key), this);
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::const_iterator
+CompactAVLTree<Key, Value>::lower_bound(const Key& key) const
+{
+    return const_iterator(bound<false>(key), this);
+}
+
+/**
+* Returns an iterator to the first item whose key is greater than key,
+* or the end iterator if there is none
+*/
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::iterator
+CompactAVLTree<Key, Value>::upper_bound(const Key& key)
+{
+    return iterator(bound<true>(key), this);
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::const_iterator
+CompactAVLTree<Key, Value>::upper_bound(const Key& key) const
+{
+    return const_iterator(bound<true>(key), this);
+}
+
+template<class Key, class Value>
+Value& CompactAVLTree<Key, Value>::operator[](const Key& key)
+{
+    std::uint32_t found = findNode(key);
+    if (found == 0) {
+        throw std::out_of_range("Invalid key");
+    }
+    return node(found).value;
+}
+
+template<class Key, class Value>
+Value const & CompactAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    std::uint32_t found = findNode(key);
+    if (found == 0) {
+        throw std::out_of_range("Invalid key");
+    }
+    return node(found).value;
+}
+
+template<class Key, class Value>
+typename CompactAVLTree<Key, Value>::Node& CompactAVLTree<Key, Value>::node(std::uint32_t index)
+{
+    return nodes_[index];
+}
+
+template<class Key, class Value>
+const typename CompactAVLTree<Key, Value>::Node& CompactAVLTree<Key, Value>::node(std::uint32_t index) const
+{
+    return nodes_[index];
+}
+
+/**
+* Hands out a free slot if there is one, else grows the pool by one.
+*/
+template<class Key, class Value>
+std::uint32_t CompactAVLTree<Key, Value>::allocateNode(const Key& key, const Value& value)
+{
+    if (freeList_ != 0) {
+        std::uint32_t index = freeList_;
+        freeList_ = nodes_[index].getRight();
+        nodes_[index] = Node(key, value);
+        return index;
+    }
+    if (nodes_.size() > MAX_ITEMS) {
+        throw std::length_error("CompactAVLTree: too many items");
+    }
+    nodes_.push_back(Node(key, value));
+    return static_cast<std::uint32_t>(nodes_.size() - 1);
+}
+
+/**
+* Puts a slot on the free list, dropping whatever its key and value held.
+*/
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::freeNode(std::uint32_t index)
+{
+    nodes_[index] = Node(Key(), Value());
+    nodes_[index].setRight(freeList_);
+    freeList_ = index;
+}
+
+/**
+* The first node whose key is not less than key (or greater than it, if
+* OrEqual), 0 if there is none.
+*/
+template<class Key, class Value>
+template<bool OrEqual>
+std::uint32_t CompactAVLTree<Key, Value>::bound(const Key& key) const
+{
+    std::uint32_t current = root_;
+    std::uint32_t result = 0;
+    while (current != 0) {
+        const Node& n = node(current);
+        bool goRight = OrEqual ? !(key < n.key) : n.key < key;
+        if (goRight) {
+            current = n.getRight();
+        }else {
+            result = current;
+            current = n.getLeft();
+        }
+    }
+    return result;
+}
+
+template<class Key, class Value>
+std::uint32_t CompactAVLTree<Key, Value>::findNode(const Key& key) const
+{
+    std::uint32_t found = bound<false>(key);
+    if (found == 0 || key < node(found).key) {
+        return 0;
+    }
+    return found;
+}
+
+/**
+* Hangs subtree where path.nodes[level] was: under the node above it on
+* the path, or as the root.
+*/
+template<class Key, class Value>
+void CompactAVLTree<Key, Value>::relink(const Path& path, int level, std::uint32_t subtree)
+{
+    if (level == 0) {
+        root_ = subtree;
+    }else if (path.wentLeft[level - 1]) {
+        node(path.nodes[level - 1]).setLeft(subtree);
+    }else {
+        node(path.nodes[level - 1]).setRight(subtree);
+    }
+}
+
+/**
+* Rotates n's right child up into n's place and returns it. Only relinks;
+* callers are responsible for the balance factors.
+*/
+template<class Key, class Value>
+std::uint32_t CompactAVLTree<Key, Value>::rotateLeft(std::uint32_t n)
+{
+    std::uint32_t up = node(n).getRight();
+    node(n).setRight(node(up).getLeft());
+    node(up).setLeft(n);
+    return up;
+}
+
+/**
+* Rotates n's left child up into n's place and returns it. Only relinks;
+* callers are responsible for the balance factors.
+*/
+template<class Key, class Value>
+std::uint32_t CompactAVLTree<Key, Value>::rotateRight(std::uint32_t n)
+{
+    std::uint32_t up = node(n).getLeft();
+    node(n).setLeft(node(up).getRight());
+    node(up).setRight(n);
+    return up;
+}
+
+/**
+* Rebalances n, whose balance factor has reached balance (2 or -2), with
+* a single or double rotation, and returns the subtree's new root. shorter
+* is set unless the taller child was even, which only happens on removal
+* and leaves the subtree as tall as before.
+*/
+template<class Key, class Value>
+std::uint32_t CompactAVLTree<Key, Value>::rotateFix(std::uint32_t n, int balance, bool& shorter)
+{
+    const int side = balance < 0 ? -1 : 1;
+    std::uint32_t c = side < 0 ? node(n).getLeft() : node(n).getRight();
+    int cbal = node(c).getBalance();
+
+    if (cbal != -side) {
+        std::uint32_t up = side < 0 ? rotateRight(n) : rotateLeft(n);
+        shorter = cbal != 0;
+        node(n).setBalance(shorter ? 0 : side);
+        node(c).setBalance(shorter ? 0 : -side);
+        return up;
+    }
+
+    //c leans back towards n: its inner child g comes up over both
+    std::uint32_t g = side < 0 ? node(c).getRight() : node(c).getLeft();
+    int gbal = node(g).getBalance();
+    if (side < 0) {
+        node(n).setLeft(rotateLeft(c));
+        rotateRight(n);
+    }else {
+        node(n).setRight(rotateRight(c));
+        rotateLeft(n);
+    }
+    node(n).setBalance(gbal == side ? -side : 0);
+    node(c).setBalance(gbal == -side ? side : 0);
+    node(g).setBalance(0);
+    shorter = true;
+    return g;
+}
+
+/*
+  ------------------------------------------------
+  End implementations for the CompactAVLTree class.
+  ------------------------------------------------
+*/
+
+#endif
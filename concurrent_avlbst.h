@@ -0,0 +1,1315 @@
+#ifndef CONCURRENT_AVLBST_H
+#define CONCURRENT_AVLBST_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include "epoch.h"
+
+template <typename Key, typename Value>
+class ConcurrentAVLTree;
+
+/**
+* A node of a ConcurrentAVLTree. Every field that is read without holding
+* the node's lock is atomic. A null value marks a routing node, one whose
+* item was removed while it had two children, so it stays in place to
+* guide searches until it can be unlinked.
+*/
+template <typename Key, typename Value>
+class ConcurrentAVLNode
+{
+public:
+    ConcurrentAVLNode();
+    ConcurrentAVLNode(const Key& key, Value* value, ConcurrentAVLNode* parent);
+    ~ConcurrentAVLNode();
+
+    ConcurrentAVLNode(const ConcurrentAVLNode&) = delete;
+    ConcurrentAVLNode& operator=(const ConcurrentAVLNode&) = delete;
+
+    const Key& getKey() const;
+    // dir < 0 is the left child, anything else the right one
+    ConcurrentAVLNode* getChild(int dir) const;
+    void setChild(int dir, ConcurrentAVLNode* child);
+
+protected:
+    friend class ConcurrentAVLTree<Key, Value>;
+
+    // the root holder has no key, so the key is constructed in place
+    typename std::aligned_storage<sizeof(Key), alignof(Key)>::type key_;
+    bool hasKey_;
+    std::atomic<Value*> value_;
+    std::atomic<int> height_;
+    // see ConcurrentAVLTree for the encoding
+    std::atomic<std::uint64_t> version_;
+    std::atomic<ConcurrentAVLNode*> parent_;
+    std::atomic<ConcurrentAVLNode*> left_;
+    std::atomic<ConcurrentAVLNode*> right_;
+    std::mutex lock_;
+};
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the ConcurrentAVLNode class.
+  -----------------------------------------------------
+*/
+
+/**
+* Constructs the root holder, which sits above the root and holds no item.
+*/
+template<typename Key, typename Value>
+ConcurrentAVLNode<Key, Value>::ConcurrentAVLNode() :
+    hasKey_(false),
+    value_(nullptr),
+    height_(0),
+    version_(0),
+    parent_(nullptr),
+    left_(nullptr),
+    right_(nullptr)
+{
+
+}
+
+/**
+* Constructs a leaf owning value.
+*/
+template<typename Key, typename Value>
+ConcurrentAVLNode<Key, Value>::ConcurrentAVLNode(const Key& key, Value* value, ConcurrentAVLNode* parent) :
+    hasKey_(true),
+    value_(value),
+    height_(1),
+    version_(0),
+    parent_(parent),
+    left_(nullptr),
+    right_(nullptr)
+{
+    new (&key_) Key(key);
+}
+
+/**
+* Destroys the key and the value, if the node still holds one.
+*/
+template<typename Key, typename Value>
+ConcurrentAVLNode<Key, Value>::~ConcurrentAVLNode()
+{
+    if (hasKey_) {
+        getKey().~Key();
+    }
+    delete value_.load();
+}
+
+template<typename Key, typename Value>
+const Key& ConcurrentAVLNode<Key, Value>::getKey() const
+{
+    return *reinterpret_cast<const Key*>(&key_);
+}
+
+template<typename Key, typename Value>
+ConcurrentAVLNode<Key, Value>* ConcurrentAVLNode<Key, Value>::getChild(int dir) const
+{
+    return dir < 0 ? left_.load() : right_.load();
+}
+
+template<typename Key, typename Value>
+void ConcurrentAVLNode<Key, Value>::setChild(int dir, ConcurrentAVLNode* child)
+{
+    if (dir < 0) {
+        left_.store(child);
+    }else {
+        right_.store(child);
+    }
+}
+
+/*
+  ---------------------------------------------------
+  End implementations for the ConcurrentAVLNode class.
+  ---------------------------------------------------
+*/
+
+/**
+* An AVL tree that may be used from many threads at once, after Bronson,
+* Casper, Chafi and Olukotun's optimistic concurrent AVL tree.
+*
+* Readers take no locks. They descend hand over hand, checking after each
+* step that the node they came from has not been rotated down (its version
+* is unchanged), and back up a level to retry if it has. Writers lock only
+* the nodes they modify: an insertion its parent, an update its node, and
+* a rotation the nodes it relinks, always top-down so they cannot deadlock.
+* Balance is relaxed while other threads are still fixing heights above
+* them, and restored once every writer has finished.
+*
+* Values are copied out rather than handed out by reference, and replaced
+* rather than assigned in place, so a reader never sees one half-written.
+* Unlinked nodes and replaced values are freed through epoch reclamation.
+*
+* Iteration is weakly consistent: each step looks up the next key, so it
+* sees every item present throughout and none removed before it started.
+*/
+template <typename Key, typename Value>
+class ConcurrentAVLTree
+{
+public:
+    ConcurrentAVLTree();
+    ~ConcurrentAVLTree();
+
+    ConcurrentAVLTree(const ConcurrentAVLTree&) = delete;
+    ConcurrentAVLTree& operator=(const ConcurrentAVLTree&) = delete;
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    private:
+        friend class ConcurrentAVLTree<Key, Value>;
+        explicit const_iterator(const ConcurrentAVLTree* tree);
+
+        // a copy of the current item, null once past the end
+        const ConcurrentAVLTree* tree_;
+        value_type current_;
+    };
+
+    // Inserting an existing key replaces its value. The bools are true iff
+    // the key was new, or was present, respectively.
+    bool insert(const std::pair<const Key, Value>& new_item);
+    bool remove(const Key& key);
+
+    // Lookups copy the value out; operator[] throws std::out_of_range for a missing key.
+    bool find(const Key& key, Value& value) const;
+    bool contains(const Key& key) const;
+    Value operator[](const Key& key) const;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    bool empty() const;
+    // O(n log n), counts by iterating
+    std::size_t size() const;
+
+protected:
+    typedef ConcurrentAVLNode<Key, Value> Node;
+
+    // Node versions. A rotation that moves a node down shrinks the range of
+    // keys below it, and marks it SHRINKING while relinking, then bumps the
+    // count, so a reader that finds the version of the node it descended
+    // from changed knows its target may have moved. An unlinked node's
+    // version becomes UNLINKED for good.
+    static const std::uint64_t UNLINKED = 1;
+    static const std::uint64_t SHRINKING = 2;
+    static const std::uint64_t SHRINK_COUNT_UNIT = 4;
+    // spins on a shrinking node before waiting on its lock
+    static const int SPINS_BEFORE_LOCK = 100;
+
+    // What an optimistic attempt came to; RETRY sends the caller back up a level.
+    enum Outcome { RETRY, NOT_FOUND, FOUND };
+
+    // Results of nodeCondition besides a height to set
+    static const int UNLINK_REQUIRED = -1;
+    static const int REBALANCE_REQUIRED = -2;
+    static const int NOTHING_REQUIRED = -3;
+
+    static int compare(const Key& a, const Key& b);
+    static int height(Node* node);
+    static bool isShrinking(std::uint64_t version);
+    static void waitUntilShrunk(Node* node, std::uint64_t version);
+
+    Outcome attemptGet(const Key& key, Node* node, int dir, std::uint64_t nodeVersion, Value* value) const;
+    Outcome attemptHigher(const Key* bound, Node* node, int dir, std::uint64_t nodeVersion, std::pair<Key, Value>& item) const;
+    bool higher(const Key* bound, std::pair<Key, Value>& item) const;
+
+    Outcome attemptPut(const Key& key, const Value& value, Node* node, int dir, std::uint64_t nodeVersion);
+    Outcome attemptInsert(const Key& key, const Value& value, Node* node, int dir, std::uint64_t nodeVersion);
+    Outcome attemptUpdate(Node* node, const Value& value);
+    Outcome attemptRemove(const Key& key, Node* node, int dir, std::uint64_t nodeVersion);
+    Outcome attemptRemoveNode(Node* parent, Node* node);
+    static bool canUnlink(Node* node);
+
+    // Rebalancing. The _nl functions expect the caller to hold the locks of
+    // the nodes passed in, and return the next node needing attention.
+    void fixHeightAndRebalance(Node* node);
+    static int nodeCondition(Node* node);
+    Node* fixHeight_nl(Node* node);
+    Node* rebalance_nl(Node* parent, Node* node);
+    Node* rebalanceToRight_nl(Node* parent, Node* node, Node* left, int rightHeight);
+    Node* rebalanceToLeft_nl(Node* parent, Node* node, Node* right, int leftHeight);
+    Node* rotateRight(Node* parent, Node* node, Node* left, int rightHeight, int leftLeftHeight, Node* leftRight, int leftRightHeight);
+    Node* rotateLeft(Node* parent, Node* node, int leftHeight, Node* right, Node* rightLeft, int rightLeftHeight, int rightRightHeight);
+    Node* rotateRightOverLeft(Node* parent, Node* node, Node* left, int rightHeight, int leftLeftHeight, Node* leftRight, int leftRightLeftHeight);
+    Node* rotateLeftOverRight(Node* parent, Node* node, int leftHeight, Node* right, Node* rightLeft, int rightRightHeight, int rightLeftRightHeight);
+    Node* finishRotation_nl(Node* parent, Node* top, int oldHeight, Node* next);
+    bool attemptUnlink_nl(Node* parent, Node* node);
+
+    static void destroySubtree(Node* node);
+
+protected:
+    // the root is the holder's right child
+    Node rootHolder_;
+    mutable EpochRetireList retired_;
+};
+
+/*
+  ---------------------------------------------------------
+  Begin implementations for the ConcurrentAVLTree iterator.
+  ---------------------------------------------------------
+*/
+
+/**
+* Constructs the end iterator.
+*/
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::const_iterator::const_iterator() : tree_(nullptr), current_()
+{
+
+}
+
+/**
+* Constructs an iterator at the tree's first item, or the end.
+*/
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::const_iterator::const_iterator(const ConcurrentAVLTree* tree) : tree_(tree), current_()
+{
+    if (!tree_->higher(nullptr, current_)) {
+        tree_ = nullptr;
+    }
+}
+
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::const_iterator::reference
+ConcurrentAVLTree<Key, Value>::const_iterator::operator*() const
+{
+    return current_;
+}
+
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::const_iterator::pointer
+ConcurrentAVLTree<Key, Value>::const_iterator::operator->() const
+{
+    return &current_;
+}
+
+/**
+* Iterators are equal when both are past the end, or both are at equal keys.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    if (tree_ == nullptr || rhs.tree_ == nullptr) {
+        return tree_ == rhs.tree_;
+    }
+    return tree_ == rhs.tree_ && compare(current_.first, rhs.current_.first) == 0;
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Moves on to the item with the next larger key present now, O(log n).
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::const_iterator&
+ConcurrentAVLTree<Key, Value>::const_iterator::operator++()
+{
+    Key bound(current_.first);
+    if (!tree_->higher(&bound, current_)) {
+        tree_ = nullptr;
+    }
+    return *this;
+}
+
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::const_iterator
+ConcurrentAVLTree<Key, Value>::const_iterator::operator++(int)
+{
+    const_iterator before(*this);
+    ++(*this);
+    return before;
+}
+
+/*
+  -------------------------------------------------------
+  End implementations for the ConcurrentAVLTree iterator.
+  -------------------------------------------------------
+*/
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the ConcurrentAVLTree class.
+  -----------------------------------------------------
+*/
+
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::ConcurrentAVLTree()
+{
+
+}
+
+/**
+* No other thread may be using the tree by now.
+*/
+template<class Key, class Value>
+ConcurrentAVLTree<Key, Value>::~ConcurrentAVLTree()
+{
+    destroySubtree(rootHolder_.right_.load());
+}
+
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::destroySubtree(Node* node)
+{
+    if (node == nullptr) {
+        return;
+    }
+    destroySubtree(node->left_.load());
+    destroySubtree(node->right_.load());
+    delete node;
+}
+
+template<class Key, class Value>
+int ConcurrentAVLTree<Key, Value>::compare(const Key& a, const Key& b)
+{
+    if (a < b) {
+        return -1;
+    }
+    return (b < a) ? 1 : 0;
+}
+
+template<class Key, class Value>
+int ConcurrentAVLTree<Key, Value>::height(Node* node)
+{
+    return node == nullptr ? 0 : node->height_.load();
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::isShrinking(std::uint64_t version)
+{
+    return (version & SHRINKING) != 0;
+}
+
+/**
+* Waits out a rotation of node. Rotations are short, so this spins for a
+* while, then waits on the node's lock, which the rotation holds.
+*/
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::waitUntilShrunk(Node* node, std::uint64_t version)
+{
+    for (int i = 0; i < SPINS_BEFORE_LOCK; ++i) {
+        if (node->version_.load() != version) {
+            return;
+        }
+    }
+    std::lock_guard<std::mutex> wait(node->lock_);
+}
+
+/**
+* Copies the value stored at key into value, if there is one.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::find(const Key& key, Value& value) const
+{
+    EpochGuard guard;
+    Node* holder = const_cast<Node*>(&rootHolder_);
+    while (true) {
+        Outcome outcome = attemptGet(key, holder, 1, 0, &value);
+        if (outcome != RETRY) {
+            return outcome == FOUND;
+        }
+    }
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::contains(const Key& key) const
+{
+    EpochGuard guard;
+    Node* holder = const_cast<Node*>(&rootHolder_);
+    while (true) {
+        Outcome outcome = attemptGet(key, holder, 1, 0, nullptr);
+        if (outcome != RETRY) {
+            return outcome == FOUND;
+        }
+    }
+}
+
+template<class Key, class Value>
+Value ConcurrentAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    Value value;
+    if (!find(key, value)) {
+        throw std::out_of_range("Invalid key");
+    }
+    return value;
+}
+
+/**
+* Looks for key below node's dir child, where node had nodeVersion when
+* the caller stepped onto it. Copies the value out if value is not null.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Outcome
+ConcurrentAVLTree<Key, Value>::attemptGet(const Key& key, Node* node, int dir, std::uint64_t nodeVersion, Value* value) const
+{
+    while (true) {
+        Node* child = node->getChild(dir);
+        if (child == nullptr) {
+            //only a miss if node did not shrink meanwhile
+            return (node->version_.load() != nodeVersion) ? RETRY : NOT_FOUND;
+        }
+
+        int childDir = compare(key, child->getKey());
+        if (childDir == 0) {
+            Value* found = child->value_.load();
+            if (found == nullptr) {
+                return NOT_FOUND;
+            }
+            if (value != nullptr) {
+                *value = *found;
+            }
+            return FOUND;
+        }
+
+        std::uint64_t childVersion = child->version_.load();
+        if (isShrinking(childVersion)) {
+            waitUntilShrunk(child, childVersion);
+        }else if (childVersion != UNLINKED && child == node->getChild(dir)) {
+            //child was still node's child after its version was read
+            if (node->version_.load() != nodeVersion) {
+                return RETRY;
+            }
+            Outcome outcome = attemptGet(key, child, childDir, childVersion, value);
+            if (outcome != RETRY) {
+                return outcome;
+            }
+        }
+    }
+}
+
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::const_iterator
+ConcurrentAVLTree<Key, Value>::begin() const
+{
+    return const_iterator(this);
+}
+
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::const_iterator
+ConcurrentAVLTree<Key, Value>::end() const
+{
+    return const_iterator();
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::empty() const
+{
+    return begin() == end();
+}
+
+template<class Key, class Value>
+std::size_t ConcurrentAVLTree<Key, Value>::size() const
+{
+    std::size_t count = 0;
+    for (const_iterator it = begin(); it != end(); ++it) {
+        ++count;
+    }
+    return count;
+}
+
+/**
+* Copies out the item with the smallest key greater than *bound, or the
+* smallest of all with a null bound. Returns false if there is none.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::higher(const Key* bound, std::pair<Key, Value>& item) const
+{
+    EpochGuard guard;
+    Node* holder = const_cast<Node*>(&rootHolder_);
+    while (true) {
+        Outcome outcome = attemptHigher(bound, holder, 1, 0, item);
+        if (outcome != RETRY) {
+            return outcome == FOUND;
+        }
+    }
+}
+
+/**
+* attemptGet for the smallest key above bound: the left subtree of a child
+* above bound is searched first, then the child itself, then its right
+* subtree. Every candidate is compared against bound, even below a node
+* above it, as a subtree that grew meanwhile may hold smaller keys.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Outcome
+ConcurrentAVLTree<Key, Value>::attemptHigher(const Key* bound, Node* node, int dir, std::uint64_t nodeVersion, std::pair<Key, Value>& item) const
+{
+    while (true) {
+        Node* child = node->getChild(dir);
+        if (node->version_.load() != nodeVersion) {
+            return RETRY;
+        }
+        if (child == nullptr) {
+            return NOT_FOUND;
+        }
+
+        std::uint64_t childVersion = child->version_.load();
+        if (isShrinking(childVersion)) {
+            waitUntilShrunk(child, childVersion);
+            continue;
+        }
+        if (childVersion == UNLINKED || child != node->getChild(dir)) {
+            continue;
+        }
+        if (node->version_.load() != nodeVersion) {
+            return RETRY;
+        }
+
+        Outcome outcome;
+        if (bound == nullptr || *bound < child->getKey()) {
+            outcome = attemptHigher(bound, child, -1, childVersion, item);
+            if (outcome == RETRY) {
+                continue;
+            }
+            if (outcome == FOUND) {
+                return FOUND;
+            }
+
+            Value* value = child->value_.load();
+            if (value != nullptr) {
+                item.first = child->getKey();
+                item.second = *value;
+                return FOUND;
+            }
+            outcome = attemptHigher(bound, child, 1, childVersion, item);
+        }else {
+            outcome = attemptHigher(bound, child, 1, childVersion, item);
+        }
+        if (outcome != RETRY) {
+            return outcome;
+        }
+    }
+}
+
+/**
+* Inserts new_item, or replaces the value of its key. Returns true iff the key was new.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& new_item)
+{
+    EpochGuard guard;
+    while (true) {
+        Outcome outcome = attemptPut(new_item.first, new_item.second, &rootHolder_, 1, 0);
+        if (outcome != RETRY) {
+            return outcome == NOT_FOUND;
+        }
+    }
+}
+
+/**
+* attemptGet, inserting or updating once the place for key is found.
+* NOT_FOUND means key was inserted, FOUND that its value was replaced.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Outcome
+ConcurrentAVLTree<Key, Value>::attemptPut(const Key& key, const Value& value, Node* node, int dir, std::uint64_t nodeVersion)
+{
+    Outcome outcome = RETRY;
+    do {
+        Node* child = node->getChild(dir);
+        if (node->version_.load() != nodeVersion) {
+            return RETRY;
+        }
+
+        if (child == nullptr) {
+            outcome = attemptInsert(key, value, node, dir, nodeVersion);
+        }else {
+            int childDir = compare(key, child->getKey());
+            if (childDir == 0) {
+                outcome = attemptUpdate(child, value);
+            }else {
+                std::uint64_t childVersion = child->version_.load();
+                if (isShrinking(childVersion)) {
+                    waitUntilShrunk(child, childVersion);
+                }else if (childVersion != UNLINKED && child == node->getChild(dir)) {
+                    if (node->version_.load() != nodeVersion) {
+                        return RETRY;
+                    }
+                    outcome = attemptPut(key, value, child, childDir, childVersion);
+                }
+            }
+        }
+    } while (outcome == RETRY);
+    return outcome;
+}
+
+/**
+* Hangs a new leaf off node, if it still has no child there and has not shrunk.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Outcome
+ConcurrentAVLTree<Key, Value>::attemptInsert(const Key& key, const Value& value, Node* node, int dir, std::uint64_t nodeVersion)
+{
+    {
+        std::lock_guard<std::mutex> lock(node->lock_);
+        if (node->version_.load() != nodeVersion || node->getChild(dir) != nullptr) {
+            return RETRY;
+        }
+        node->setChild(dir, new Node(key, new Value(value), node));
+    }
+    fixHeightAndRebalance(node);
+    return NOT_FOUND;
+}
+
+/**
+* Replaces node's value, which also revives a routing node.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Outcome
+ConcurrentAVLTree<Key, Value>::attemptUpdate(Node* node, const Value& value)
+{
+    Value* replacement = new Value(value);
+    Value* previous = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(node->lock_);
+        if (node->version_.load() == UNLINKED) {
+            delete replacement;
+            return RETRY;
+        }
+        previous = node->value_.exchange(replacement);
+    }
+
+    if (previous == nullptr) {
+        return NOT_FOUND;
+    }
+    retired_.retire(previous);
+    return FOUND;
+}
+
+/**
+* Removes the item with key, returning true iff there was one.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::remove(const Key& key)
+{
+    EpochGuard guard;
+    while (true) {
+        Outcome outcome = attemptRemove(key, &rootHolder_, 1, 0);
+        if (outcome != RETRY) {
+            return outcome == FOUND;
+        }
+    }
+}
+
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Outcome
+ConcurrentAVLTree<Key, Value>::attemptRemove(const Key& key, Node* node, int dir, std::uint64_t nodeVersion)
+{
+    Outcome outcome = RETRY;
+    do {
+        Node* child = node->getChild(dir);
+        if (node->version_.load() != nodeVersion) {
+            return RETRY;
+        }
+        if (child == nullptr) {
+            return NOT_FOUND;
+        }
+
+        int childDir = compare(key, child->getKey());
+        if (childDir == 0) {
+            outcome = attemptRemoveNode(node, child);
+        }else {
+            std::uint64_t childVersion = child->version_.load();
+            if (isShrinking(childVersion)) {
+                waitUntilShrunk(child, childVersion);
+            }else if (childVersion != UNLINKED && child == node->getChild(dir)) {
+                if (node->version_.load() != nodeVersion) {
+                    return RETRY;
+                }
+                outcome = attemptRemove(key, child, childDir, childVersion);
+            }
+        }
+    } while (outcome == RETRY);
+    return outcome;
+}
+
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::canUnlink(Node* node)
+{
+    return node->left_.load() == nullptr || node->right_.load() == nullptr;
+}
+
+/**
+* Removes node's item. A node with two children becomes a routing node,
+* any other is unlinked, which takes its parent's lock as well.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Outcome
+ConcurrentAVLTree<Key, Value>::attemptRemoveNode(Node* parent, Node* node)
+{
+    if (node->value_.load() == nullptr) {
+        return NOT_FOUND;
+    }
+
+    Value* previous = nullptr;
+    if (!canUnlink(node)) {
+        std::lock_guard<std::mutex> lock(node->lock_);
+        if (node->version_.load() == UNLINKED || canUnlink(node)) {
+            return RETRY;
+        }
+        previous = node->value_.exchange(nullptr);
+    }else {
+        {
+            std::lock_guard<std::mutex> parentLock(parent->lock_);
+            if (parent->version_.load() == UNLINKED || node->parent_.load() != parent) {
+                return RETRY;
+            }
+
+            std::lock_guard<std::mutex> lock(node->lock_);
+            if (node->version_.load() == UNLINKED || !canUnlink(node)) {
+                return RETRY;
+            }
+            previous = node->value_.exchange(nullptr);
+            if (previous == nullptr) {
+                return NOT_FOUND;
+            }
+
+            Node* splice = (node->left_.load() != nullptr) ? node->left_.load() : node->right_.load();
+            if (parent->left_.load() == node) {
+                parent->left_.store(splice);
+            }else {
+                parent->right_.store(splice);
+            }
+            if (splice != nullptr) {
+                splice->parent_.store(parent);
+            }
+            node->version_.store(UNLINKED);
+        }
+        retired_.retire(node);
+        fixHeightAndRebalance(parent);
+    }
+
+    if (previous == nullptr) {
+        return NOT_FOUND;
+    }
+    retired_.retire(previous);
+    return FOUND;
+}
+
+/**
+* What node needs: its routing node unlinked, a rotation, a new height
+* (returned as is), or nothing.
+*/
+template<class Key, class Value>
+int ConcurrentAVLTree<Key, Value>::nodeCondition(Node* node)
+{
+    Node* left = node->left_.load();
+    Node* right = node->right_.load();
+    if ((left == nullptr || right == nullptr) && node->value_.load() == nullptr) {
+        return UNLINK_REQUIRED;
+    }
+
+    int leftHeight = height(left);
+    int rightHeight = height(right);
+    int balance = leftHeight - rightHeight;
+    if (balance < -1 || balance > 1) {
+        return REBALANCE_REQUIRED;
+    }
+
+    int newHeight = 1 + std::max(leftHeight, rightHeight);
+    return (node->height_.load() != newHeight) ? newHeight : NOTHING_REQUIRED;
+}
+
+/**
+* Walks up from node fixing heights and rotating until nothing changes.
+* Fixing a height takes only the node's lock, while unlinking or rotating
+* takes its parent's first.
+* That nothing needs changing is only ever concluded under the node's lock,
+* as another writer holding it may be about to store a height computed
+* before this one's change below. Even then the node's parent is looked at
+* once more: a rotation that handed the node back may have left the parent
+* an outdated height (see finishRotation_nl), and another writer may have
+* settled the node since.
+* An unlinked node keeps its links, parent included, so whether node is
+* still in the tree is checked again under its lock: rotating it would
+* link it back in over one of its old parent's children.
+*/
+template<class Key, class Value>
+void ConcurrentAVLTree<Key, Value>::fixHeightAndRebalance(Node* node)
+{
+    bool settled = false;
+    while (node != nullptr && node->parent_.load() != nullptr) {
+        if (node->version_.load() == UNLINKED) {
+            return;
+        }
+
+        int condition = nodeCondition(node);
+        Node* next = nullptr;
+        if (condition != UNLINK_REQUIRED && condition != REBALANCE_REQUIRED) {
+            std::lock_guard<std::mutex> lock(node->lock_);
+            if (node->version_.load() == UNLINKED) {
+                return;
+            }
+            next = fixHeight_nl(node);
+        }else {
+            Node* parent = node->parent_.load();
+            std::lock_guard<std::mutex> parentLock(parent->lock_);
+            if (parent->version_.load() != UNLINKED && node->parent_.load() == parent) {
+                std::lock_guard<std::mutex> lock(node->lock_);
+                if (node->version_.load() == UNLINKED) {
+                    return;
+                }
+                next = rebalance_nl(parent, node);
+            }else {
+                //node moved meanwhile, so look at it again
+                next = node;
+            }
+        }
+
+        if (next == nullptr) {
+            if (settled) {
+                return;
+            }
+            settled = true;
+            next = node->parent_.load();
+        }else {
+            settled = false;
+        }
+        node = next;
+    }
+}
+
+/**
+* Sets node's height, returning its parent to look at next, node itself if
+* it needs more than a height, or null if it needs nothing.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::fixHeight_nl(Node* node)
+{
+    int condition = nodeCondition(node);
+    if (condition == REBALANCE_REQUIRED || condition == UNLINK_REQUIRED) {
+        return node;
+    }
+    if (condition == NOTHING_REQUIRED) {
+        return nullptr;
+    }
+    node->height_.store(condition);
+    return node->parent_.load();
+}
+
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::rebalance_nl(Node* parent, Node* node)
+{
+    Node* left = node->left_.load();
+    Node* right = node->right_.load();
+    if ((left == nullptr || right == nullptr) && node->value_.load() == nullptr) {
+        if (attemptUnlink_nl(parent, node)) {
+            return fixHeight_nl(parent);
+        }
+        return node;
+    }
+
+    int leftHeight = height(left);
+    int rightHeight = height(right);
+    int newHeight = 1 + std::max(leftHeight, rightHeight);
+    int balance = leftHeight - rightHeight;
+
+    if (balance > 1) {
+        return rebalanceToRight_nl(parent, node, left, rightHeight);
+    }else if (balance < -1) {
+        return rebalanceToLeft_nl(parent, node, right, leftHeight);
+    }else if (newHeight != node->height_.load()) {
+        node->height_.store(newHeight);
+        return fixHeight_nl(parent);
+    }
+    return nullptr;
+}
+
+/**
+* node is left heavy: rotates right, first rotating left left if it leans
+* right. Locks left, and its right child when that one moves up.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::rebalanceToRight_nl(Node* parent, Node* node, Node* left, int rightHeight)
+{
+    std::lock_guard<std::mutex> leftLock(left->lock_);
+    int leftHeight = left->height_.load();
+    if (leftHeight - rightHeight <= 1) {
+        return node;
+    }
+
+    Node* leftRight = left->right_.load();
+    int leftLeftHeight = height(left->left_.load());
+    int leftRightHeight = height(leftRight);
+    if (leftLeftHeight >= leftRightHeight) {
+        return rotateRight(parent, node, left, rightHeight, leftLeftHeight, leftRight, leftRightHeight);
+    }
+
+    {
+        std::lock_guard<std::mutex> leftRightLock(leftRight->lock_);
+        leftRightHeight = leftRight->height_.load();
+        if (leftLeftHeight >= leftRightHeight) {
+            return rotateRight(parent, node, left, rightHeight, leftLeftHeight, leftRight, leftRightHeight);
+        }
+
+        int leftRightLeftHeight = height(leftRight->left_.load());
+        int balance = leftLeftHeight - leftRightLeftHeight;
+        if (balance >= -1 && balance <= 1) {
+            return rotateRightOverLeft(parent, node, left, rightHeight, leftLeftHeight, leftRight, leftRightLeftHeight);
+        }
+    }
+    //the double rotation would leave node unbalanced, so only rotate left down for now
+    return rebalanceToLeft_nl(node, left, leftRight, leftLeftHeight);
+}
+
+/**
+* Mirror image of rebalanceToRight_nl.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::rebalanceToLeft_nl(Node* parent, Node* node, Node* right, int leftHeight)
+{
+    std::lock_guard<std::mutex> rightLock(right->lock_);
+    int rightHeight = right->height_.load();
+    if (leftHeight - rightHeight >= -1) {
+        return node;
+    }
+
+    Node* rightLeft = right->left_.load();
+    int rightLeftHeight = height(rightLeft);
+    int rightRightHeight = height(right->right_.load());
+    if (rightRightHeight >= rightLeftHeight) {
+        return rotateLeft(parent, node, leftHeight, right, rightLeft, rightLeftHeight, rightRightHeight);
+    }
+
+    {
+        std::lock_guard<std::mutex> rightLeftLock(rightLeft->lock_);
+        rightLeftHeight = rightLeft->height_.load();
+        if (rightRightHeight >= rightLeftHeight) {
+            return rotateLeft(parent, node, leftHeight, right, rightLeft, rightLeftHeight, rightRightHeight);
+        }
+
+        int rightLeftRightHeight = height(rightLeft->right_.load());
+        int balance = rightRightHeight - rightLeftRightHeight;
+        if (balance >= -1 && balance <= 1) {
+            return rotateLeftOverRight(parent, node, leftHeight, right, rightLeft, rightRightHeight, rightLeftRightHeight);
+        }
+    }
+    return rebalanceToRight_nl(node, right, rightLeft, rightRightHeight);
+}
+
+/**
+* Rotates left up over node, with parent, node and left locked. node moves
+* down, so it is marked shrinking while the links change.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::rotateRight(Node* parent, Node* node, Node* left, int rightHeight,
+    int leftLeftHeight, Node* leftRight, int leftRightHeight)
+{
+    std::uint64_t nodeVersion = node->version_.load();
+    int oldHeight = node->height_.load();
+    Node* parentLeft = parent->left_.load();
+
+    node->version_.store(nodeVersion | SHRINKING);
+
+    node->left_.store(leftRight);
+    if (leftRight != nullptr) {
+        leftRight->parent_.store(node);
+    }
+    left->right_.store(node);
+    node->parent_.store(left);
+    if (parentLeft == node) {
+        parent->left_.store(left);
+    }else {
+        parent->right_.store(left);
+    }
+    left->parent_.store(parent);
+
+    //leftRight's writers check its parent after storing its height, so
+    //reading that height only after relinking it means neither misses the other
+    leftRightHeight = height(leftRight);
+    int nodeHeight = 1 + std::max(leftRightHeight, rightHeight);
+    node->height_.store(nodeHeight);
+    left->height_.store(1 + std::max(leftLeftHeight, nodeHeight));
+
+    node->version_.store(nodeVersion + SHRINK_COUNT_UNIT);
+
+    //hand back whichever node still needs work, most urgent first
+    int nodeBalance = leftRightHeight - rightHeight;
+    if (nodeBalance < -1 || nodeBalance > 1) {
+        return finishRotation_nl(parent, left, oldHeight, node);
+    }
+    if ((leftRight == nullptr || rightHeight == 0) && node->value_.load() == nullptr) {
+        return finishRotation_nl(parent, left, oldHeight, node);
+    }
+    int leftBalance = leftLeftHeight - nodeHeight;
+    if (leftBalance < -1 || leftBalance > 1) {
+        return finishRotation_nl(parent, left, oldHeight, left);
+    }
+    if (leftLeftHeight == 0 && left->value_.load() == nullptr) {
+        return finishRotation_nl(parent, left, oldHeight, left);
+    }
+    return fixHeight_nl(parent);
+}
+
+/**
+* Mirror image of rotateRight.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::rotateLeft(Node* parent, Node* node, int leftHeight, Node* right,
+    Node* rightLeft, int rightLeftHeight, int rightRightHeight)
+{
+    std::uint64_t nodeVersion = node->version_.load();
+    int oldHeight = node->height_.load();
+    Node* parentLeft = parent->left_.load();
+
+    node->version_.store(nodeVersion | SHRINKING);
+
+    node->right_.store(rightLeft);
+    if (rightLeft != nullptr) {
+        rightLeft->parent_.store(node);
+    }
+    right->left_.store(node);
+    node->parent_.store(right);
+    if (parentLeft == node) {
+        parent->left_.store(right);
+    }else {
+        parent->right_.store(right);
+    }
+    right->parent_.store(parent);
+
+    rightLeftHeight = height(rightLeft);
+    int nodeHeight = 1 + std::max(leftHeight, rightLeftHeight);
+    node->height_.store(nodeHeight);
+    right->height_.store(1 + std::max(nodeHeight, rightRightHeight));
+
+    node->version_.store(nodeVersion + SHRINK_COUNT_UNIT);
+
+    int nodeBalance = rightLeftHeight - leftHeight;
+    if (nodeBalance < -1 || nodeBalance > 1) {
+        return finishRotation_nl(parent, right, oldHeight, node);
+    }
+    if ((rightLeft == nullptr || leftHeight == 0) && node->value_.load() == nullptr) {
+        return finishRotation_nl(parent, right, oldHeight, node);
+    }
+    int rightBalance = rightRightHeight - nodeHeight;
+    if (rightBalance < -1 || rightBalance > 1) {
+        return finishRotation_nl(parent, right, oldHeight, right);
+    }
+    if (rightRightHeight == 0 && right->value_.load() == nullptr) {
+        return finishRotation_nl(parent, right, oldHeight, right);
+    }
+    return fixHeight_nl(parent);
+}
+
+/**
+* Double rotation bringing leftRight up over left and node, with all four
+* of parent, node, left and leftRight locked. Both node and left move down.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::rotateRightOverLeft(Node* parent, Node* node, Node* left, int rightHeight,
+    int leftLeftHeight, Node* leftRight, int leftRightLeftHeight)
+{
+    std::uint64_t nodeVersion = node->version_.load();
+    int oldHeight = node->height_.load();
+    std::uint64_t leftVersion = left->version_.load();
+    Node* parentLeft = parent->left_.load();
+    Node* leftRightLeft = leftRight->left_.load();
+    Node* leftRightRight = leftRight->right_.load();
+
+    node->version_.store(nodeVersion | SHRINKING);
+    left->version_.store(leftVersion | SHRINKING);
+
+    node->left_.store(leftRightRight);
+    if (leftRightRight != nullptr) {
+        leftRightRight->parent_.store(node);
+    }
+    left->right_.store(leftRightLeft);
+    if (leftRightLeft != nullptr) {
+        leftRightLeft->parent_.store(left);
+    }
+    leftRight->left_.store(left);
+    left->parent_.store(leftRight);
+    leftRight->right_.store(node);
+    node->parent_.store(leftRight);
+    if (parentLeft == node) {
+        parent->left_.store(leftRight);
+    }else {
+        parent->right_.store(leftRight);
+    }
+    leftRight->parent_.store(parent);
+
+    //as in rotateRight, the subtrees that changed parents are measured afterwards
+    int leftRightRightHeight = height(leftRightRight);
+    leftRightLeftHeight = height(leftRightLeft);
+    int nodeHeight = 1 + std::max(leftRightRightHeight, rightHeight);
+    node->height_.store(nodeHeight);
+    int leftNewHeight = 1 + std::max(leftLeftHeight, leftRightLeftHeight);
+    left->height_.store(leftNewHeight);
+    leftRight->height_.store(1 + std::max(leftNewHeight, nodeHeight));
+
+    node->version_.store(nodeVersion + SHRINK_COUNT_UNIT);
+    left->version_.store(leftVersion + SHRINK_COUNT_UNIT);
+
+    int nodeBalance = leftRightRightHeight - rightHeight;
+    if (nodeBalance < -1 || nodeBalance > 1) {
+        return finishRotation_nl(parent, leftRight, oldHeight, node);
+    }
+    if ((leftRightRight == nullptr || rightHeight == 0) && node->value_.load() == nullptr) {
+        return finishRotation_nl(parent, leftRight, oldHeight, node);
+    }
+    //left may be a routing node left with a single child
+    if ((leftRightLeft == nullptr || leftLeftHeight == 0) && left->value_.load() == nullptr) {
+        return finishRotation_nl(parent, leftRight, oldHeight, left);
+    }
+    int leftRightBalance = leftNewHeight - nodeHeight;
+    if (leftRightBalance < -1 || leftRightBalance > 1) {
+        return finishRotation_nl(parent, leftRight, oldHeight, leftRight);
+    }
+    return fixHeight_nl(parent);
+}
+
+/**
+* Mirror image of rotateRightOverLeft.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::rotateLeftOverRight(Node* parent, Node* node, int leftHeight, Node* right,
+    Node* rightLeft, int rightRightHeight, int rightLeftRightHeight)
+{
+    std::uint64_t nodeVersion = node->version_.load();
+    int oldHeight = node->height_.load();
+    std::uint64_t rightVersion = right->version_.load();
+    Node* parentLeft = parent->left_.load();
+    Node* rightLeftLeft = rightLeft->left_.load();
+    Node* rightLeftRight = rightLeft->right_.load();
+
+    node->version_.store(nodeVersion | SHRINKING);
+    right->version_.store(rightVersion | SHRINKING);
+
+    node->right_.store(rightLeftLeft);
+    if (rightLeftLeft != nullptr) {
+        rightLeftLeft->parent_.store(node);
+    }
+    right->left_.store(rightLeftRight);
+    if (rightLeftRight != nullptr) {
+        rightLeftRight->parent_.store(right);
+    }
+    rightLeft->right_.store(right);
+    right->parent_.store(rightLeft);
+    rightLeft->left_.store(node);
+    node->parent_.store(rightLeft);
+    if (parentLeft == node) {
+        parent->left_.store(rightLeft);
+    }else {
+        parent->right_.store(rightLeft);
+    }
+    rightLeft->parent_.store(parent);
+
+    int rightLeftLeftHeight = height(rightLeftLeft);
+    rightLeftRightHeight = height(rightLeftRight);
+    int nodeHeight = 1 + std::max(leftHeight, rightLeftLeftHeight);
+    node->height_.store(nodeHeight);
+    int rightNewHeight = 1 + std::max(rightLeftRightHeight, rightRightHeight);
+    right->height_.store(rightNewHeight);
+    rightLeft->height_.store(1 + std::max(nodeHeight, rightNewHeight));
+
+    node->version_.store(nodeVersion + SHRINK_COUNT_UNIT);
+    right->version_.store(rightVersion + SHRINK_COUNT_UNIT);
+
+    int nodeBalance = rightLeftLeftHeight - leftHeight;
+    if (nodeBalance < -1 || nodeBalance > 1) {
+        return finishRotation_nl(parent, rightLeft, oldHeight, node);
+    }
+    if ((rightLeftLeft == nullptr || leftHeight == 0) && node->value_.load() == nullptr) {
+        return finishRotation_nl(parent, rightLeft, oldHeight, node);
+    }
+    if ((rightLeftRight == nullptr || rightRightHeight == 0) && right->value_.load() == nullptr) {
+        return finishRotation_nl(parent, rightLeft, oldHeight, right);
+    }
+    int rightLeftBalance = rightNewHeight - nodeHeight;
+    if (rightLeftBalance < -1 || rightLeftBalance > 1) {
+        return finishRotation_nl(parent, rightLeft, oldHeight, rightLeft);
+    }
+    return fixHeight_nl(parent);
+}
+
+/**
+* Ends a rotation that put top in the place of a node of height oldHeight.
+* If next still needs work, top keeps oldHeight for now, the height that
+* parent's own was computed with: the walk up from next then finds top's
+* height off and goes on to fix parent's. Otherwise parent is fixed now.
+*/
+template<class Key, class Value>
+typename ConcurrentAVLTree<Key, Value>::Node*
+ConcurrentAVLTree<Key, Value>::finishRotation_nl(Node* parent, Node* top, int oldHeight, Node* next)
+{
+    if (next == nullptr) {
+        return fixHeight_nl(parent);
+    }
+    top->height_.store(oldHeight);
+    return next;
+}
+
+/**
+* Splices out the routing node node, with parent and node locked.
+* Returns false if node gained a second child or moved meanwhile.
+*/
+template<class Key, class Value>
+bool ConcurrentAVLTree<Key, Value>::attemptUnlink_nl(Node* parent, Node* node)
+{
+    Node* parentLeft = parent->left_.load();
+    Node* parentRight = parent->right_.load();
+    if (parentLeft != node && parentRight != node) {
+        return false;
+    }
+
+    Node* left = node->left_.load();
+    Node* right = node->right_.load();
+    if (left != nullptr && right != nullptr) {
+        return false;
+    }
+
+    Node* splice = (left != nullptr) ? left : right;
+    if (parentLeft == node) {
+        parent->left_.store(splice);
+    }else {
+        parent->right_.store(splice);
+    }
+    if (splice != nullptr) {
+        splice->parent_.store(parent);
+    }
+    node->version_.store(UNLINKED);
+    retired_.retire(node);
+    return true;
+}
+
+/*
+  ---------------------------------------------------
+  End implementations for the ConcurrentAVLTree class.
+  ---------------------------------------------------
+*/
+
+#endif
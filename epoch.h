@@ -0,0 +1,269 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/**
+ * Epoch based reclamation, for data structures read without locks.
+ *
+ * A thread holds an EpochGuard for as long as it may be looking at shared
+ * nodes. Writers do not free what they unlink, they retire it to an
+ * EpochRetireList, and it is only freed once the global epoch has moved on
+ * twice since. The epoch only moves on when every thread inside a guard
+ * has entered it in the current epoch, so two steps mean that every thread
+ * that could have reached the object has since left its guard.
+ *
+ * Guards nest and cost two stores on the thread's own slot; there is one
+ * process-wide epoch shared by every retire list.
+ */
+class EpochDomain
+{
+public:
+    static std::atomic<unsigned long>& epoch();
+    static bool tryAdvance();
+
+private:
+    friend class EpochGuard;
+
+    // one per thread that ever took a guard, reused once that thread exits
+    struct Slot
+    {
+        Slot() : epoch(0), inUse(true), next(nullptr), depth(0) {}
+
+        // 0 while the owning thread holds no guard
+        std::atomic<unsigned long> epoch;
+        std::atomic<bool> inUse;
+        Slot* next;
+        // guard nesting, only touched by the owning thread
+        unsigned depth;
+        // keeps slots of different threads off each other's cache lines
+        char padding[64];
+    };
+
+    struct SlotOwner
+    {
+        SlotOwner();
+        ~SlotOwner();
+        Slot* slot;
+    };
+
+    static std::atomic<Slot*>& slots();
+    static Slot* threadSlot();
+    static Slot* acquireSlot();
+};
+
+/**
+ * Keeps every node the current thread reaches alive until destruction.
+ */
+class EpochGuard
+{
+public:
+    EpochGuard();
+    ~EpochGuard();
+
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+
+private:
+    EpochDomain::Slot* slot_;
+};
+
+/**
+ * Objects unlinked from a shared structure, waiting to be freed.
+ * retire() must be called after the object is unreachable; destroying
+ * the list frees whatever is left, so no thread may be reading by then.
+ */
+class EpochRetireList
+{
+public:
+    EpochRetireList();
+    ~EpochRetireList();
+
+    EpochRetireList(const EpochRetireList&) = delete;
+    EpochRetireList& operator=(const EpochRetireList&) = delete;
+
+    template<typename T>
+    void retire(T* object);
+    void retire(void* object, void (*destroy)(void*));
+
+private:
+    struct Retired
+    {
+        void* object;
+        void (*destroy)(void*);
+        unsigned long epoch;
+    };
+
+    // freeing is attempted once the list has grown by this many objects, or
+    // by as many as it held after the last try, whichever is more
+    static const std::size_t RECLAIM_THRESHOLD = 256;
+
+    template<typename T>
+    static void deleteObject(void* object);
+
+    std::mutex lock_;
+    std::vector<Retired> retired_;
+    std::size_t nextReclaim_;
+};
+
+/*
+  ----------------------------------------------
+  Begin implementations for the epoch classes.
+  ----------------------------------------------
+*/
+
+/**
+* The global epoch. Starts at 1, since 0 marks a slot outside any guard.
+*/
+inline std::atomic<unsigned long>& EpochDomain::epoch()
+{
+    static std::atomic<unsigned long> current(1);
+    return current;
+}
+
+/**
+* Moves the epoch on if every thread inside a guard entered it in the
+* current epoch. Returns true iff the epoch is past the one read on entry.
+*/
+inline bool EpochDomain::tryAdvance()
+{
+    unsigned long current = epoch().load();
+    for (Slot* slot = slots().load(); slot != nullptr; slot = slot->next) {
+        unsigned long seen = slot->epoch.load();
+        if (seen != 0 && seen != current) {
+            return false;
+        }
+    }
+    epoch().compare_exchange_strong(current, current + 1);
+    return true;
+}
+
+inline std::atomic<EpochDomain::Slot*>& EpochDomain::slots()
+{
+    static std::atomic<Slot*> head(nullptr);
+    return head;
+}
+
+inline EpochDomain::SlotOwner::SlotOwner() : slot(EpochDomain::acquireSlot())
+{
+
+}
+
+inline EpochDomain::SlotOwner::~SlotOwner()
+{
+    slot->inUse.store(false);
+}
+
+inline EpochDomain::Slot* EpochDomain::threadSlot()
+{
+    static thread_local SlotOwner owner;
+    return owner.slot;
+}
+
+/**
+* Takes over the slot of a thread that has exited, or pushes a new one.
+* Slots are never freed, so the list can be walked without locks.
+*/
+inline EpochDomain::Slot* EpochDomain::acquireSlot()
+{
+    for (Slot* slot = slots().load(); slot != nullptr; slot = slot->next) {
+        bool taken = false;
+        if (!slot->inUse.load() && slot->inUse.compare_exchange_strong(taken, true)) {
+            return slot;
+        }
+    }
+
+    Slot* slot = new Slot();
+    Slot* head = slots().load();
+    do {
+        slot->next = head;
+    } while (!slots().compare_exchange_weak(head, slot));
+    return slot;
+}
+
+/**
+* Publishes the epoch this thread entered in before it reads anything.
+*/
+inline EpochGuard::EpochGuard() : slot_(EpochDomain::threadSlot())
+{
+    if (slot_->depth++ == 0) {
+        slot_->epoch.store(EpochDomain::epoch().load());
+    }
+}
+
+inline EpochGuard::~EpochGuard()
+{
+    if (--slot_->depth == 0) {
+        slot_->epoch.store(0);
+    }
+}
+
+inline EpochRetireList::EpochRetireList() : nextReclaim_(RECLAIM_THRESHOLD)
+{
+
+}
+
+inline EpochRetireList::~EpochRetireList()
+{
+    for (std::size_t i = 0; i < retired_.size(); ++i) {
+        retired_[i].destroy(retired_[i].object);
+    }
+}
+
+template<typename T>
+void EpochRetireList::retire(T* object)
+{
+    retire(object, &EpochRetireList::deleteObject<T>);
+}
+
+template<typename T>
+void EpochRetireList::deleteObject(void* object)
+{
+    delete static_cast<T*>(object);
+}
+
+/**
+* Queues object to be freed with destroy, and now and then frees whatever
+* has waited out two epochs. The freeing itself happens outside the lock.
+*/
+inline void EpochRetireList::retire(void* object, void (*destroy)(void*))
+{
+    std::vector<Retired> ready;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        Retired entry = { object, destroy, EpochDomain::epoch().load() };
+        retired_.push_back(entry);
+        if (retired_.size() < nextReclaim_) {
+            return;
+        }
+
+        EpochDomain::tryAdvance();
+        unsigned long current = EpochDomain::epoch().load();
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < retired_.size(); ++i) {
+            if (retired_[i].epoch + 2 <= current) {
+                ready.push_back(retired_[i]);
+            }else {
+                retired_[kept++] = retired_[i];
+            }
+        }
+        retired_.resize(kept);
+        nextReclaim_ = kept + std::max(kept, static_cast<std::size_t>(RECLAIM_THRESHOLD));
+    }
+
+    for (std::size_t i = 0; i < ready.size(); ++i) {
+        ready[i].destroy(ready[i].object);
+    }
+}
+
+/*
+  --------------------------------------------
+  End implementations for the epoch classes.
+  --------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,397 @@
+#ifndef FROZEN_MAP_H
+#define FROZEN_MAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/**
+* A read-only sorted map for lookup-only phases, built once from a tree
+* with freeze().
+*
+* Keys are laid out in Eytzinger order: the implicit tree rooted at index 1
+* has the children of k at 2k and 2k + 1, stored in one contiguous array,
+* with the values in a second array in the same order. A search touches the
+* first levels in the same few cache lines every time, and each step only
+* computes the next index from a comparison instead of branching on it, so
+* the loads of the levels below can be prefetched before they are needed.
+*
+* Ordered iteration walks the implicit tree in order, O(1) amortized per step.
+* Keys are ordered by Compare, as in the tree the map was frozen from.
+*
+* For trivially copyable keys and values the two arrays can be saved as a
+* snapshot file, which can be mapped back and queried in place; see
+* Snapshot in snapshot.h. Copies of a map share its arrays, which are
+* never modified.
+*/
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class FrozenMap
+{
+public:
+    FrozenMap();
+    // The pairs in [first, last) must be sorted by strictly increasing key.
+    template<typename InputIt>
+    FrozenMap(InputIt first, InputIt last, const Compare& compare = Compare());
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key&, const Value&> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type reference;
+
+        // keys and values are stored apart, so -> hands out a pair of references
+        class pointer
+        {
+        public:
+            const value_type* operator->() const;
+
+        private:
+            friend class const_iterator;
+            explicit pointer(const value_type& item);
+            value_type item_;
+        };
+
+        const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    private:
+        friend class FrozenMap<Key, Value, Compare>;
+        const_iterator(const FrozenMap* map, std::size_t index);
+
+        const FrozenMap* map_;
+        // 1-based Eytzinger index, 0 past the end
+        std::size_t index_;
+    };
+
+    const_iterator find(const Key& key) const;
+    const_iterator lower_bound(const Key& key) const;
+    const_iterator upper_bound(const Key& key) const;
+    bool contains(const Key& key) const;
+    const Value& operator[](const Key& key) const;
+
+    const_iterator begin() const;
+    const_iterator end() const;
+    bool empty() const;
+    std::size_t size() const;
+
+protected:
+    // reads and writes the arrays directly
+    friend class Snapshot;
+
+    // index of the first key not less than key (or greater than it, if
+    // Strict), 0 if there is none
+    template<bool Strict>
+    std::size_t bound(const Key& key) const;
+
+    static std::size_t firstIndex(std::size_t size);
+    static std::size_t nextIndex(std::size_t index, std::size_t size);
+
+    // Eytzinger index k lives at position k - 1 of both arrays, which are
+    // owned by storage_: a pair of vectors, or a mapped snapshot
+    const Key* keys_;
+    const Value* values_;
+    std::size_t size_;
+    std::shared_ptr<const void> storage_;
+    Compare compare_;
+};
+
+/*
+  -------------------------------------------------
+  Begin implementations for the FrozenMap iterator.
+  -------------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+FrozenMap<Key, Value, Compare>::const_iterator::pointer::pointer(const value_type& item) : item_(item)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+const typename FrozenMap<Key, Value, Compare>::const_iterator::value_type*
+FrozenMap<Key, Value, Compare>::const_iterator::pointer::operator->() const
+{
+    return &item_;
+}
+
+/**
+* Constructs the end iterator.
+*/
+template<class Key, class Value, class Compare>
+FrozenMap<Key, Value, Compare>::const_iterator::const_iterator() : map_(nullptr), index_(0)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+FrozenMap<Key, Value, Compare>::const_iterator::const_iterator(const FrozenMap* map, std::size_t index) :
+    map_(index == 0 ? nullptr : map),
+    index_(index)
+{
+
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator::reference
+FrozenMap<Key, Value, Compare>::const_iterator::operator*() const
+{
+    return value_type(map_->keys_[index_ - 1], map_->values_[index_ - 1]);
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator::pointer
+FrozenMap<Key, Value, Compare>::const_iterator::operator->() const
+{
+    return pointer(**this);
+}
+
+template<class Key, class Value, class Compare>
+bool FrozenMap<Key, Value, Compare>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    return map_ == rhs.map_ && index_ == rhs.index_;
+}
+
+template<class Key, class Value, class Compare>
+bool FrozenMap<Key, Value, Compare>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator&
+FrozenMap<Key, Value, Compare>::const_iterator::operator++()
+{
+    index_ = nextIndex(index_, map_->size_);
+    if (index_ == 0) {
+        map_ = nullptr;
+    }
+    return *this;
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/*
+  -----------------------------------------------
+  End implementations for the FrozenMap iterator.
+  -----------------------------------------------
+*/
+
+/*
+  ----------------------------------------------
+  Begin implementations for the FrozenMap class.
+  ----------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+FrozenMap<Key, Value, Compare>::FrozenMap() : keys_(nullptr), values_(nullptr), size_(0)
+{
+
+}
+
+/**
+* Copies the sorted pairs out, then places the i-th smallest at the
+* i-th index of an in-order walk of the implicit tree. O(n).
+*/
+template<class Key, class Value, class Compare>
+template<typename InputIt>
+FrozenMap<Key, Value, Compare>::FrozenMap(InputIt first, InputIt last, const Compare& compare) :
+    keys_(nullptr),
+    values_(nullptr),
+    size_(0),
+    compare_(compare)
+{
+    std::vector<std::pair<Key, Value> > sorted;
+    for (; first != last; ++first) {
+        sorted.push_back(std::pair<Key, Value>(first->first, first->second));
+    }
+
+    const std::size_t n = sorted.size();
+    std::vector<std::size_t> rank(n);
+    std::size_t next = 0;
+    for (std::size_t k = firstIndex(n); k != 0; k = nextIndex(k, n)) {
+        rank[k - 1] = next++;
+    }
+
+    std::shared_ptr<std::pair<std::vector<Key>, std::vector<Value> > > arrays =
+        std::make_shared<std::pair<std::vector<Key>, std::vector<Value> > >();
+    arrays->first.reserve(n);
+    arrays->second.reserve(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        arrays->first.push_back(sorted[rank[i]].first);
+        arrays->second.push_back(sorted[rank[i]].second);
+    }
+
+    keys_ = arrays->first.data();
+    values_ = arrays->second.data();
+    size_ = n;
+    storage_ = arrays;
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::find(const Key& key) const
+{
+    std::size_t k = bound<false>(key);
+    if (k == 0 || compare_(key, keys_[k - 1])) {
+        return end();
+    }
+    return const_iterator(this, k);
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::lower_bound(const Key& key) const
+{
+    return const_iterator(this, bound<false>(key));
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::upper_bound(const Key& key) const
+{
+    return const_iterator(this, bound<true>(key));
+}
+
+template<class Key, class Value, class Compare>
+bool FrozenMap<Key, Value, Compare>::contains(const Key& key) const
+{
+    return find(key) != end();
+}
+
+template<class Key, class Value, class Compare>
+const Value& FrozenMap<Key, Value, Compare>::operator[](const Key& key) const
+{
+    std::size_t k = bound<false>(key);
+    if (k == 0 || compare_(key, keys_[k - 1])) {
+        throw std::out_of_range("Invalid key");
+    }
+    return values_[k - 1];
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::begin() const
+{
+    return const_iterator(this, firstIndex(size_));
+}
+
+template<class Key, class Value, class Compare>
+typename FrozenMap<Key, Value, Compare>::const_iterator
+FrozenMap<Key, Value, Compare>::end() const
+{
+    return const_iterator();
+}
+
+template<class Key, class Value, class Compare>
+bool FrozenMap<Key, Value, Compare>::empty() const
+{
+    return size_ == 0;
+}
+
+template<class Key, class Value, class Compare>
+std::size_t FrozenMap<Key, Value, Compare>::size() const
+{
+    return size_;
+}
+
+/**
+* Descends to a leaf going right past every key less than key, so the loop
+* has no data dependent branch. Every step prefetches the line holding
+* the node's descendants four levels down. The descent ends below the
+* answer, after one left turn and then only right turns, so shifting out
+* the trailing one bits and one more of k gives the answer, or 0.
+*/
+template<class Key, class Value, class Compare>
+template<bool Strict>
+std::size_t FrozenMap<Key, Value, Compare>::bound(const Key& key) const
+{
+    const Key* keys = keys_;
+    const std::size_t n = size_;
+    // the 16 descendants of k four levels down start at 16k, which for
+    // small keys is a cache line or two
+    const std::size_t prefetchStride = 16;
+
+    std::size_t k = 1;
+    while (k <= n) {
+#if defined(__GNUC__)
+        __builtin_prefetch(keys + std::min(prefetchStride * k, n) - 1);
+#endif
+        bool right = Strict ? !compare_(key, keys[k - 1]) : compare_(keys[k - 1], key);
+        k = 2 * k + right;
+    }
+
+#if defined(__GNUC__)
+    return k >> __builtin_ffsll(~static_cast<unsigned long long>(k));
+#else
+    while (k & 1) {
+        k >>= 1;
+    }
+    return k >> 1;
+#endif
+}
+
+/**
+* The leftmost index of an implicit tree with size nodes, 0 if it is empty.
+*/
+template<class Key, class Value, class Compare>
+std::size_t FrozenMap<Key, Value, Compare>::firstIndex(std::size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+    std::size_t k = 1;
+    while (2 * k <= size) {
+        k *= 2;
+    }
+    return k;
+}
+
+/**
+* The index after index in order: the leftmost of its right subtree, else
+* the nearest ancestor it is left of. 0 past the last one.
+*/
+template<class Key, class Value, class Compare>
+std::size_t FrozenMap<Key, Value, Compare>::nextIndex(std::size_t index, std::size_t size)
+{
+    if (2 * index + 1 <= size) {
+        std::size_t k = 2 * index + 1;
+        while (2 * k <= size) {
+            k *= 2;
+        }
+        return k;
+    }
+    while (index & 1) {
+        index >>= 1;
+    }
+    return index >> 1;
+}
+
+/*
+  --------------------------------------------
+  End implementations for the FrozenMap class.
+  --------------------------------------------
+*/
+
+#endif
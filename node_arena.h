@@ -0,0 +1,178 @@
+#ifndef NODE_ARENA_H
+#define NODE_ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/**
+ * A slab allocator for fixed-size tree nodes.
+ *
+ * Slots are carved out of large contiguous blocks instead of being
+ * allocated one at a time. Freed slots go on an intrusive free list
+ * and are reused before any new block is requested, and release()
+ * hands every block back at once, so tearing down a tree is
+ * O(blocks) instead of O(nodes).
+ *
+ * The arena only manages raw storage; constructing and destroying the
+ * objects that live in it is up to the caller.
+ */
+class NodeArena
+{
+public:
+    explicit NodeArena(std::size_t slotSize, std::size_t align = alignof(std::max_align_t));
+    ~NodeArena();
+
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    void* allocate();
+    void deallocate(void* slot);
+    void release();
+
+    std::size_t slotSize() const;
+    std::size_t alignment() const;
+    std::size_t blockCount() const;
+
+private:
+    // a freed slot is reused to hold the link to the next free slot
+    struct FreeSlot
+    {
+        FreeSlot* next;
+    };
+
+    // blocks start small so tiny trees stay tiny, then double up to a cap
+    static const std::size_t MIN_SLOTS_PER_BLOCK = 64;
+    static const std::size_t MAX_SLOTS_PER_BLOCK = 65536;
+
+    void grow();
+
+    std::size_t slotSize_;
+    std::size_t align_;
+    std::size_t nextBlockSlots_;
+    std::vector<char*> blocks_;
+    char* cursor_;
+    char* blockEnd_;
+    FreeSlot* freeList_;
+};
+
+/*
+  ----------------------------------------------
+  Begin implementations for the NodeArena class.
+  ----------------------------------------------
+*/
+
+/**
+* Creates an empty arena handing out slots of at least slotSize bytes.
+* Slots are padded to a multiple of align, which should be the alignment of
+* the node type stored in them. Blocks come from ::operator new, so align
+* must not exceed alignof(std::max_align_t), which is also the default.
+*/
+inline NodeArena::NodeArena(std::size_t slotSize, std::size_t align) :
+    slotSize_(0),
+    align_(align < alignof(FreeSlot) ? alignof(FreeSlot) : align),
+    nextBlockSlots_(MIN_SLOTS_PER_BLOCK),
+    cursor_(nullptr),
+    blockEnd_(nullptr),
+    freeList_(nullptr)
+{
+    std::size_t size = slotSize < sizeof(FreeSlot) ? sizeof(FreeSlot) : slotSize;
+    slotSize_ = (size + align_ - 1) / align_ * align_;
+}
+
+inline NodeArena::~NodeArena()
+{
+    release();
+}
+
+/**
+* Returns storage for one slot, preferring previously freed slots.
+*/
+inline void* NodeArena::allocate()
+{
+    if (freeList_ != nullptr) {
+        FreeSlot* slot = freeList_;
+        freeList_ = slot->next;
+        return slot;
+    }
+
+    if (cursor_ == blockEnd_) {
+        grow();
+    }
+
+    void* slot = cursor_;
+    cursor_ += slotSize_;
+    return slot;
+}
+
+/**
+* Puts a slot back on the free list. Whatever lived in it must already be
+* destroyed. The slot need not have come from this arena: any slot of the
+* same size and alignment will do, as long as the block it lies in outlives
+* this arena's free list, that is, until release() or the destructor.
+*/
+inline void NodeArena::deallocate(void* slot)
+{
+    if (slot == nullptr) {
+        return;
+    }
+    FreeSlot* freed = static_cast<FreeSlot*>(slot);
+    freed->next = freeList_;
+    freeList_ = freed;
+}
+
+/**
+* Frees every block at once. Any slot still handed out becomes invalid,
+* so the objects in them must either be destroyed already or not need it.
+*/
+inline void NodeArena::release()
+{
+    for (std::size_t i = 0; i < blocks_.size(); ++i) {
+        ::operator delete(blocks_[i]);
+    }
+    blocks_.clear();
+    cursor_ = nullptr;
+    blockEnd_ = nullptr;
+    freeList_ = nullptr;
+    nextBlockSlots_ = MIN_SLOTS_PER_BLOCK;
+}
+
+inline std::size_t NodeArena::slotSize() const
+{
+    return slotSize_;
+}
+
+inline std::size_t NodeArena::alignment() const
+{
+    return align_;
+}
+
+inline std::size_t NodeArena::blockCount() const
+{
+    return blocks_.size();
+}
+
+/**
+* Requests the next block, doubling the block size each time up to the cap.
+*/
+inline void NodeArena::grow()
+{
+    blocks_.reserve(blocks_.size() + 1);
+    char* block = static_cast<char*>(::operator new(slotSize_ * nextBlockSlots_));
+    blocks_.push_back(block);
+
+    cursor_ = block;
+    blockEnd_ = block + slotSize_ * nextBlockSlots_;
+
+    if (nextBlockSlots_ < MAX_SLOTS_PER_BLOCK) {
+        nextBlockSlots_ *= 2;
+    }
+}
+
+/*
+  --------------------------------------------
+  End implementations for the NodeArena class.
+  --------------------------------------------
+*/
+
+#endif
@@ -0,0 +1,714 @@
+#ifndef PERSISTENT_AVLBST_H
+#define PERSISTENT_AVLBST_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+template <typename Key, typename Value>
+class PersistentAVLTree;
+
+/**
+* A node of a PersistentAVLTree. Nodes never change once built, and have
+* no parent pointer, so any number of tree versions can point at the same
+* node. The count of those pointers is atomic, so versions may be handed
+* to, and dropped by, other threads.
+*/
+template <typename Key, typename Value>
+class PersistentAVLNode
+{
+public:
+    PersistentAVLNode(const std::pair<const Key, Value>& item, const PersistentAVLNode* left, const PersistentAVLNode* right);
+
+    PersistentAVLNode(const PersistentAVLNode&) = delete;
+    PersistentAVLNode& operator=(const PersistentAVLNode&) = delete;
+
+    const std::pair<const Key, Value>& getItem() const;
+    const Key& getKey() const;
+    const Value& getValue() const;
+    const PersistentAVLNode* getLeft() const;
+    const PersistentAVLNode* getRight() const;
+    int getHeight() const;
+
+protected:
+    friend class PersistentAVLTree<Key, Value>;
+
+    std::pair<const Key, Value> item_;
+    const PersistentAVLNode* left_;
+    const PersistentAVLNode* right_;
+    int height_;
+    // pointers to this node from parents, trees and iterators
+    mutable std::atomic<std::size_t> refs_;
+};
+
+/*
+  -----------------------------------------------------
+  Begin implementations for the PersistentAVLNode class.
+  -----------------------------------------------------
+*/
+
+/**
+* Constructs a node taking over one reference to each child,
+* with a single reference of its own held by the caller.
+*/
+template<typename Key, typename Value>
+PersistentAVLNode<Key, Value>::PersistentAVLNode(const std::pair<const Key, Value>& item, const PersistentAVLNode* left, const PersistentAVLNode* right) :
+    item_(item),
+    left_(left),
+    right_(right),
+    height_(1 + std::max(left == nullptr ? 0 : left->height_, right == nullptr ? 0 : right->height_)),
+    refs_(1)
+{
+
+}
+
+template<typename Key, typename Value>
+const std::pair<const Key, Value>& PersistentAVLNode<Key, Value>::getItem() const
+{
+    return item_;
+}
+
+template<typename Key, typename Value>
+const Key& PersistentAVLNode<Key, Value>::getKey() const
+{
+    return item_.first;
+}
+
+template<typename Key, typename Value>
+const Value& PersistentAVLNode<Key, Value>::getValue() const
+{
+    return item_.second;
+}
+
+template<typename Key, typename Value>
+const PersistentAVLNode<Key, Value>* PersistentAVLNode<Key, Value>::getLeft() const
+{
+    return left_;
+}
+
+template<typename Key, typename Value>
+const PersistentAVLNode<Key, Value>* PersistentAVLNode<Key, Value>::getRight() const
+{
+    return right_;
+}
+
+template<typename Key, typename Value>
+int PersistentAVLNode<Key, Value>::getHeight() const
+{
+    return height_;
+}
+
+/*
+  ---------------------------------------------------
+  End implementations for the PersistentAVLNode class.
+  ---------------------------------------------------
+*/
+
+/**
+* An AVL tree whose versions share structure. insert and remove copy only
+* the O(log n) nodes on the path they change and leave every other node in
+* place, so snapshot() and copying a tree are O(1), and a snapshot keeps
+* seeing the items it had however the tree it was taken from changes.
+*
+* Nodes are reference counted and freed along with the last version that
+* reaches them. A single version is not safe to change from several threads
+* at once, but different versions are, even where they share nodes.
+*/
+template <typename Key, typename Value>
+class PersistentAVLTree
+{
+public:
+    PersistentAVLTree();
+    PersistentAVLTree(const PersistentAVLTree& other);
+    PersistentAVLTree(PersistentAVLTree&& other);
+    PersistentAVLTree& operator=(const PersistentAVLTree& other);
+    PersistentAVLTree& operator=(PersistentAVLTree&& other);
+    ~PersistentAVLTree();
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef std::pair<const Key, Value> value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef const value_type& reference;
+
+        const_iterator();
+        const_iterator(const const_iterator& other);
+        const_iterator& operator=(const const_iterator& other);
+        ~const_iterator();
+
+        reference operator*() const;
+        pointer operator->() const;
+
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+
+    private:
+        friend class PersistentAVLTree<Key, Value>;
+        typedef PersistentAVLNode<Key, Value> Node;
+
+        explicit const_iterator(const Node* root);
+
+        // the version iterated over, held so it outlives changes to the tree
+        const Node* root_;
+        // the current node on top, below it the ancestors still to be visited
+        std::vector<const Node*> path_;
+    };
+
+    // Inserting an existing key replaces its value in this version only.
+    void insert(const std::pair<const Key, Value>& new_item);
+    void remove(const Key& key);
+    void clear();
+
+    // An O(1) copy of the current version.
+    PersistentAVLTree snapshot() const;
+
+    const_iterator find(const Key& key) const;
+    const Value& operator[](const Key& key) const;
+    const_iterator begin() const;
+    const_iterator end() const;
+    bool empty() const;
+    std::size_t size() const;
+
+protected:
+    typedef PersistentAVLNode<Key, Value> Node;
+
+    // Every function here that returns a node hands one reference to the
+    // caller, and every node passed to makeNode or balance is taken over.
+    static const Node* acquire(const Node* node);
+    static void release(const Node* node);
+    static int height(const Node* node);
+    static const Node* makeNode(const std::pair<const Key, Value>& item, const Node* left, const Node* right);
+    static const Node* balance(const std::pair<const Key, Value>& item, const Node* left, const Node* right);
+
+    static const Node* insertBelow(const Node* node, const std::pair<const Key, Value>& new_item, bool& added);
+    static const Node* removeBelow(const Node* node, const Key& key, bool& removed);
+    static const Node* removeMin(const Node* node, const Node*& min);
+
+    const Node* root_;
+    std::size_t size_;
+};
+
+/*
+  ---------------------------------------------------------
+  Begin implementations for the PersistentAVLTree iterator.
+  ---------------------------------------------------------
+*/
+
+/**
+* Constructs the end iterator.
+*/
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::const_iterator::const_iterator() : root_(nullptr)
+{
+
+}
+
+/**
+* Constructs an iterator with no current node yet, holding on to root.
+*/
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::const_iterator::const_iterator(const Node* root) : root_(PersistentAVLTree::acquire(root))
+{
+
+}
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::const_iterator::const_iterator(const const_iterator& other) :
+    root_(PersistentAVLTree::acquire(other.root_)),
+    path_(other.path_)
+{
+
+}
+
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator&
+PersistentAVLTree<Key, Value>::const_iterator::operator=(const const_iterator& other)
+{
+    if (this != &other) {
+        PersistentAVLTree::acquire(other.root_);
+        PersistentAVLTree::release(root_);
+        root_ = other.root_;
+        path_ = other.path_;
+    }
+    return *this;
+}
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::const_iterator::~const_iterator()
+{
+    PersistentAVLTree::release(root_);
+}
+
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator::reference
+PersistentAVLTree<Key, Value>::const_iterator::operator*() const
+{
+    return path_.back()->getItem();
+}
+
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator::pointer
+PersistentAVLTree<Key, Value>::const_iterator::operator->() const
+{
+    return &(path_.back()->getItem());
+}
+
+/**
+* Iterators are equal when both are past the end, or both are at the same node.
+*/
+template<class Key, class Value>
+bool PersistentAVLTree<Key, Value>::const_iterator::operator==(const const_iterator& rhs) const
+{
+    if (path_.empty() || rhs.path_.empty()) {
+        return path_.empty() && rhs.path_.empty();
+    }
+    return path_.back() == rhs.path_.back();
+}
+
+template<class Key, class Value>
+bool PersistentAVLTree<Key, Value>::const_iterator::operator!=(const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+/**
+* Moves to the next node in order. Without parent pointers, the path keeps
+* the ancestors whose items are still ahead: leftmost descent of the right
+* subtree if there is one, else the nearest such ancestor.
+* O(1) amortized, O(log n) worst case.
+*/
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator&
+PersistentAVLTree<Key, Value>::const_iterator::operator++()
+{
+    const Node* current = path_.back();
+    path_.pop_back();
+    for (const Node* node = current->getRight(); node != nullptr; node = node->getLeft()) {
+        path_.push_back(node);
+    }
+    if (path_.empty()) {
+        PersistentAVLTree::release(root_);
+        root_ = nullptr;
+    }
+    return *this;
+}
+
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator
+PersistentAVLTree<Key, Value>::const_iterator::operator++(int)
+{
+    const_iterator old(*this);
+    ++(*this);
+    return old;
+}
+
+/*
+  -------------------------------------------------------
+  End implementations for the PersistentAVLTree iterator.
+  -------------------------------------------------------
+*/
+
+/*
+  ------------------------------------------------------
+  Begin implementations for the PersistentAVLTree class.
+  ------------------------------------------------------
+*/
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::PersistentAVLTree() : root_(nullptr), size_(0)
+{
+
+}
+
+/**
+* Shares other's nodes, O(1).
+*/
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::PersistentAVLTree(const PersistentAVLTree& other) :
+    root_(acquire(other.root_)),
+    size_(other.size_)
+{
+
+}
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::PersistentAVLTree(PersistentAVLTree&& other) :
+    root_(other.root_),
+    size_(other.size_)
+{
+    other.root_ = nullptr;
+    other.size_ = 0;
+}
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>& PersistentAVLTree<Key, Value>::operator=(const PersistentAVLTree& other)
+{
+    if (this != &other) {
+        acquire(other.root_);
+        release(root_);
+        root_ = other.root_;
+        size_ = other.size_;
+    }
+    return *this;
+}
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>& PersistentAVLTree<Key, Value>::operator=(PersistentAVLTree&& other)
+{
+    if (this != &other) {
+        release(root_);
+        root_ = other.root_;
+        size_ = other.size_;
+        other.root_ = nullptr;
+        other.size_ = 0;
+    }
+    return *this;
+}
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value>::~PersistentAVLTree()
+{
+    release(root_);
+}
+
+/**
+* Copies the path down to the key's position, rebalancing the copies on the
+* way back up. Nodes off the path are shared with the previous version.
+*/
+template<class Key, class Value>
+void PersistentAVLTree<Key, Value>::insert(const std::pair<const Key, Value>& new_item)
+{
+    bool added = false;
+    const Node* root = insertBelow(root_, new_item, added);
+    release(root_);
+    root_ = root;
+    if (added) {
+        ++size_;
+    }
+}
+
+/**
+* Copies the path down to key, and to its successor if the key's node has
+* two children. Does nothing if the key is not present.
+*/
+template<class Key, class Value>
+void PersistentAVLTree<Key, Value>::remove(const Key& key)
+{
+    bool removed = false;
+    const Node* root = removeBelow(root_, key, removed);
+    release(root_);
+    root_ = root;
+    if (removed) {
+        --size_;
+    }
+}
+
+/**
+* Drops this version. Nodes still reached by other versions stay.
+*/
+template<class Key, class Value>
+void PersistentAVLTree<Key, Value>::clear()
+{
+    release(root_);
+    root_ = nullptr;
+    size_ = 0;
+}
+
+template<class Key, class Value>
+PersistentAVLTree<Key, Value> PersistentAVLTree<Key, Value>::snapshot() const
+{
+    return PersistentAVLTree(*this);
+}
+
+/**
+* Returns an iterator to the key's item, or end() if it is not present.
+*/
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator
+PersistentAVLTree<Key, Value>::find(const Key& key) const
+{
+    const_iterator it(root_);
+    const Node* node = root_;
+    while (node != nullptr) {
+        if (key < node->getKey()) {
+            //node comes after key, so it is still ahead when iterating on from key
+            it.path_.push_back(node);
+            node = node->getLeft();
+        }else if (node->getKey() < key) {
+            node = node->getRight();
+        }else {
+            it.path_.push_back(node);
+            return it;
+        }
+    }
+    return end();
+}
+
+template<class Key, class Value>
+const Value& PersistentAVLTree<Key, Value>::operator[](const Key& key) const
+{
+    const Node* node = root_;
+    while (node != nullptr) {
+        if (key < node->getKey()) {
+            node = node->getLeft();
+        }else if (node->getKey() < key) {
+            node = node->getRight();
+        }else {
+            return node->getValue();
+        }
+    }
+    throw std::out_of_range("Invalid key");
+}
+
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator
+PersistentAVLTree<Key, Value>::begin() const
+{
+    if (root_ == nullptr) {
+        return end();
+    }
+    const_iterator it(root_);
+    for (const Node* node = root_; node != nullptr; node = node->getLeft()) {
+        it.path_.push_back(node);
+    }
+    return it;
+}
+
+template<class Key, class Value>
+typename PersistentAVLTree<Key, Value>::const_iterator
+PersistentAVLTree<Key, Value>::end() const
+{
+    return const_iterator();
+}
+
+template<class Key, class Value>
+bool PersistentAVLTree<Key, Value>::empty() const
+{
+    return root_ == nullptr;
+}
+
+template<class Key, class Value>
+std::size_t PersistentAVLTree<Key, Value>::size() const
+{
+    return size_;
+}
+
+template<class Key, class Value>
+const typename PersistentAVLTree<Key, Value>::Node*
+PersistentAVLTree<Key, Value>::acquire(const Node* node)
+{
+    if (node != nullptr) {
+        node->refs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return node;
+}
+
+/**
+* Drops one reference to node, freeing it and releasing its children if it
+* was the last. The frees recurse only as deep as the tree is high.
+*/
+template<class Key, class Value>
+void PersistentAVLTree<Key, Value>::release(const Node* node)
+{
+    if (node == nullptr || node->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+        return;
+    }
+    release(node->getLeft());
+    release(node->getRight());
+    delete node;
+}
+
+template<class Key, class Value>
+int PersistentAVLTree<Key, Value>::height(const Node* node)
+{
+    return node == nullptr ? 0 : node->getHeight();
+}
+
+template<class Key, class Value>
+const typename PersistentAVLTree<Key, Value>::Node*
+PersistentAVLTree<Key, Value>::makeNode(const std::pair<const Key, Value>& item, const Node* left, const Node* right)
+{
+    try {
+        return new Node(item, left, right);
+    }
+    catch (...) {
+        release(left);
+        release(right);
+        throw;
+    }
+}
+
+/**
+* Builds a node for item over left and right, whose heights differ by at
+* most two, rotating if they differ by two. A rotation copies the child it
+* lifts, and the grandchild too for a double rotation, rather than
+* changing them in place, since other versions may share them.
+*/
+template<class Key, class Value>
+const typename PersistentAVLTree<Key, Value>::Node*
+PersistentAVLTree<Key, Value>::balance(const std::pair<const Key, Value>& item, const Node* left, const Node* right)
+{
+    if (height(left) > height(right) + 1) {
+        //lower is only ours to release until it is handed to the node above it
+        const Node* lower = nullptr;
+        const Node* top = nullptr;
+        try {
+            if (height(left->getLeft()) >= height(left->getRight())) {
+                //single rotation to the right
+                lower = makeNode(item, acquire(left->getRight()), right);
+                const Node* lowerRight = lower;
+                lower = nullptr;
+                top = makeNode(left->getItem(), acquire(left->getLeft()), lowerRight);
+            }else {
+                //double rotation, the left child's right child ends up on top
+                const Node* middle = left->getRight();
+                lower = makeNode(left->getItem(), acquire(left->getLeft()), acquire(middle->getLeft()));
+                const Node* lowerRight = makeNode(item, acquire(middle->getRight()), right);
+                const Node* lowerLeft = lower;
+                lower = nullptr;
+                top = makeNode(middle->getItem(), lowerLeft, lowerRight);
+            }
+        }
+        catch (...) {
+            release(lower);
+            release(left);
+            throw;
+        }
+        release(left);
+        return top;
+    }
+    if (height(right) > height(left) + 1) {
+        const Node* lower = nullptr;
+        const Node* top = nullptr;
+        try {
+            if (height(right->getRight()) >= height(right->getLeft())) {
+                //single rotation to the left
+                lower = makeNode(item, left, acquire(right->getLeft()));
+                const Node* lowerLeft = lower;
+                lower = nullptr;
+                top = makeNode(right->getItem(), lowerLeft, acquire(right->getRight()));
+            }else {
+                //double rotation, the right child's left child ends up on top
+                const Node* middle = right->getLeft();
+                lower = makeNode(item, left, acquire(middle->getLeft()));
+                const Node* lowerRight = makeNode(right->getItem(), acquire(middle->getRight()), acquire(right->getRight()));
+                const Node* lowerLeft = lower;
+                lower = nullptr;
+                top = makeNode(middle->getItem(), lowerLeft, lowerRight);
+            }
+        }
+        catch (...) {
+            release(lower);
+            release(right);
+            throw;
+        }
+        release(right);
+        return top;
+    }
+    return makeNode(item, left, right);
+}
+
+/**
+* Returns a copy of node's subtree with new_item in it. added is set iff
+* the key was not already present.
+*/
+template<class Key, class Value>
+const typename PersistentAVLTree<Key, Value>::Node*
+PersistentAVLTree<Key, Value>::insertBelow(const Node* node, const std::pair<const Key, Value>& new_item, bool& added)
+{
+    if (node == nullptr) {
+        added = true;
+        return makeNode(new_item, nullptr, nullptr);
+    }
+    if (new_item.first < node->getKey()) {
+        const Node* left = insertBelow(node->getLeft(), new_item, added);
+        return balance(node->getItem(), left, acquire(node->getRight()));
+    }else if (node->getKey() < new_item.first) {
+        const Node* right = insertBelow(node->getRight(), new_item, added);
+        return balance(node->getItem(), acquire(node->getLeft()), right);
+    }
+    return makeNode(new_item, acquire(node->getLeft()), acquire(node->getRight()));
+}
+
+/**
+* Returns a copy of node's subtree without key. removed is set iff the key
+* was present; if it was not, the subtree itself is returned, uncopied.
+*/
+template<class Key, class Value>
+const typename PersistentAVLTree<Key, Value>::Node*
+PersistentAVLTree<Key, Value>::removeBelow(const Node* node, const Key& key, bool& removed)
+{
+    if (node == nullptr) {
+        return nullptr;
+    }
+    if (key < node->getKey()) {
+        const Node* left = removeBelow(node->getLeft(), key, removed);
+        if (!removed) {
+            release(left);
+            return acquire(node);
+        }
+        return balance(node->getItem(), left, acquire(node->getRight()));
+    }else if (node->getKey() < key) {
+        const Node* right = removeBelow(node->getRight(), key, removed);
+        if (!removed) {
+            release(right);
+            return acquire(node);
+        }
+        return balance(node->getItem(), acquire(node->getLeft()), right);
+    }
+
+    removed = true;
+    if (node->getLeft() == nullptr) {
+        return acquire(node->getRight());
+    }
+    if (node->getRight() == nullptr) {
+        return acquire(node->getLeft());
+    }
+    //the successor's item takes the removed one's place
+    const Node* min = nullptr;
+    const Node* replaced = nullptr;
+    try {
+        const Node* right = removeMin(node->getRight(), min);
+        replaced = balance(min->getItem(), acquire(node->getLeft()), right);
+    }
+    catch (...) {
+        release(min);
+        throw;
+    }
+    release(min);
+    return replaced;
+}
+
+/**
+* Returns a copy of node's subtree without its smallest node, which is
+* handed back through min with a reference held for the caller.
+*/
+template<class Key, class Value>
+const typename PersistentAVLTree<Key, Value>::Node*
+PersistentAVLTree<Key, Value>::removeMin(const Node* node, const Node*& min)
+{
+    if (node->getLeft() == nullptr) {
+        min = acquire(node);
+        return acquire(node->getRight());
+    }
+    const Node* left = removeMin(node->getLeft(), min);
+    return balance(node->getItem(), left, acquire(node->getRight()));
+}
+
+/*
+  ----------------------------------------------------
+  End implementations for the PersistentAVLTree class.
+  ----------------------------------------------------
+*/
+
+#endif
@@ -24,8 +24,8 @@
 // 1 means that it is the root.
 // Returns -1 (not found) if the distance is more than PPBST_MAX_HEIGHT,
 // or -2 if the tree is inconsistent.
-template<typename Key, typename Value>
-int getNodeDepth(BinarySearchTree<Key, Value> const & tree, Node<Key, Value> * root, Node<Key, Value> * node)
+template<typename Key, typename Value, typename Compare>
+int getNodeDepth(BinarySearchTree<Key, Value, Compare> const & tree, Node<Key, Value> * root, Node<Key, Value> * node)
 {
     int dist = 1;
 
@@ -99,17 +99,17 @@ int getSubtreeHeight(Node<Key, Value> * root, int recursionDepth = 1)
 
     */
 
-template <typename Key, typename Value>
-void BinarySearchTree<Key, Value>::print_placeholders(std::ios::fmtflags origCoutState, std::map<Key, uint8_t> valuePlaceholders) const {
+template <typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::print_placeholders(std::ios::fmtflags origCoutState, std::map<Key, uint8_t, Compare> valuePlaceholders) const {
     std::cout << "Tree Placeholders:------------------" << std::endl;
-    for(typename std::map<Key, uint8_t>::iterator placeholdersIter = valuePlaceholders.begin(); placeholdersIter != valuePlaceholders.end(); ++placeholdersIter) {
+    for(typename std::map<Key, uint8_t, Compare>::iterator placeholdersIter = valuePlaceholders.begin(); placeholdersIter != valuePlaceholders.end(); ++placeholdersIter) {
         std::cout << '[' << std::setfill('0') << std::setw(2) << ((uint16_t)placeholdersIter->second) << "] -> ";
 
         // print element with original cout flags
         std::cout.flags(origCoutState);
         std::cout << '(' << placeholdersIter->first << ", ";
 
-        typename BinarySearchTree<Key, Value>::iterator elementIter = this->find(placeholdersIter->first);
+        typename BinarySearchTree<Key, Value, Compare>::const_iterator elementIter = this->find(placeholdersIter->first);
         if(elementIter == this->end())
         {
             std::cout << "<error: lookup failed>";
@@ -133,8 +133,8 @@ void BinarySearchTree<Key, Value>::print_placeholders(std::ios::fmtflags origCou
     }
 }
 
-template<typename Key, typename Value>
-void BinarySearchTree<Key, Value>::printRoot (Node<Key, Value>* root) const
+template<typename Key, typename Value, typename Compare>
+void BinarySearchTree<Key, Value, Compare>::printRoot (Node<Key, Value>* root) const
 {
     // special case for empty trees:
     if(root == nullptr)
@@ -168,10 +168,10 @@ void BinarySearchTree<Key, Value>::printRoot (Node<Key, Value>* root) const
 
     // get placeholders
     // ----------------------------------------------------------------------
-    std::map<Key, uint8_t> valuePlaceholders;
+    std::map<Key, uint8_t, Compare> valuePlaceholders;
 
     uint8_t nextPlaceHolderVal = 1;
-    for(typename BinarySearchTree<Key, Value>::iterator treeIter = this->begin(); treeIter != this->end(); ++treeIter)
+    for(typename BinarySearchTree<Key, Value, Compare>::const_iterator treeIter = this->begin(); treeIter != this->end(); ++treeIter)
     {
 
         if(getNodeDepth(*this, root, treeIter.current_) != -1)
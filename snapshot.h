@@ -0,0 +1,282 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bst.h"
+#include "frozen_map.h"
+
+/**
+* Snapshot files of a FrozenMap's two arrays, written with mmap and renamed
+* into place, and mapped back read-only to be queried where they lie.
+* Kept apart from bst.h and frozen_map.h as it needs POSIX.
+*
+* A file holds a header, then the keys and the values in Eytzinger order,
+* each 64-byte aligned. It is in the host's byte order and only readable
+* by the same Key and Value types, which must be trivially copyable.
+*/
+class Snapshot
+{
+public:
+    // Saving replaces the file whole, so maps loaded from it stay valid.
+    template<class Key, class Value, class Compare>
+    static void save(const std::string& path, const FrozenMap<Key, Value, Compare>& map);
+    template<class Key, class Value, class Compare>
+    static void save(const std::string& path, const BinarySearchTree<Key, Value, Compare>& tree);
+    // Writes the n pairs of [first, ...), which must be sorted by strictly
+    // increasing key, without building a map first.
+    template<class Key, class Value, class InputIt>
+    static void save_sorted(const std::string& path, InputIt first, std::size_t n);
+
+    // Maps a snapshot read-only; pages are read in as lookups touch them.
+    // Throws std::runtime_error if the file is not a snapshot of this Key
+    // and Value, or, when verify is set, if its checksum does not match.
+    // The keys must have been sorted by an ordering equal to compare.
+    template<class Key, class Value, class Compare = std::less<Key> >
+    static FrozenMap<Key, Value, Compare> load(const std::string& path, bool verify = true, const Compare& compare = Compare());
+    // Replaces the tree's contents, rebuilding it balanced in O(n) without
+    // comparing keys. Throws as the other load(), leaving the tree as it was.
+    template<class Key, class Value, class Compare>
+    static void load(const std::string& path, BinarySearchTree<Key, Value, Compare>& tree, bool verify = true);
+
+    static const std::uint32_t VERSION = 1;
+
+protected:
+    struct Header
+    {
+        char magic[8];
+        std::uint32_t version;
+        // 0x01020304 as the writer stored it
+        std::uint32_t byteOrder;
+        std::uint32_t keySize;
+        std::uint32_t valueSize;
+        std::uint64_t count;
+        std::uint64_t valuesOffset;
+        // over the key bytes, then the value bytes
+        std::uint64_t checksum;
+    };
+
+    // where the keys start, and the alignment of both arrays
+    static const std::size_t ALIGN = 64;
+
+    template<class Key>
+    static std::size_t valuesOffset(std::size_t n);
+    static std::uint64_t checksum(const void* data, std::size_t bytes, std::uint64_t hash);
+};
+
+/*
+  ---------------------------------------------
+  Begin implementations for the Snapshot class.
+  ---------------------------------------------
+*/
+
+template<class Key, class Value, class Compare>
+void Snapshot::save(const std::string& path, const FrozenMap<Key, Value, Compare>& map)
+{
+    save_sorted<Key, Value>(path, map.begin(), map.size());
+}
+
+template<class Key, class Value, class Compare>
+void Snapshot::save(const std::string& path, const BinarySearchTree<Key, Value, Compare>& tree)
+{
+    save_sorted<Key, Value>(path, tree.begin(), tree.size());
+}
+
+/**
+* Writes a temporary file next to path, mapped and filled in place: the
+* i-th pair goes to the i-th index of an in-order walk of the implicit
+* tree, as FrozenMap's constructor does, so nothing is buffered. Once the
+* file is synced it is renamed over path, so a map still loaded from path
+* keeps reading the old file, and a crash part way leaves path as it was.
+* O(n).
+*/
+template<class Key, class Value, class InputIt>
+void Snapshot::save_sorted(const std::string& path, InputIt first, std::size_t n)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+        "snapshots need trivially copyable keys and values");
+
+    const std::size_t valuesStart = valuesOffset<Key>(n);
+    const std::size_t bytes = valuesStart + n * sizeof(Value);
+
+    std::vector<char> tempPath(path.begin(), path.end());
+    const char suffix[] = ".XXXXXX";
+    tempPath.insert(tempPath.end(), suffix, suffix + sizeof(suffix));
+    int fd = ::mkstemp(tempPath.data());
+    if (fd < 0) {
+        throw std::runtime_error("Cannot create snapshot " + path);
+    }
+    // drops the temporary file unless it was renamed into place
+    std::shared_ptr<int> file(&fd, [&tempPath](int* descriptor) {
+        if (*descriptor >= 0) {
+            ::close(*descriptor);
+            ::unlink(tempPath.data());
+        }
+    });
+
+    // a fresh file reads as zeros, padding included
+    void* base = MAP_FAILED;
+    if (::fchmod(fd, 0644) == 0 && ::ftruncate(fd, bytes) == 0) {
+        base = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Cannot write snapshot " + path);
+    }
+    std::shared_ptr<void> mapping(base, [bytes](void* p) { ::munmap(p, bytes); });
+
+    unsigned char* keys = static_cast<unsigned char*>(base) + ALIGN;
+    unsigned char* values = static_cast<unsigned char*>(base) + valuesStart;
+    for (std::size_t k = FrozenMap<Key, Value>::firstIndex(n); k != 0; k = FrozenMap<Key, Value>::nextIndex(k, n), ++first) {
+        std::memcpy(keys + (k - 1) * sizeof(Key), &(*first).first, sizeof(Key));
+        std::memcpy(values + (k - 1) * sizeof(Value), &(*first).second, sizeof(Value));
+    }
+
+    Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "BSTSNAP", sizeof(header.magic));
+    header.version = VERSION;
+    header.byteOrder = 0x01020304;
+    header.keySize = sizeof(Key);
+    header.valueSize = sizeof(Value);
+    header.count = n;
+    header.valuesOffset = valuesStart;
+    header.checksum = checksum(values, n * sizeof(Value), checksum(keys, n * sizeof(Key), 0xcbf29ce484222325ULL));
+    std::memcpy(base, &header, sizeof(header));
+
+    if (::msync(base, bytes, MS_SYNC) != 0 || ::fsync(fd) != 0
+            || ::rename(tempPath.data(), path.c_str()) != 0) {
+        throw std::runtime_error("Cannot write snapshot " + path);
+    }
+    ::close(fd);
+    fd = -1;
+}
+
+/**
+* Checks the header against Key, Value and the file's size, then points
+* the map straight into the mapping, which lives as long as the map or
+* any copy of it. O(1), or O(n) with verify to checksum the file.
+*/
+template<class Key, class Value, class Compare>
+FrozenMap<Key, Value, Compare> Snapshot::load(const std::string& path, bool verify, const Compare& compare)
+{
+    static_assert(std::is_trivially_copyable<Key>::value && std::is_trivially_copyable<Value>::value,
+        "snapshots need trivially copyable keys and values");
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Cannot open snapshot " + path);
+    }
+    struct stat status;
+    if (::fstat(fd, &status) != 0 || static_cast<std::size_t>(status.st_size) < ALIGN) {
+        ::close(fd);
+        throw std::runtime_error("Not a snapshot: " + path);
+    }
+    const std::size_t bytes = status.st_size;
+    void* base = ::mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        throw std::runtime_error("Cannot map snapshot " + path);
+    }
+    std::shared_ptr<const void> mapping(base, [bytes](const void* p) { ::munmap(const_cast<void*>(p), bytes); });
+
+    Header header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, "BSTSNAP", sizeof(header.magic)) != 0 || header.version != VERSION) {
+        throw std::runtime_error("Not a snapshot: " + path);
+    }
+    if (header.byteOrder != 0x01020304 || header.keySize != sizeof(Key) || header.valueSize != sizeof(Value)) {
+        throw std::runtime_error("Snapshot of other key or value types: " + path);
+    }
+    // the count is checked against the size first, so the offsets cannot overflow
+    if (header.count > bytes / sizeof(Key) || header.valuesOffset != valuesOffset<Key>(header.count)
+            || bytes != header.valuesOffset + header.count * sizeof(Value)) {
+        throw std::runtime_error("Truncated snapshot: " + path);
+    }
+
+    const unsigned char* keys = static_cast<const unsigned char*>(base) + ALIGN;
+    const unsigned char* values = static_cast<const unsigned char*>(base) + header.valuesOffset;
+    if (verify) {
+        std::uint64_t sum = checksum(keys, header.count * sizeof(Key), 0xcbf29ce484222325ULL);
+        if (checksum(values, header.count * sizeof(Value), sum) != header.checksum) {
+            throw std::runtime_error("Snapshot checksum mismatch: " + path);
+        }
+    }
+
+    FrozenMap<Key, Value, Compare> map;
+    map.keys_ = reinterpret_cast<const Key*>(keys);
+    map.values_ = reinterpret_cast<const Value*>(values);
+    map.size_ = header.count;
+    map.storage_ = mapping;
+    map.compare_ = compare;
+    return map;
+}
+
+/**
+* Maps the snapshot and builds the tree straight from its in-order walk,
+* which is already sorted, so no key is compared. Only the pages of the
+* file are read, never copied to the heap first.
+*/
+template<class Key, class Value, class Compare>
+void Snapshot::load(const std::string& path, BinarySearchTree<Key, Value, Compare>& tree, bool verify)
+{
+    FrozenMap<Key, Value, Compare> snapshot = load<Key, Value, Compare>(path, verify, tree.compare_);
+    typename FrozenMap<Key, Value, Compare>::const_iterator it = snapshot.begin();
+
+    tree.clear();
+    tree.buildTree(it, snapshot.size());
+}
+
+/**
+* Where the values of a snapshot of n pairs start: past the header's
+* line and the keys, rounded up to the next line.
+*/
+template<class Key>
+std::size_t Snapshot::valuesOffset(std::size_t n)
+{
+    const std::size_t keysEnd = ALIGN + n * sizeof(Key);
+    return (keysEnd + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+/**
+* Folds bytes into hash eight at a time, FNV style with an extra shift to
+* mix the high bits down. Catches truncation and corruption, not tampering.
+*/
+inline std::uint64_t Snapshot::checksum(const void* data, std::size_t bytes, std::uint64_t hash)
+{
+    const std::uint64_t prime = 0x100000001b3ULL;
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    for (; bytes >= sizeof(std::uint64_t); p += sizeof(std::uint64_t), bytes -= sizeof(std::uint64_t)) {
+        std::uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 32;
+    }
+    if (bytes > 0) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, p, bytes);
+        hash = (hash ^ word) * prime;
+        hash ^= hash >> 32;
+    }
+    return hash;
+}
+
+/*
+  -------------------------------------------
+  End implementations for the Snapshot class.
+  -------------------------------------------
+*/
+
+#endif